@@ -17,22 +17,77 @@
 // safe.
 //
 ////===----------------------------------------------------------------------===//
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/ADT/SCCIterator.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Analysis/AliasAnalysis.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/CFG.h"
 #include "llvm/Analysis/BlockFrequencyInfo.h"
 #include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/CallGraph.h"
+#include "llvm/Analysis/DomTreeUpdater.h"
+#include "llvm/Analysis/LoopAccessAnalysis.h"
 #include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/LoopIterator.h"
 #include "llvm/Analysis/LoopPass.h"
+#include "llvm/Analysis/MemorySSA.h"
+#include "llvm/Analysis/MustExecute.h"
+#include "llvm/Analysis/OptimizationRemarkEmitter.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Analysis/VectorUtils.h"
+#include "llvm/CodeGen/MachineBlockFrequencyInfo.h"
+#include "llvm/CodeGen/MachineBranchProbabilityInfo.h"
+#include "llvm/CodeGen/MachineFunctionPass.h"
+#include "llvm/CodeGen/MachineLoopInfo.h"
+#include "llvm/CodeGen/MachineModuleInfo.h"
+#include "llvm/CodeGen/MachineTraceMetrics.h"
+#include "llvm/CodeGen/TargetPassConfig.h"
 #include "llvm/IR/CFG.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
 #include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Dominators.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/MC/TargetRegistry.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/PassPlugin.h"
+#include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/Scalar/LoopPassManager.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 #include "llvm/Transforms/Utils/LoopUtils.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
 #include "llvm/Analysis/Trace.h"
 #include "llvm/Analysis/PostDominators.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/ProfileData/SampleProfReader.h"
+#include "llvm/Transforms/IPO/SampleProfile.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/CodeExtractor.h"
+#include "llvm/Transforms/Utils/SSAUpdater.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
 
 /* *******Implementation Starts Here******* */
 // include necessary header files
@@ -42,6 +97,8 @@
 #include <vector>
 #include <deque>
 #include <cassert>
+#include <cstring>
+#include <mutex>
 /* *******Implementation Ends Here******* */
 
 using namespace llvm;
@@ -49,6 +106,270 @@ using namespace std;
 
 #define DEBUG_TYPE "fplicm"
 
+// Superblock formation: tail duplicate the side entrances of every trace and
+// merge the resulting single-entry chains. Budgets are in percent of the
+// original instruction count.
+static cl::opt<bool> FormSuperblocks(
+    "form-superblocks", cl::init(false),
+    cl::desc("Tail duplicate traces into single-entry superblocks"));
+static cl::opt<unsigned> SBFuncGrowth(
+    "sb-func-growth", cl::init(50),
+    cl::desc("Max code growth per function from tail duplication (percent)"));
+static cl::opt<unsigned> SBModuleGrowth(
+    "sb-module-growth", cl::init(25),
+    cl::desc("Max code growth per module from tail duplication (percent)"));
+
+// Trace-driven layout: every trace becomes one contiguous run of blocks, hot
+// traces first. Cold traces are moved to the end of the function or split
+// out into functions placed in .text.unlikely.
+static cl::opt<bool> TraceLayout(
+    "trace-layout", cl::init(false),
+    cl::desc("Lay out blocks trace by trace in decreasing frequency"));
+static cl::opt<bool> SplitColdTraces(
+    "split-cold-traces", cl::init(false),
+    cl::desc("Extract cold traces into functions in .text.unlikely"));
+static cl::opt<unsigned> ColdTracePercent(
+    "cold-trace-percent", cl::init(1),
+    cl::desc("A trace entered less often than this percent of the function "
+             "entry is cold"));
+static cl::opt<bool> StaticBranchWeights(
+    "static-branch-weights", cl::init(false),
+    cl::desc("Attach !prof branch_weights from the static predictor"));
+static cl::opt<bool> OverwriteBranchWeights(
+    "static-branch-weights-overwrite", cl::init(false),
+    cl::desc("Replace existing !prof metadata with static branch weights"));
+static cl::opt<unsigned> ColdSplitMinInstrs(
+    "cold-split-min-instrs", cl::init(8),
+    cl::desc("Min size of a cold trace worth extracting"));
+
+// Alias-driven hazards: an ambiguous store only ends a trace if MemorySSA
+// finds a load that may read the location it writes.
+static cl::opt<bool> AliasHazards(
+    "alias-hazards", cl::init(false),
+    cl::desc("Use MemorySSA to drop store hazards no load may observe"));
+
+// Interprocedural hazards: a call is not a hazard if the callee's summary
+// shows it returns normally and at most reads memory or writes the caller's
+// stack slots it is passed.
+static cl::opt<bool> UseCallSummaries(
+    "call-summaries", cl::init(false),
+    cl::desc("Let traces grow across calls with harmless side effects"));
+
+// Path profiling: -path-profile-instr numbers the acyclic paths of each
+// function and counts them at run time; -path-profile-file reads the counts
+// back for trace selection and the trace report.
+static cl::opt<unsigned> PathProfileMaxPaths(
+    "path-profile-max-paths", cl::init(65536),
+    cl::desc("Do not path profile functions with more acyclic paths"));
+static cl::opt<std::string> PathProfileFile(
+    "path-profile-file", cl::init(""),
+    cl::desc("Path and trace counts written by the profiling runtime"));
+
+// Sample profiles: -trace-sample-profile reads a sample profile, in LLVM's
+// text or binary format, into branch weights and entry counts before the
+// trace passes run. Samples map to blocks by debug line. Blocks without
+// samples get counts from the loader's propagation, or, with
+// -sample-profile-use-profi given, from profile inference, which keeps the
+// counts flow consistent. Functions without samples, and every function if
+// the profile cannot be read, keep the static estimates.
+static cl::opt<std::string> TraceSampleProfile(
+    "trace-sample-profile", cl::init(""),
+    cl::desc("Sample profile to select traces by"));
+
+// Trace accuracy: -trace-exit-instr counts, for every trace formed, the
+// entries into its head and the exits off it before its last block. With
+// the counts read back through -path-profile-file, the report shows the
+// measured fall through next to the predicted one.
+static cl::opt<bool> TraceExitInstr(
+    "trace-exit-instr", cl::init(false),
+    cl::desc("Instrument trace entries and early exits instead of transforming"));
+
+// Hyperblocks: if-convert short hazard-free diamonds and triangles into
+// selects before traces are formed, where executing both sides is cheaper
+// than the expected cost of the branch, mispredictions included. Costs are
+// in instructions.
+static cl::opt<bool> Hyperblocks(
+    "hyperblocks", cl::init(false),
+    cl::desc("If-convert short branches so traces run through both sides"));
+static cl::opt<unsigned> HyperblockMaxInstrs(
+    "hyperblock-max-instrs", cl::init(6),
+    cl::desc("Max instructions on a side of an if-converted branch"));
+static cl::opt<unsigned> MispredictPenalty(
+    "hyperblock-mispredict-penalty", cl::init(12),
+    cl::desc("Cost of a mispredicted branch"));
+
+// Multi-way branches: peel the dominant case of a switch or indirectbr into
+// a compare and branch in front of it, so a trace continues through the hot
+// case. Static prediction scores the cases on its own; with a profile the
+// dominant case is the profiled one.
+static cl::opt<bool> PeelCases(
+    "peel-dominant-cases", cl::init(false),
+    cl::desc("Peel the dominant case of switches and indirect branches"));
+static cl::opt<unsigned> DominantCasePercent(
+    "dominant-case-percent", cl::init(50),
+    cl::desc("Min probability of a case worth peeling (percent)"));
+
+// Superblock enlargement: unroll hot superblock loops along their trace, peel
+// the ones that average few trips, and copy the superblock a trace runs into
+// onto its end. Hot superblocks get the growth budget first.
+static cl::opt<bool> EnlargeSuperblocks(
+    "enlarge-superblocks", cl::init(false),
+    cl::desc("Unroll, peel and target expand superblocks"));
+static cl::opt<unsigned> SBUnrollFactor(
+    "sb-unroll-factor", cl::init(4),
+    cl::desc("Copies of the body in an unrolled superblock loop"));
+static cl::opt<unsigned> SBPeelMaxTrips(
+    "sb-peel-max-trips", cl::init(2),
+    cl::desc("Peel superblock loops averaging at most this many trips"));
+static cl::opt<unsigned> SBEnlargeGrowth(
+    "sb-enlarge-growth", cl::init(100),
+    cl::desc("Max code growth per function from enlargement (percent)"));
+
+// Superblock scheduling: list schedule every single-entry stretch of a trace
+// across its side exits, with latencies from the target's cost model and a
+// machine issuing sb-sched-width instructions per cycle.
+static cl::opt<bool> ScheduleSuperblocks(
+    "schedule-superblocks", cl::init(false),
+    cl::desc("List schedule superblocks with speculation and compensation code"));
+static cl::opt<unsigned> SchedWidth(
+    "sb-sched-width", cl::init(4),
+    cl::desc("Instructions the scheduler may issue per cycle"));
+static cl::opt<unsigned> SchedMaxInstrs(
+    "sb-sched-max-instrs", cl::init(512),
+    cl::desc("Max instructions in one scheduling region"));
+
+// Superblock vectorization: SLP pack the stores to consecutive addresses of
+// every single-entry stretch of a hot trace, and the arithmetic and loads
+// feeding them, across its side exits. Packing must pay off by the target's
+// cost model; stores from before a side exit are kept, scalar, on the exit.
+static cl::opt<bool> VectorizeSuperblocks(
+    "vectorize-superblocks", cl::init(false),
+    cl::desc("SLP vectorize superblocks across their block boundaries"));
+static cl::opt<unsigned> VectorMaxInstrs(
+    "sb-vector-max-instrs", cl::init(512),
+    cl::desc("Max instructions in one vectorization region"));
+
+// Trace cache: the traces of a function, and the predictions they were grown
+// from, kept in a file across runs. A function is looked up by a hash of its
+// IR, hazards and profile, and the options trace formation depends on; a hit
+// skips prediction and trace growth.
+static cl::opt<std::string> TraceCacheFile(
+    "trace-cache", cl::init(""),
+    cl::desc("File caching trace formation results across runs"));
+
+// Trace metrics: per trace and per function, as optimization remarks of
+// trace-formation (-pass-remarks-analysis, -pass-remarks-output) and as one
+// JSON summary of every function run on.
+static cl::opt<std::string> TraceStatsJson(
+    "trace-stats-json", cl::init(""),
+    cl::desc("File for a JSON summary of the traces of every function"));
+static const char TraceRemarkPass[] = "trace-formation";
+
+// New pass manager: -passes=<name> runs a pass by its legacy name, and
+// -trace-pipeline-pass adds one to the end of the optimization pipeline, so
+// it runs in clang -O2 -fpass-plugin builds.
+static cl::opt<std::string> TracePipelinePass(
+    "trace-pipeline-pass", cl::init(""),
+    cl::desc("Trace pass to run at the end of the optimization pipeline"));
+
+// Tuning: the probability a trace continues to a successor at, and the hit
+// rates of the static heuristics, from a JSON file as sb-trace-driver -tune
+// writes it: {"threshold": 0.6, "hitRates": {"loop branch": 0.88, ...}}.
+// -trace-threshold and -heuristic-hit-rate take precedence over the file.
+static cl::opt<std::string> TraceConfigFile(
+    "trace-config", cl::init(""),
+    cl::desc("JSON file with the trace threshold and heuristic hit rates"));
+static cl::opt<double> TraceThreshold(
+    "trace-threshold", cl::init(0.6),
+    cl::desc("Min probability of the successor a trace continues to"));
+static cl::list<std::string> HeuristicHitRates(
+    "heuristic-hit-rate", cl::CommaSeparated,
+    cl::desc("name=rate of a static heuristic, e.g. loop-branch=0.9"));
+
+// Cycle estimates: lower the function before and after the trace transforms
+// and measure every trace, as a machine trace along the trace's blocks, with
+// MachineTraceMetrics and the target's scheduling model. Traces are reported
+// ranked by the cycles they save per function entry.
+static cl::opt<bool> TraceCycleEval(
+    "trace-cycle-eval", cl::init(false),
+    cl::desc("Estimate the cycles of every trace before and after the transforms"));
+static cl::opt<std::string> TraceCycleCPU(
+    "trace-cycle-cpu", cl::init(""),
+    cl::desc("CPU whose scheduling model to use where the IR names none "
+             "(default: the host)"));
+
+// Where the passes report. A driver running functions on several threads
+// gives each thread a stream of its own through HW2SetReportStream.
+static thread_local raw_ostream *ReportStream = nullptr;
+
+raw_ostream &report() {
+  return ReportStream ? *ReportStream : errs();
+}
+
+extern "C" void HW2SetReportStream(raw_ostream *OS) {
+  ReportStream = OS;
+}
+
+// The function summaries for -trace-stats-json, by module and function, from
+// every trace pass of the process. Each pass writes them all when done, so
+// the file holds every function whichever finishes last.
+static std::mutex TraceStatsLock;
+static std::map<std::pair<std::string, std::string>, json::Value> TraceStats;
+
+void AddTraceStats(Function &F, json::Value stats) {
+  std::lock_guard<std::mutex> lock(TraceStatsLock);
+  std::pair<std::string, std::string> key(F.getParent()->getModuleIdentifier(), F.getName().str());
+  TraceStats.erase(key);
+  TraceStats.emplace(std::move(key), std::move(stats));
+}
+
+void WriteTraceStats() {
+  std::lock_guard<std::mutex> lock(TraceStatsLock);
+  std::error_code EC;
+  raw_fd_ostream OS(TraceStatsJson, EC, sys::fs::OF_Text);
+  if (EC) {
+    report() << "cannot write " << TraceStatsJson << ": " << EC.message() << '\n';
+    return;
+  }
+  json::OStream J(OS, 2);
+  J.object([&] {
+    J.attribute("version", 1);
+    J.attributeArray("functions", [&] {
+      for (auto &entry : TraceStats) J.value(entry.second);
+    });
+  });
+  OS << '\n';
+}
+
+// Totals of the trace evaluation over every function run on since the last
+// HW2TakeTraceTotals, for sb-trace-driver -tune to score a configuration by.
+// Entries and blocks are weighted by how often a trace is entered.
+struct TraceTotals {
+  double entries = 0, completed = 0, blocks = 0;
+  uint64_t traces = 0, hazards = 0;
+};
+static std::mutex TraceTotalsLock;
+static TraceTotals Totals;
+
+void AddTraceTotals(const TraceTotals &T) {
+  std::lock_guard<std::mutex> lock(TraceTotalsLock);
+  Totals.entries += T.entries;
+  Totals.completed += T.completed;
+  Totals.blocks += T.blocks;
+  Totals.traces += T.traces;
+  Totals.hazards += T.hazards;
+}
+
+extern "C" void HW2TakeTraceTotals(raw_ostream *OS) {
+  std::lock_guard<std::mutex> lock(TraceTotalsLock);
+  *OS << json::Value(json::Object{{"entries", Totals.entries},
+                                  {"completed", Totals.completed},
+                                  {"blocks", Totals.blocks},
+                                  {"traces", int64_t(Totals.traces)},
+                                  {"hazards", int64_t(Totals.hazards)}});
+  Totals = TraceTotals();
+}
+
 // Recursively finds all subloops in a loop
 std::vector<Loop*> GetAllSubLoops(Loop* L) {
   std::vector<Loop*> allLoops;
@@ -74,162 +395,3144 @@ bool CompareLoopDepth(Loop* L1, Loop* L2) {
     return L1->getLoopDepth() > L2->getLoopDepth();
 }
 
-    bool containHazard(BasicBlock* bb) {
-    //   errs()<<"Processing containHazard for block "<<bb->getName()<<'\n';
-      for (BasicBlock::iterator i = bb->begin(), e = bb->end(); i != e; ++i) {
-          string op = i->getOpcodeName();
-          if (op=="call") // subroutine call
-            return true;
-          if (i->isAtomic()) // sync instr
-            return true;
-          if (op=="store") { // ambiguous store
-            Value *oper = i->getOperand(1); // get the store destination
-            if (Instruction *stdestInstr = dyn_cast<Instruction>(oper)) {
-                string stdestOp = stdestInstr->getOpcodeName();
-                // errs()<<"store destination instr: "<< stdestOp<<'\n';
-                if (stdestOp=="alloca") {
-                    // errs()<<"not hazard"<<'\n';
-                    continue; // known at compile time
-                }
-                if (GetElementPtrInst *GEPInstr = dyn_cast<GetElementPtrInst>(stdestInstr)) {
-                    if (GEPInstr->hasAllConstantIndices()) {
-                        if (Instruction *ptrInstr = dyn_cast<Instruction>(GEPInstr->getPointerOperand())) {
-                            string ptrOp = ptrInstr->getOpcodeName();
-                            if (ptrOp=="alloca") {
-                                // errs()<<"not hazard"<<'\n';
-                                continue; // known at compile time
-                            }
-                        }
-                    }
-                }
-                return true; // otherwise unknown at compile time
-              }
+// Returns true if an instruction may read what SI writes. Readers hang off
+// any def on the way from SI, not only off SI: MemorySSA need not have
+// optimized a use to its nearest clobber, and defs such as calls or
+// memcpy read memory too. So follow every def and phi downstream of SI,
+// asking alias analysis at each access, up to a store that overwrites all
+// of SI's location.
+bool storeMayBeRead(StoreInst *SI, MemorySSA &MSSA, AAResults &AA) {
+  MemoryAccess *def = MSSA.getMemoryAccess(SI);
+  if (!def) return true;
+  MemoryLocation storeLoc = MemoryLocation::get(SI);
+  SmallVector<MemoryAccess*, 8> worklist(1, def);
+  SmallPtrSet<MemoryAccess*, 16> seen;
+  seen.insert(def);
+  while (!worklist.empty()) {
+    MemoryAccess *MA = worklist.pop_back_val();
+    for (User *U : MA->users()) {
+      MemoryAccess *next = cast<MemoryAccess>(U);
+      if (MemoryUseOrDef *access = dyn_cast<MemoryUseOrDef>(next)) {
+        Instruction *I = access->getMemoryInst();
+        if (isRefSet(AA.getModRefInfo(I, storeLoc))) return true;
+        if (StoreInst *kill = dyn_cast<StoreInst>(I)) {
+          MemoryLocation killLoc = MemoryLocation::get(kill);
+          if (killLoc.Size.hasValue() && storeLoc.Size.hasValue() &&
+              killLoc.Size.getValue() >= storeLoc.Size.getValue() &&
+              AA.isMustAlias(storeLoc, killLoc))
+            continue;
+        }
+      }
+      if (!isa<MemoryUse>(next) && seen.insert(next).second) worklist.push_back(next);
+    }
+  }
+  return false;
+}
+
+namespace CallSummary {
+  // What a call to a function may do, from least to most harmful to a trace.
+  enum Effect {
+    Pure,       // touches no memory
+    ReadOnly,   // only reads memory
+    WritesArgs, // only writes memory its pointer arguments point to
+    Unknown     // anything else
+  };
+  static const char *EffectName[] = {"pure", "read only", "writes args", "unknown"};
+
+  struct Summary {
+    Effect effect = Pure;
+    bool mayUnwind = false;
+    bool operator!=(const Summary &O) const {
+      return effect != O.effect || mayUnwind != O.mayUnwind;
+    }
+  };
+
+  // Side-effect summary of every function in the module, computed bottom-up
+  // over the call graph. Bodies are scanned, declarations and intrinsics are
+  // classified from their attributes.
+  struct CallSummaryInfo {
+    void analyze(CallGraph &CG) {
+      summaries.clear();
+      // callees come before their callers; recursive functions start pure
+      // and are rescanned until their summaries stop growing
+      for (scc_iterator<CallGraph*> I = scc_begin(&CG); !I.isAtEnd(); ++I) {
+        std::vector<Function*> scc;
+        for (CallGraphNode *N : *I)
+          if (Function *F = N->getFunction()) {
+            summaries[F] = Summary();
+            scc.push_back(F);
+          }
+        bool changed = true;
+        while (changed) {
+          changed = false;
+          for (Function *F : scc) {
+            Summary S = summarize(*F);
+            if (S != summaries[F]) {
+              summaries[F] = S;
+              changed = true;
+            }
+          }
+        }
+      }
+      unsigned counts[Unknown + 1] = {0}, unwind = 0;
+      for (auto &FS : summaries) {
+        if (FS.first->isDeclaration()) continue;
+        counts[FS.second.effect]++;
+        if (FS.second.mayUnwind) unwind++;
+      }
+      report() << "call summaries:";
+      for (unsigned e = Pure; e <= Unknown; ++e) report() << ' ' << EffectName[e] << ' ' << counts[e] << ',';
+      report() << " may unwind " << unwind << "\n\n";
+    }
+
+    // A call a trace can grow across: it returns normally, and at most
+    // reads memory or writes the stack slots it is passed.
+    bool isSafeCall(const CallBase &CB) const {
+      const Function *callee = CB.getCalledFunction();
+      if (!callee || CB.doesNotReturn() || CB.hasFnAttr(Attribute::ReturnsTwice)) return false;
+      Summary S = lookup(*callee);
+      if (S.mayUnwind && !CB.doesNotThrow()) return false;
+      if (S.effect == WritesArgs) {
+        for (const Value *arg : CB.args())
+          if (arg->getType()->isPointerTy() && !isa<AllocaInst>(getUnderlyingObject(arg)))
+            return false;
+        return true;
+      }
+      return S.effect != Unknown;
+    }
+
+    private:
+    DenseMap<const Function*, Summary> summaries;
+
+    Summary lookup(const Function &F) const {
+      auto it = summaries.find(&F);
+      if (it != summaries.end()) return it->second;
+      return fromAttributes(F); // created after the analysis ran
+    }
+
+    static Summary fromAttributes(const Function &F) {
+      Summary S;
+      if (F.doesNotAccessMemory()) S.effect = Pure;
+      else if (F.onlyReadsMemory()) S.effect = ReadOnly;
+      else if (F.onlyAccessesArgMemory()) S.effect = WritesArgs;
+      else S.effect = Unknown;
+      S.mayUnwind = !F.doesNotThrow();
+      return S;
+    }
+
+    // Effect of a read (ReadOnly) or write (WritesArgs) through ptr. Stack
+    // slots of the function are private to it, and a write anywhere but an
+    // argument's memory is Unknown.
+    static Effect access(const Value *ptr, Effect writeOrRead) {
+      const Value *obj = getUnderlyingObject(ptr);
+      if (isa<AllocaInst>(obj)) return Pure;
+      if (isa<Argument>(obj) || writeOrRead == ReadOnly) return writeOrRead;
+      return Unknown;
+    }
+
+    Summary summarize(Function &F) const {
+      if (F.isDeclaration()) return fromAttributes(F);
+      Summary S;
+      auto join = [&](Effect e) { S.effect = std::max(S.effect, e); };
+      for (Instruction &I : instructions(F)) {
+        if (LoadInst *LI = dyn_cast<LoadInst>(&I)) {
+          join(LI->isSimple() ? access(LI->getPointerOperand(), ReadOnly) : Unknown);
+        } else if (StoreInst *SI = dyn_cast<StoreInst>(&I)) {
+          join(SI->isSimple() ? access(SI->getPointerOperand(), WritesArgs) : Unknown);
+        } else if (CallBase *CB = dyn_cast<CallBase>(&I)) {
+          const Function *callee = CB->getCalledFunction();
+          Summary C;
+          if (callee) {
+            C = lookup(*callee);
+          } else {
+            C.effect = Unknown;
+            C.mayUnwind = true;
+          }
+          if (C.effect == WritesArgs) {
+            for (Value *arg : CB->args())
+              if (arg->getType()->isPointerTy()) join(access(arg, WritesArgs));
+          } else {
+            join(C.effect);
           }
-          if (op=="ret") // subroutine return
-              return true;
-          if (op=="indirectbr") // indirect jump
-              return true;
+          if (C.mayUnwind && !CB->doesNotThrow() && isa<CallInst>(CB)) S.mayUnwind = true;
+        } else if (isa<ResumeInst>(I)) {
+          S.mayUnwind = true;
+        } else if (I.mayWriteToMemory()) { // fences, atomic read-modify-write
+          join(Unknown);
+        }
       }
-    //   errs()<<"Block "<<bb->getName()<<" has no hazard!"<<'\n';
+      // attributes may know better than the scan
+      Summary A = fromAttributes(F);
+      S.effect = std::min(S.effect, A.effect);
+      S.mayUnwind = S.mayUnwind && A.mayUnwind;
+      return S;
+    }
+  };
+
+  struct CallSummaryPass : public ModulePass {
+    static char ID;
+    CallSummaryPass() : ModulePass(ID) {};
+
+    bool runOnModule(Module &M) override {
+      info.analyze(getAnalysis<CallGraphWrapperPass>().getCallGraph());
       return false;
     }
 
-namespace BaseTrace {
-  struct BaseTracePass : public FunctionPass {
+    const CallSummaryInfo &getInfo() const { return info; }
+
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+      AU.addRequired<CallGraphWrapperPass>();
+      AU.setPreservesAll();
+    }
+    private:
+    CallSummaryInfo info;
+  };
+
+  // The same summaries for the new pass manager.
+  struct CallSummaryAnalysis : public AnalysisInfoMixin<CallSummaryAnalysis> {
+    using Result = CallSummaryInfo;
+    Result run(Module &M, ModuleAnalysisManager &MAM) {
+      CallSummaryInfo info;
+      info.analyze(MAM.getResult<CallGraphAnalysis>(M));
+      return info;
+    }
+    private:
+    friend AnalysisInfoMixin<CallSummaryAnalysis>;
+    static AnalysisKey Key;
+  };
+}
+
+AnalysisKey CallSummary::CallSummaryAnalysis::Key;
+char CallSummary::CallSummaryPass::ID = 0;
+static RegisterPass<CallSummary::CallSummaryPass>
+    CS("call-summary",
+       "callee side-effect summaries", false, true);
+
+namespace SampleInput {
+  // Load TraceSampleProfile into M with LLVM's sample profile loader, which
+  // only takes functions marked for it, as clang marks them under
+  // -fprofile-sample-use; here every definition with debug info is. A module
+  // that already has a profile is left alone, so several trace passes load
+  // it once. Returns true if M changed.
+  bool LoadSampleProfile(Module &M, ModuleAnalysisManager &MAM) {
+    if (M.getProfileSummary(/*IsCS=*/false)) return false;
+    // the loader treats an unreadable profile as a fatal error
+    ErrorOr<std::unique_ptr<sampleprof::SampleProfileReader> > reader =
+        sampleprof::SampleProfileReader::create(TraceSampleProfile, M.getContext());
+    std::error_code EC = reader ? (*reader)->read() : reader.getError();
+    if (EC) {
+      report() << "cannot read sample profile " << TraceSampleProfile << ": " << EC.message()
+               << ", using static estimates\n";
+      return false;
+    }
+    unsigned marked = 0, sampled = 0;
+    for (Function &F : M)
+      if (!F.isDeclaration() && F.getSubprogram()) {
+        F.addFnAttr("use-sample-profile");
+        marked++;
+      }
+    SampleProfileLoaderPass(TraceSampleProfile).run(M, MAM);
+    for (Function &F : M)
+      if (!F.isDeclaration() && F.getEntryCount() && F.getEntryCount()->getCount() > 0) sampled++;
+    report() << "sample profile: " << sampled << " of " << marked << " functions with debug info sampled\n";
+    return marked > 0;
+  }
+
+  // The loader for the legacy pass manager, which the trace passes require
+  // under -trace-sample-profile.
+  struct SampleProfileInputPass : public ModulePass {
     static char ID;
-    BaseTracePass() : FunctionPass(ID) {};
-    BaseTracePass(char id): FunctionPass(id) {};
+    SampleProfileInputPass() : ModulePass(ID) {}
 
-    Trace GrowTrace(BasicBlock* seedBB, DominatorTree &DT, PostDominatorTree &PDT, Function &F, BranchProbabilityInfo &BPI) {
-      std::vector<BasicBlock*> trace;
-      BasicBlock *currBB = seedBB;
-      while (1) {
-        trace.push_back(currBB);
-        visited.insert(currBB);
-        BasicBlock *likelyBB = predict(currBB, F, PDT, BPI);
-        if (!likelyBB || visited.find(likelyBB) != visited.end()) {break;}
-        if (DT.dominates(&likelyBB->front(), &currBB->front())) {break;}
-        currBB = likelyBB;
+    bool runOnModule(Module &M) override {
+      // the loader is a new pass manager pass
+      PassBuilder PB;
+      LoopAnalysisManager LAM;
+      FunctionAnalysisManager FAM;
+      CGSCCAnalysisManager CGAM;
+      ModuleAnalysisManager MAM;
+      PB.registerModuleAnalyses(MAM);
+      PB.registerCGSCCAnalyses(CGAM);
+      PB.registerFunctionAnalyses(FAM);
+      PB.registerLoopAnalyses(LAM);
+      PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+      return LoadSampleProfile(M, MAM);
+    }
+  };
+}
+
+char SampleInput::SampleProfileInputPass::ID = 0;
+static RegisterPass<SampleInput::SampleProfileInputPass>
+    SPI("trace-sample-profile-input",
+        "sample profile input for the trace passes", false, false);
+
+// The instructions a trace should not grow past: a synchronizing
+// instruction, a call, a return, an indirect jump, or a store to an address
+// not known at compile time.
+enum HazardKind {
+  SyncHazard = 1,
+  CallHazard = 2,
+  ReturnHazard = 4,
+  IndirectJumpHazard = 8,
+  StoreHazard = 16,
+  NumHazardKinds = 5
+};
+static const char *HazardKindName[NumHazardKinds] = {
+  "sync", "call", "return", "indirectJump", "store"};
+
+// The kinds of hazard in the block, all of them, or with all false the first
+// one found. With MSSA and AA, an ambiguous store no load may read is not a
+// hazard; with CS, neither is a call CS finds safe.
+unsigned hazardKinds(BasicBlock* bb, MemorySSA *MSSA = nullptr, AAResults *AA = nullptr,
+                     const CallSummary::CallSummaryInfo *CS = nullptr, bool all = true) {
+  unsigned kinds = 0;
+  for (Instruction &I : *bb) {
+    if (I.isAtomic()) { // sync instr
+      kinds |= SyncHazard;
+      if (!all) return kinds;
+      continue;
+    }
+    switch (I.getOpcode()) {
+    case Instruction::Call: // subroutine call
+      if (CS && CS->isSafeCall(cast<CallBase>(I))) break;
+      kinds |= CallHazard;
+      break;
+    case Instruction::Ret: // subroutine return
+      kinds |= ReturnHazard;
+      break;
+    case Instruction::IndirectBr: // indirect jump
+      kinds |= IndirectJumpHazard;
+      break;
+    case Instruction::Store: { // ambiguous store
+      // only addresses computed in the function are considered; a stack
+      // slot, or a constant offset into one, is known at compile time
+      Instruction *dest = dyn_cast<Instruction>(cast<StoreInst>(I).getPointerOperand());
+      if (!dest || isa<AllocaInst>(dest)) break;
+      if (GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(dest))
+        if (GEP->hasAllConstantIndices() && isa<AllocaInst>(GEP->getPointerOperand())) break;
+      if (MSSA && !storeMayBeRead(cast<StoreInst>(&I), *MSSA, *AA)) break;
+      kinds |= StoreHazard;
+      break;
+    }
+    default:
+      break;
+    }
+    if (kinds && !all) return kinds;
+  }
+  return kinds;
+}
+
+// Returns true if the block holds a hazard.
+bool classifyHazard(BasicBlock* bb, MemorySSA *MSSA = nullptr, AAResults *AA = nullptr,
+                    const CallSummary::CallSummaryInfo *CS = nullptr) {
+  return hazardKinds(bb, MSSA, AA, CS, /*all=*/false) != 0;
+}
+
+namespace PathProfile {
+  // Ball-Larus numbering of the acyclic paths of a function. Back edges are
+  // cut and stand-in edges added: entry -> loop header to start a path, and
+  // latch -> exit to end one. Returns, unreachables and calls that do not
+  // return end a path too. Each
+  // path gets a unique number in [0, numPaths), the sum of the values of its
+  // edges, so a single register added to along the way identifies it.
+  // The call a path through BB ends at, if any: nothing after a call that
+  // does not return runs.
+  CallBase* NoReturnCall(BasicBlock *BB) {
+    for (Instruction &I : *BB)
+      if (CallBase *CB = dyn_cast<CallBase>(&I))
+        if (CB->doesNotReturn()) return CB;
+    return nullptr;
+  }
+
+  struct BallLarusDAG {
+    struct Edge {
+      BasicBlock *from, *to; // to is null for an edge into the exit
+      uint64_t val;
+      bool dummy;            // stand-in for a back edge
+    };
+    BasicBlock *entry = nullptr;
+    std::vector<Edge> edges;
+    DenseMap<BasicBlock*, SmallVector<unsigned, 2> > outEdges; // increasing val
+    DenseMap<BasicBlock*, uint64_t> startVal; // of entry -> header, per header
+    DenseSet<std::pair<BasicBlock*, BasicBlock*> > backEdges;
+    uint64_t numPaths = 0;
+    uint64_t checksum = 0;
+    bool valid = false;
+
+    // Functions with more than maxPaths paths, EH pads or indirect branches
+    // are not numbered.
+    BallLarusDAG(Function &F, uint64_t maxPaths) {
+      entry = &F.getEntryBlock();
+      if (!pred_empty(entry)) return;
+      for (BasicBlock &BB : F) {
+        Instruction *T = BB.getTerminator();
+        if (BB.isEHPad() || isa<IndirectBrInst>(T) || isa<CallBrInst>(T) || isa<InvokeInst>(T))
+          return;
+      }
+      SmallVector<std::pair<const BasicBlock*, const BasicBlock*>, 8> BE;
+      FindFunctionBackedges(F, BE);
+      std::vector<BasicBlock*> headers;
+      for (auto &E : BE) {
+        BasicBlock *from = const_cast<BasicBlock*>(E.first), *to = const_cast<BasicBlock*>(E.second);
+        backEdges.insert({from, to});
+        if (!startVal.count(to)) {
+          startVal[to] = 0;
+          headers.push_back(to);
+        }
+      }
+
+      // out edges in successor order, then the stand-ins
+      DenseMap<BasicBlock*, unsigned> blockIndex;
+      for (BasicBlock &BB : F) blockIndex[&BB] = blockIndex.size();
+      for (BasicBlock &BB : F) {
+        SmallPtrSet<BasicBlock*, 4> seen;
+        bool latch = false, exits = NoReturnCall(&BB) || succ_empty(&BB);
+        for (BasicBlock *succ : successors(&BB)) {
+          if (exits) break;
+          if (!seen.insert(succ).second) continue;
+          if (backEdges.count({&BB, succ})) latch = true;
+          else addEdge(&BB, succ, false);
+        }
+        if (latch || exits) addEdge(&BB, nullptr, latch);
+        if (&BB == entry)
+          for (BasicBlock *H : headers) addEdge(entry, H, true);
+      }
+
+      // number in reverse topological order: a depth first post order
+      DenseMap<BasicBlock*, uint64_t> pathsFrom;
+      SmallVector<std::pair<BasicBlock*, unsigned>, 16> stack;
+      stack.push_back({entry, 0});
+      pathsFrom[entry] = 0;
+      while (!stack.empty()) {
+        BasicBlock *BB = stack.back().first;
+        SmallVector<unsigned, 2> &out = outEdges[BB];
+        if (stack.back().second < out.size()) {
+          BasicBlock *to = edges[out[stack.back().second++]].to;
+          if (to && pathsFrom.insert({to, 0}).second) stack.push_back({to, 0});
+          continue;
+        }
+        stack.pop_back();
+        uint64_t n = 0;
+        for (unsigned e : out) {
+          edges[e].val = n;
+          n += edges[e].to ? pathsFrom[edges[e].to] : 1;
+          if (n > maxPaths) return;
+        }
+        pathsFrom[BB] = n;
+      }
+      numPaths = pathsFrom[entry];
+      for (auto &SV : startVal)
+        for (unsigned e : outEdges[entry])
+          if (edges[e].dummy && edges[e].to == SV.first) SV.second = edges[e].val;
+
+      // the CFG the numbering was made for
+      checksum = 14695981039346656037ULL;
+      auto mix = [&](uint64_t v) { checksum = (checksum ^ v) * 1099511628211ULL; };
+      mix(F.size());
+      for (Edge &E : edges) {
+        mix(blockIndex[E.from]);
+        mix(E.to ? blockIndex[E.to] : ~0ULL);
+        mix(E.dummy);
+      }
+      valid = true;
+    }
+
+    // Blocks of path id, in execution order.
+    std::vector<BasicBlock*> decode(uint64_t id) {
+      std::vector<BasicBlock*> path;
+      BasicBlock *BB = entry;
+      for (bool first = true;; first = false) {
+        Edge *edge = nullptr;
+        for (unsigned e : outEdges[BB]) {
+          if (edges[e].val > id) break;
+          edge = &edges[e];
+        }
+        id -= edge->val;
+        // a path from entry -> header starts at the header
+        if (first && !edge->dummy) path.push_back(entry);
+        if (!edge->to) break;
+        path.push_back(edge->to);
+        BB = edge->to;
+      }
+      return path;
+    }
+
+    private:
+    void addEdge(BasicBlock *from, BasicBlock *to, bool dummy) {
+      outEdges[from].push_back(edges.size());
+      edges.push_back(Edge{from, to, 0, dummy});
+    }
+  };
+
+  // Counters of F, zero at program start.
+  GlobalVariable* CreateCounters(Function &F, StringRef kind, uint64_t n) {
+    ArrayType *CountsTy = ArrayType::get(Type::getInt64Ty(F.getContext()), n);
+    return new GlobalVariable(*F.getParent(), CountsTy, false, GlobalValue::PrivateLinkage,
+                              ConstantAggregateZero::get(CountsTy),
+                              "__pathprof_" + kind + "." + F.getName());
+  }
+
+  // struct __pathprof_function in the runtime
+  StructType* CounterTableType(LLVMContext &C) {
+    Type *I64 = Type::getInt64Ty(C);
+    return StructType::get(C, {Type::getInt8PtrTy(C), I64, I64, I64->getPointerTo()});
+  }
+
+  // Runtime table entry for counters, written to the profile under name.
+  // The checksum identifies what the counters were taken on.
+  Constant* CounterTableEntry(Module &M, StringRef name, uint64_t checksum, GlobalVariable *counts) {
+    LLVMContext &C = M.getContext();
+    Type *I64 = Type::getInt64Ty(C);
+    Constant *nameInit = ConstantDataArray::getString(C, name);
+    GlobalVariable *nameGV = new GlobalVariable(
+        M, nameInit->getType(), true, GlobalValue::PrivateLinkage, nameInit, "__pathprof_name");
+    ArrayType *CountsTy = cast<ArrayType>(counts->getValueType());
+    Constant *zero = ConstantInt::get(I64, 0);
+    Constant *fields[] = {
+        ConstantExpr::getPointerCast(nameGV, Type::getInt8PtrTy(C)),
+        ConstantInt::get(I64, checksum), ConstantInt::get(I64, CountsTy->getNumElements()),
+        ConstantExpr::getInBoundsGetElementPtr(CountsTy, counts, ArrayRef<Constant*>{zero, zero})};
+    return ConstantStruct::get(CounterTableType(C), fields);
+  }
+
+  // A constructor registering the counter table with the runtime and a
+  // destructor having it write the counters out. A destructor rather than
+  // atexit, so the counters are still there when the program runs in a JIT.
+  void EmitCounterRegistration(Module &M, ArrayRef<Constant*> table) {
+    LLVMContext &C = M.getContext();
+    StructType *FnTy = CounterTableType(C);
+    ArrayType *TableTy = ArrayType::get(FnTy, table.size());
+    GlobalVariable *tableGV = new GlobalVariable(
+        M, TableTy, false, GlobalValue::PrivateLinkage,
+        ConstantArray::get(TableTy, table), "__pathprof_functions");
+    FunctionCallee reg = M.getOrInsertFunction(
+        "__pathprof_register", Type::getVoidTy(C), FnTy->getPointerTo(), Type::getInt64Ty(C));
+    FunctionCallee dump = M.getOrInsertFunction("__pathprof_dump", Type::getVoidTy(C));
+    FunctionType *VoidFnTy = FunctionType::get(Type::getVoidTy(C), false);
+    Function *ctor = Function::Create(VoidFnTy, GlobalValue::InternalLinkage, "__pathprof_init", M);
+    IRBuilder<> B(BasicBlock::Create(C, "", ctor));
+    B.CreateCall(reg, {B.CreateConstInBoundsGEP2_32(TableTy, tableGV, 0, 0),
+                       B.getInt64(table.size())});
+    B.CreateRetVoid();
+    appendToGlobalCtors(M, ctor, 0);
+    Function *dtor = Function::Create(VoidFnTy, GlobalValue::InternalLinkage, "__pathprof_fini", M);
+    B.SetInsertPoint(BasicBlock::Create(C, "", dtor));
+    B.CreateCall(dump);
+    B.CreateRetVoid();
+    appendToGlobalDtors(M, dtor, 0);
+  }
+
+  // counts[idx] += amount
+  void AddToCounter(IRBuilder<> &B, GlobalVariable *counts, uint64_t idx, Value *amount) {
+    Value *slot = B.CreateConstInBoundsGEP2_64(counts->getValueType(), counts, 0, idx);
+    B.CreateStore(B.CreateAdd(B.CreateLoad(B.getInt64Ty(), slot), amount), slot);
+  }
+
+  // Where to put code that runs when the edge from -> to is taken; splits
+  // the edge if it is critical.
+  Instruction* EdgeInsertPoint(BasicBlock *from, BasicBlock *to) {
+    if (from->getUniqueSuccessor() == to) return from->getTerminator();
+    if (to->getUniquePredecessor() == from) return &*to->getFirstInsertionPt();
+    Instruction *T = from->getTerminator();
+    for (unsigned i = 0, e = T->getNumSuccessors(); i != e; ++i)
+      if (T->getSuccessor(i) == to)
+        return SplitCriticalEdge(T, i, CriticalEdgeSplittingOptions().setMergeIdenticalEdges())
+            ->getTerminator();
+    llvm_unreachable("not an edge");
+  }
+
+  // Insert counter updates for the acyclic paths of every function, a
+  // constructor registering the counters with the runtime and a destructor
+  // having it write them to a file (runtime/PathProfileRT.c). Run the trace passes on
+  // the IR that was instrumented with -path-profile-file to use them.
+  struct PathProfileInstrPass : public ModulePass {
+    static char ID;
+    PathProfileInstrPass() : ModulePass(ID) {};
+
+    bool runOnModule(Module &M) override {
+      std::vector<Constant*> table;
+      unsigned skipped = 0;
+      for (Function &F : M) {
+        if (F.isDeclaration()) continue;
+        BallLarusDAG dag(F, PathProfileMaxPaths);
+        if (!dag.valid) {
+          skipped++;
+          continue;
+        }
+        GlobalVariable *counts = CreateCounters(F, "paths", dag.numPaths);
+        instrument(F, dag, counts);
+        table.push_back(CounterTableEntry(M, F.getName(), dag.checksum, counts));
+      }
+      report() << "path profiled functions: " << table.size() << ", skipped: " << skipped << "\n";
+      if (table.empty()) return false;
+      EmitCounterRegistration(M, table);
+      return true;
+    }
+
+    private:
+    void count(Instruction *IP, AllocaInst *reg, uint64_t val, GlobalVariable *counts) {
+      IRBuilder<> B(IP);
+      Value *idx = B.CreateAdd(B.CreateLoad(B.getInt64Ty(), reg), B.getInt64(val));
+      Value *slot = B.CreateInBoundsGEP(counts->getValueType(), counts, {B.getInt64(0), idx});
+      B.CreateStore(B.CreateAdd(B.CreateLoad(B.getInt64Ty(), slot), B.getInt64(1)), slot);
+    }
+
+    void instrument(Function &F, BallLarusDAG &dag, GlobalVariable *counts) {
+      IRBuilder<> B(&*F.getEntryBlock().getFirstInsertionPt());
+      AllocaInst *reg = B.CreateAlloca(B.getInt64Ty(), nullptr, "pathreg");
+      B.CreateStore(B.getInt64(0), reg);
+      // collect first: splitting edges changes the CFG the DAG refers to
+      std::vector<BallLarusDAG::Edge> adds, ends;
+      for (BallLarusDAG::Edge &E : dag.edges) {
+        if (!E.to) ends.push_back(E);
+        else if (!E.dummy && E.val) adds.push_back(E);
+      }
+      for (BallLarusDAG::Edge &E : adds) {
+        IRBuilder<> EB(EdgeInsertPoint(E.from, E.to));
+        EB.CreateStore(EB.CreateAdd(EB.CreateLoad(EB.getInt64Ty(), reg), EB.getInt64(E.val)), reg);
+      }
+      for (BallLarusDAG::Edge &E : ends) {
+        if (!E.dummy) {
+          CallBase *end = NoReturnCall(E.from);
+          count(end ? end : E.from->getTerminator(), reg, E.val, counts);
+          continue;
+        }
+        // a back edge ends the path and starts one at the header
+        std::vector<BasicBlock*> headers;
+        for (BasicBlock *succ : successors(E.from))
+          if (dag.backEdges.count({E.from, succ}) && !is_contained(headers, succ))
+            headers.push_back(succ);
+        for (BasicBlock *H : headers) {
+          Instruction *IP = EdgeInsertPoint(E.from, H);
+          count(IP, reg, E.val, counts);
+          new StoreInst(ConstantInt::get(Type::getInt64Ty(F.getContext()), dag.startVal[H]), reg, IP);
+        }
+      }
+    }
+  };
+}
+
+char PathProfile::PathProfileInstrPass::ID = 0;
+static RegisterPass<PathProfile::PathProfileInstrPass>
+    PP("path-profile-instr",
+       "Ball-Larus path profiling instrumentation", false, false);
+
+// Put a block of its own on every edge from BB to its side exit E, for code
+// that runs on the way out only. Returns the block, which falls through to
+// E.
+static BasicBlock *SplitExitEdge(BasicBlock *BB, BasicBlock *E, DomTreeUpdater &DTU, const Twine &suffix) {
+  BasicBlock *C = BasicBlock::Create(BB->getContext(), BB->getName() + suffix, BB->getParent());
+  BranchInst::Create(E, C);
+  BB->getTerminator()->replaceSuccessorWith(E, C);
+  for (PHINode &PN : E->phis()) {
+    bool first = true;
+    for (int i = PN.getNumIncomingValues() - 1; i >= 0; --i) {
+      if (PN.getIncomingBlock(i) != BB) continue;
+      if (!first) PN.removeIncomingValue(i, false);
+      first = false;
+    }
+    PN.setIncomingBlock(PN.getBasicBlockIndex(BB), C);
+  }
+  DTU.applyUpdates({{DominatorTree::Insert, BB, C}, {DominatorTree::Insert, C, E},
+                    {DominatorTree::Delete, BB, E}});
+  return C;
+}
+
+namespace SuperblockSchedule {
+  // One instruction of a region. Edges run forward in program order, so
+  // program order is a topological order of the DAG.
+  struct Node {
+    Instruction *I;
+    unsigned block;    // block of the region it started in
+    bool exit;         // a terminator: exits keep their order
+    bool barrier;      // may not cross an exit either way
+    bool speculative;  // may move above an exit
+    unsigned latency;
+    unsigned height = 0; // latency-weighted path to the end of the region
+    SmallVector<std::pair<unsigned, unsigned>, 4> succs; // node, latency
+  };
+
+  // List scheduling of a single-entry chain of blocks, the superblock, as one
+  // straight-line region. The exits stay in order and split the schedule
+  // back into the blocks. Instructions that are safe to speculate may move
+  // above an exit; the rest, except calls and other barriers, may move below
+  // one, and are then copied onto the exit edge.
+  struct Scheduler {
+    Scheduler(const TargetTransformInfo &TTI, AAResults *AA, DomTreeUpdater &DTU, unsigned width)
+        : TTI(TTI), AA(AA), DTU(DTU), width(std::max(width, 1u)) {}
+
+    unsigned numRegions = 0, numHoisted = 0, numSunk = 0, numCopies = 0;
+    uint64_t cyclesBefore = 0, cyclesAfter = 0;
+
+    // Schedule blocks, where every block but the first has the one before
+    // as its single predecessor. Returns true if the IR changed.
+    bool run(ArrayRef<BasicBlock*> blocks) {
+      bool changed = false;
+      for (BasicBlock *BB : blocks.drop_front())
+        changed |= FoldSingleEntryPHINodes(BB);
+      BuildDAG(blocks);
+      if (nodes.size() < 3) return changed;
+
+      std::vector<unsigned> order, cycle;
+      ListSchedule(order, cycle);
+      numRegions++;
+      cyclesBefore += InOrderCycles();
+      cyclesAfter += cycle[order.back()] + 1;
+
+      // instructions issued before the exit of block j go to block j
+      std::vector<unsigned> newBlock(nodes.size());
+      unsigned cur = 0;
+      bool moved = false;
+      for (unsigned n : order) {
+        newBlock[n] = nodes[n].exit ? nodes[n].block : cur;
+        if (nodes[n].exit) cur = nodes[n].block + 1;
+        if (newBlock[n] < nodes[n].block) numHoisted++;
+        if (newBlock[n] > nodes[n].block) numSunk++;
+      }
+      for (unsigned i = 0; i < order.size(); ++i)
+        moved |= order[i] != i;
+      if (!moved) return changed;
+      for (unsigned n : order)
+        if (!nodes[n].exit) nodes[n].I->moveBefore(blocks[newBlock[n]]->getTerminator());
+      Compensate(blocks, newBlock);
+      return true;
+    }
+
+    private:
+    const TargetTransformInfo &TTI;
+    AAResults *AA;
+    DomTreeUpdater &DTU;
+    unsigned width;
+    std::vector<Node> nodes;
+    DenseMap<Instruction*, unsigned> nodeOf;
+
+    static bool isBarrier(Instruction &I) {
+      if (isa<CallBase>(I) || isa<AllocaInst>(I) || I.isAtomic() || I.isEHPad()) return true;
+      if (LoadInst *LI = dyn_cast<LoadInst>(&I)) return !LI->isSimple();
+      if (StoreInst *SI = dyn_cast<StoreInst>(&I)) return !SI->isSimple();
+      return I.mayHaveSideEffects();
+    }
+
+    unsigned Latency(Instruction &I) {
+      InstructionCost cost = TTI.getInstructionCost(&I, TargetTransformInfo::TCK_Latency);
+      return cost.isValid() ? std::max<unsigned>(*cost.getValue(), 1) : 1;
+    }
+
+    bool MayDepend(Node &A, Node &B) {
+      if (!A.I->mayWriteToMemory() && !B.I->mayWriteToMemory()) return false;
+      if (!AA || A.barrier || B.barrier) return true;
+      Optional<MemoryLocation> LA = MemoryLocation::getOrNone(A.I), LB = MemoryLocation::getOrNone(B.I);
+      return !LA || !LB || !AA->isNoAlias(*LA, *LB);
+    }
+
+    void AddEdge(unsigned from, unsigned to, unsigned latency) {
+      nodes[from].succs.push_back({to, latency});
+    }
+
+    void BuildDAG(ArrayRef<BasicBlock*> blocks) {
+      nodes.clear();
+      nodeOf.clear();
+      for (unsigned b = 0; b < blocks.size(); ++b) {
+        for (Instruction &I : *blocks[b]) {
+          // the phis, EH pad and static allocas heading the region stay in
+          // place, ahead of everything scheduled
+          if (b == 0 && nodes.empty() &&
+              (isa<PHINode>(I) || isa<AllocaInst>(I) || (I.isEHPad() && !I.isTerminator())))
+            continue;
+          Node N;
+          N.I = &I;
+          N.block = b;
+          N.exit = I.isTerminator();
+          N.barrier = !N.exit && isBarrier(I);
+          N.speculative = !N.exit && !N.barrier && isSafeToSpeculativelyExecute(&I);
+          N.latency = Latency(I);
+          nodeOf[&I] = nodes.size();
+          nodes.push_back(N);
+        }
+      }
+
+      std::vector<unsigned> memory, pinned;
+      int lastExit = -1;
+      for (unsigned j = 0; j < nodes.size(); ++j) {
+        Node &N = nodes[j];
+        for (Value *op : N.I->operands())
+          if (Instruction *def = dyn_cast<Instruction>(op)) {
+            auto it = nodeOf.find(def);
+            if (it != nodeOf.end()) AddEdge(it->second, j, nodes[it->second].latency);
+          }
+        if (N.I->mayReadOrWriteMemory()) {
+          for (unsigned i : memory)
+            if (MayDepend(nodes[i], N)) AddEdge(i, j, 0);
+          memory.push_back(j);
+        }
+        // barriers keep their order with each other, with everything that is
+        // not safe to speculate and with the exits
+        if (N.barrier || !N.speculative)
+          for (unsigned i : pinned)
+            if (N.barrier || nodes[i].barrier) AddEdge(i, j, 0);
+        if (N.barrier || (!N.speculative && !N.exit)) pinned.push_back(j);
+
+        if (lastExit >= 0 && !N.speculative) AddEdge(lastExit, j, 0);
+        if (N.exit) lastExit = j;
+      }
+      // everything issues before the region ends
+      for (unsigned i = 0; i + 1 < nodes.size(); ++i) AddEdge(i, nodes.size() - 1, 0);
+
+      for (unsigned i = nodes.size(); i-- > 0;)
+        for (auto &S : nodes[i].succs)
+          nodes[i].height = std::max(nodes[i].height, S.second + nodes[S.first].height);
+    }
+
+    // Cycle by cycle, issue up to width ready nodes, tallest first.
+    void ListSchedule(std::vector<unsigned> &order, std::vector<unsigned> &cycle) {
+      std::vector<unsigned> preds(nodes.size()), earliest(nodes.size()), ready;
+      cycle.assign(nodes.size(), 0);
+      for (Node &N : nodes)
+        for (auto &S : N.succs) preds[S.first]++;
+      for (unsigned i = 0; i < nodes.size(); ++i)
+        if (!preds[i]) ready.push_back(i);
+      for (unsigned now = 0; order.size() < nodes.size(); ++now) {
+        for (unsigned issued = 0; issued < width; ++issued) {
+          int best = -1;
+          for (unsigned k = 0; k < ready.size(); ++k) {
+            unsigned n = ready[k];
+            if (earliest[n] > now) continue;
+            if (best < 0 || nodes[n].height > nodes[ready[best]].height ||
+                (nodes[n].height == nodes[ready[best]].height && n < ready[best]))
+              best = k;
+          }
+          if (best < 0) break;
+          unsigned n = ready[best];
+          ready.erase(ready.begin() + best);
+          order.push_back(n);
+          cycle[n] = now;
+          for (auto &S : nodes[n].succs) {
+            earliest[S.first] = std::max(earliest[S.first], now + S.second);
+            if (!--preds[S.first]) ready.push_back(S.first);
+          }
+        }
+      }
+    }
+
+    // Length of the program order under the same machine model.
+    uint64_t InOrderCycles() {
+      std::vector<unsigned> earliest(nodes.size());
+      unsigned now = 0, issued = 0;
+      for (unsigned n = 0; n < nodes.size(); ++n) {
+        if (issued == width) {
+          now++;
+          issued = 0;
+        }
+        if (earliest[n] > now) {
+          now = earliest[n];
+          issued = 0;
+        }
+        issued++;
+        for (auto &S : nodes[n].succs)
+          earliest[S.first] = std::max(earliest[S.first], now + S.second);
+      }
+      return now + 1;
+    }
+
+    // Copy what was moved below an exit onto the exit edge, where it is
+    // still needed: for its side effects, by a use off the region, or by
+    // another copy. Uses off the region then see the copy on the way out.
+    void Compensate(ArrayRef<BasicBlock*> blocks, std::vector<unsigned> &newBlock) {
+      SmallPtrSet<BasicBlock*, 8> region(blocks.begin(), blocks.end());
+      DenseMap<Instruction*, SmallVector<std::pair<BasicBlock*, Instruction*>, 2> > copies;
+      SmallPtrSet<BasicBlock*, 8> compBlocks;
+      auto usedOff = [&](Instruction *I) {
+        for (User *U : I->users()) {
+          Instruction *UI = cast<Instruction>(U);
+          if (isa<PHINode>(UI) || !region.count(UI->getParent())) return true;
+        }
+        return false;
+      };
+      for (unsigned j = 0; j + 1 < blocks.size(); ++j) {
+        std::vector<unsigned> sunk;
+        for (unsigned n = 0; n < nodes.size(); ++n)
+          if (!nodes[n].exit && nodes[n].block <= j && newBlock[n] > j) sunk.push_back(n);
+        if (sunk.empty()) continue;
+        SmallPtrSet<Instruction*, 16> needed;
+        for (unsigned k = sunk.size(); k-- > 0;) {
+          Instruction *I = nodes[sunk[k]].I;
+          bool need = I->mayWriteToMemory() || usedOff(I);
+          for (User *U : I->users())
+            need |= needed.count(cast<Instruction>(U)) > 0;
+          if (need) needed.insert(I);
+        }
+        if (needed.empty()) continue;
+
+        Instruction *T = blocks[j]->getTerminator();
+        SmallVector<BasicBlock*, 4> exits;
+        for (BasicBlock *succ : successors(T))
+          if (succ != blocks[j+1] && !is_contained(exits, succ)) exits.push_back(succ);
+        for (BasicBlock *E : exits) {
+          BasicBlock *C = SplitExitEdge(blocks[j], E, DTU, ".comp");
+          Instruction *br = C->getTerminator();
+          compBlocks.insert(C);
+          ValueToValueMapTy VMap;
+          for (unsigned n : sunk) {
+            Instruction *I = nodes[n].I;
+            if (!needed.count(I)) continue;
+            Instruction *copy = I->clone();
+            if (I->hasName()) copy->setName(I->getName() + ".comp");
+            copy->insertBefore(br);
+            RemapInstruction(copy, VMap, RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+            VMap[I] = copy;
+            copies[I].push_back({C, copy});
+            numCopies++;
+          }
+        }
+      }
+
+      SSAUpdater SSA;
+      SmallVector<Use*, 16> usesToRename;
+      for (auto &entry : copies) {
+        Instruction *I = entry.first;
+        usesToRename.clear();
+        for (Use &U : I->uses()) {
+          Instruction *user = cast<Instruction>(U.getUser());
+          if (compBlocks.count(user->getParent())) continue;
+          if (isa<PHINode>(user) || !region.count(user->getParent())) usesToRename.push_back(&U);
+        }
+        if (usesToRename.empty()) continue;
+        SSA.Initialize(I->getType(), I->getName());
+        SSA.AddAvailableValue(I->getParent(), I);
+        for (auto &copy : entry.second) SSA.AddAvailableValue(copy.first, copy.second);
+        for (Use *U : usesToRename) SSA.RewriteUse(*U);
+      }
+    }
+  };
+}
+
+namespace SuperblockVectorize {
+  // A bundle of scalars, one per lane, packed into one vector instruction,
+  // or gathered into a vector from wherever they are.
+  struct Node {
+    SmallVector<Value*, 8> lanes;
+    bool gather = true;
+    SmallVector<unsigned, 2> operands; // nodes
+    Value *vec = nullptr;
+  };
+
+  // SLP vectorization of a single-entry chain of blocks, the superblock, as
+  // one straight-line region. Runs of stores to consecutive addresses are
+  // the seeds; their values are packed bottom up through isomorphic
+  // arithmetic, casts and loads of consecutive addresses, in whichever block
+  // of the region they are. The vector code goes where the last store of
+  // the run was, on the hot path. A store from before a side exit is copied
+  // onto the exit edge, as is what computes its value, so a trace left
+  // early stores the scalars it would have.
+  struct Vectorizer {
+    Vectorizer(const TargetTransformInfo &TTI, AAResults &AA, ScalarEvolution &SE, DomTreeUpdater &DTU,
+               const DataLayout &DL)
+        : TTI(TTI), AA(AA), SE(SE), DTU(DTU), DL(DL) {}
+
+    unsigned numRegions = 0, numBundles = 0, numAcross = 0, numPacked = 0, numCopies = 0;
+    int64_t costBefore = 0, costAfter = 0;
+
+    // Vectorize blocks, where every block but the first has the one before
+    // as its single predecessor. Returns true if the IR changed.
+    bool run(ArrayRef<BasicBlock*> region) {
+      bool changed = false;
+      for (BasicBlock *BB : region.drop_front())
+        changed |= FoldSingleEntryPHINodes(BB);
+      blocks = region;
+      compBlocks.clear();
+      Number();
+
+      // seeds by element type and the object they store to
+      MapVector<std::pair<Type*, const Value*>, SmallVector<StoreInst*, 8> > groups;
+      for (Instruction *I : order)
+        if (StoreInst *SI = dyn_cast<StoreInst>(I)) {
+          Type *Ty = SI->getValueOperand()->getType();
+          if (SI->isSimple() && MaxLanes(Ty) >= 2)
+            groups[{Ty, getUnderlyingObject(SI->getPointerOperand())}].push_back(SI);
+        }
+      bool vectorized = false;
+      SmallPtrSet<StoreInst*, 16> done;
+      for (auto &G : groups) {
+        Type *Ty = G.first.first;
+        Value *base = G.second[0]->getPointerOperand();
+        // in address order, in elements from the first; stores SCEV cannot
+        // place are left out
+        SmallVector<std::pair<int, StoreInst*>, 8> sorted;
+        for (StoreInst *SI : G.second)
+          if (Optional<int> diff = getPointersDiff(Ty, base, Ty, SI->getPointerOperand(), DL, SE, true))
+            sorted.push_back({*diff, SI});
+        llvm::stable_sort(sorted, less_first());
+        for (unsigned lanes = MaxLanes(Ty); lanes >= 2; lanes /= 2)
+          for (unsigned i = 0; i + lanes <= sorted.size();) {
+            bool run = true;
+            for (unsigned k = 0; k < lanes && run; ++k)
+              run = !done.count(sorted[i+k].second) && sorted[i+k].first == sorted[i].first + int(k);
+            SmallVector<StoreInst*, 8> bundle;
+            for (unsigned k = 0; run && k < lanes; ++k) bundle.push_back(sorted[i+k].second);
+            if (!run || !Vectorize(bundle)) {
+              i++;
+              continue;
+            }
+            done.insert(bundle.begin(), bundle.end());
+            vectorized = true;
+            i += lanes;
+            Number();
+          }
+      }
+      if (vectorized) numRegions++;
+      return changed || vectorized;
+    }
+
+    private:
+    static const unsigned MaxDepth = 12; // of the operand tree
+    const TargetTransformInfo &TTI;
+    AAResults &AA;
+    ScalarEvolution &SE;
+    DomTreeUpdater &DTU;
+    const DataLayout &DL;
+    ArrayRef<BasicBlock*> blocks;
+    std::vector<Instruction*> order; // of the region, in program order
+    std::vector<unsigned> blockOf;
+    DenseMap<Instruction*, unsigned> pos;
+    SmallPtrSet<BasicBlock*, 8> compBlocks; // on the side exits of the region
+    std::vector<Node> nodes;
+
+    void Number() {
+      order.clear();
+      blockOf.clear();
+      pos.clear();
+      for (unsigned b = 0; b < blocks.size(); ++b)
+        for (Instruction &I : *blocks[b]) {
+          pos[&I] = order.size();
+          order.push_back(&I);
+          blockOf.push_back(b);
+        }
+    }
+
+    // Lanes of Ty that fit a vector register, 0 if Ty does not pack.
+    unsigned MaxLanes(Type *Ty) {
+      if (!Ty->isIntegerTy() && !Ty->isFloatingPointTy()) return 0;
+      uint64_t bits = DL.getTypeSizeInBits(Ty).getFixedSize();
+      if (bits < 8 || !isPowerOf2_64(bits)) return 0;
+      uint64_t width = TTI.getRegisterBitWidth(TargetTransformInfo::RGK_FixedWidthVector).getFixedSize();
+      return unsigned(PowerOf2Floor(std::min<uint64_t>(width / bits, 16)));
+    }
+
+    static bool SameKind(Value *A, Value *B) {
+      Instruction *IA = dyn_cast<Instruction>(A), *IB = dyn_cast<Instruction>(B);
+      if (IA && IB) return IA->getOpcode() == IB->getOpcode();
+      return isa<Constant>(A) && isa<Constant>(B);
+    }
+
+    // The node for the lanes VL: packed if they are isomorphic instructions
+    // of the region, a gather otherwise.
+    unsigned Build(ArrayRef<Value*> VL, unsigned depth) {
+      unsigned n = nodes.size();
+      nodes.emplace_back();
+      nodes[n].lanes.assign(VL.begin(), VL.end());
+      Instruction *I0 = dyn_cast<Instruction>(VL[0]);
+      if (depth >= MaxDepth || !I0 || !pos.count(I0)) return n;
+      SmallPtrSet<Value*, 8> seen;
+      for (Value *V : VL) {
+        Instruction *I = dyn_cast<Instruction>(V);
+        if (!I || !pos.count(I) || I->getOpcode() != I0->getOpcode() || I->getType() != I0->getType() ||
+            !seen.insert(V).second)
+          return n;
+      }
+
+      if (LoadInst *L0 = dyn_cast<LoadInst>(I0)) {
+        for (unsigned k = 0; k < VL.size(); ++k) {
+          LoadInst *L = cast<LoadInst>(VL[k]);
+          Optional<int> diff = getPointersDiff(L0->getType(), L0->getPointerOperand(), L->getType(),
+                                               L->getPointerOperand(), DL, SE, true);
+          if (!L->isSimple() || !diff || *diff != int(k)) return n;
+        }
+        nodes[n].gather = false;
+        return n;
+      }
+      if (isa<BinaryOperator>(I0)) {
+        SmallVector<Value*, 8> lhs, rhs;
+        for (Value *V : VL) {
+          BinaryOperator *B = cast<BinaryOperator>(V);
+          Value *A = B->getOperand(0), *C = B->getOperand(1);
+          // commuted lanes line up with the first by opcode
+          if (B->isCommutative() && !lhs.empty() && !SameKind(A, lhs[0]) && SameKind(C, lhs[0]))
+            std::swap(A, C);
+          lhs.push_back(A);
+          rhs.push_back(C);
+        }
+        nodes[n].gather = false;
+        unsigned l = Build(lhs, depth + 1);
+        unsigned r = Build(rhs, depth + 1);
+        nodes[n].operands = {l, r};
+        return n;
+      }
+      if (isa<CastInst>(I0)) {
+        SmallVector<Value*, 8> src;
+        for (Value *V : VL) {
+          src.push_back(cast<CastInst>(V)->getOperand(0));
+          if (src.back()->getType() != src[0]->getType() || MaxLanes(src[0]->getType()) < 2) return n;
+        }
+        nodes[n].gather = false;
+        unsigned s = Build(src, depth + 1);
+        nodes[n].operands = {s};
+        return n;
+      }
+      return n;
+    }
+
+    static FixedVectorType *VectorOf(Node &N) {
+      return FixedVectorType::get(N.lanes[0]->getType(), N.lanes.size());
+    }
+
+    InstructionCost Cost(Node &N) {
+      const TargetTransformInfo::TargetCostKind kind = TargetTransformInfo::TCK_RecipThroughput;
+      FixedVectorType *VecTy = VectorOf(N);
+      if (N.gather) {
+        if (all_of(N.lanes, [](Value *V) { return isa<Constant>(V); })) return 0;
+        if (is_splat(N.lanes))
+          return TTI.getVectorInstrCost(Instruction::InsertElement, VecTy, 0) +
+                 TTI.getShuffleCost(TargetTransformInfo::SK_Broadcast, VecTy);
+        return TTI.getScalarizationOverhead(VecTy, APInt::getAllOnes(N.lanes.size()), true, false);
+      }
+      Instruction *I0 = cast<Instruction>(N.lanes[0]);
+      if (LoadInst *L0 = dyn_cast<LoadInst>(I0))
+        return TTI.getMemoryOpCost(Instruction::Load, VecTy, L0->getAlign(), L0->getPointerAddressSpace(), kind);
+      if (isa<CastInst>(I0))
+        return TTI.getCastInstrCost(I0->getOpcode(), VecTy, VectorOf(nodes[N.operands[0]]),
+                                    TargetTransformInfo::CastContextHint::None, kind);
+      return TTI.getArithmeticInstrCost(I0->getOpcode(), VecTy, kind);
+    }
+
+    Value *Emit(unsigned n, IRBuilder<> &B) {
+      Node &N = nodes[n];
+      if (N.vec) return N.vec;
+      FixedVectorType *VecTy = VectorOf(N);
+      std::string name = N.lanes[0]->hasName() ? (N.lanes[0]->getName() + ".vec").str() : "";
+      if (N.gather) {
+        if (all_of(N.lanes, [](Value *V) { return isa<Constant>(V); })) {
+          SmallVector<Constant*, 8> lanes;
+          for (Value *V : N.lanes) lanes.push_back(cast<Constant>(V));
+          return N.vec = ConstantVector::get(lanes);
+        }
+        if (is_splat(N.lanes)) return N.vec = B.CreateVectorSplat(N.lanes.size(), N.lanes[0]);
+        Value *vec = PoisonValue::get(VecTy);
+        for (unsigned k = 0; k < N.lanes.size(); ++k) vec = B.CreateInsertElement(vec, N.lanes[k], k);
+        return N.vec = vec;
+      }
+      Instruction *I0 = cast<Instruction>(N.lanes[0]);
+      if (LoadInst *L0 = dyn_cast<LoadInst>(I0)) {
+        Value *ptr = B.CreateBitCast(L0->getPointerOperand(), VecTy->getPointerTo(L0->getPointerAddressSpace()));
+        LoadInst *load = B.CreateAlignedLoad(VecTy, ptr, L0->getAlign(), name);
+        propagateMetadata(load, N.lanes);
+        return N.vec = load;
+      }
+      Value *vec;
+      if (isa<CastInst>(I0))
+        vec = B.CreateCast(Instruction::CastOps(I0->getOpcode()), Emit(N.operands[0], B), VecTy, name);
+      else
+        vec = B.CreateBinOp(Instruction::BinaryOps(I0->getOpcode()), Emit(N.operands[0], B),
+                            Emit(N.operands[1], B), name);
+      propagateIRFlags(vec, N.lanes);
+      return N.vec = vec;
+    }
+
+    // A side exit, from block of the region to to, a store is moved across.
+    struct Exit {
+      StoreInst *store;
+      unsigned block;
+      BasicBlock *to;
+    };
+
+    // The exits the stores are moved across, down to the block of last.
+    void CrossedExits(ArrayRef<StoreInst*> stores, unsigned last, SmallVectorImpl<Exit> &exits) {
+      for (StoreInst *SI : stores)
+        for (unsigned j = blockOf[pos[SI]]; j < blockOf[last]; ++j) {
+          SmallPtrSet<BasicBlock*, 4> seen;
+          for (BasicBlock *E : successors(blocks[j]))
+            if (E != blocks[j+1] && seen.insert(E).second) exits.push_back({SI, j, E});
+        }
+    }
+
+    // The stores and the packed loads move down to last. Nothing they pass,
+    // nor a fallback store already on an exit they cross, may touch what they
+    // write, or write what they read.
+    bool Legal(ArrayRef<StoreInst*> stores, unsigned last, ArrayRef<LoadInst*> loads) {
+      auto inBundle = [&](Instruction *I) { return is_contained(stores, I); };
+      SmallVector<Exit, 8> exits;
+      CrossedExits(stores, last, exits);
+      for (StoreInst *SI : stores) {
+        MemoryLocation loc = MemoryLocation::get(SI);
+        for (unsigned p = pos[SI] + 1; p < last; ++p)
+          if (!inBundle(order[p]) && isModOrRefSet(AA.getModRefInfo(order[p], loc))) return false;
+        for (Exit &exit : exits)
+          if (compBlocks.count(exit.to))
+            for (Instruction &I : *exit.to)
+              if (isModOrRefSet(AA.getModRefInfo(&I, loc))) return false;
+      }
+      for (LoadInst *L : loads) {
+        MemoryLocation loc = MemoryLocation::get(L);
+        for (unsigned p = pos[L] + 1; p < last; ++p)
+          if (!inBundle(order[p]) && isModSet(AA.getModRefInfo(order[p], loc))) return false;
+        for (Exit &exit : exits)
+          if (compBlocks.count(exit.to))
+            for (Instruction &I : *exit.to)
+              if (isModSet(AA.getModRefInfo(&I, loc))) return false;
+      }
+      return true;
+    }
+
+    // Pack the stores, by address, and their operand tree. Returns false,
+    // with the IR untouched, if that is illegal or does not pay off.
+    bool Vectorize(ArrayRef<StoreInst*> stores) {
+      nodes.clear();
+      SmallVector<Value*, 8> values;
+      unsigned last = 0;
+      for (StoreInst *SI : stores) {
+        values.push_back(SI->getValueOperand());
+        last = std::max(last, pos[SI]);
+      }
+      unsigned root = Build(values, 0);
+
+      // the scalars the vector code replaces: the stores, and the packed
+      // lanes nothing else uses
+      SmallPtrSet<Instruction*, 32> replaced(stores.begin(), stores.end());
+      SmallVector<LoadInst*, 16> loads;
+      for (Node &N : nodes)
+        if (!N.gather)
+          for (Value *V : N.lanes) {
+            replaced.insert(cast<Instruction>(V));
+            if (LoadInst *L = dyn_cast<LoadInst>(V)) loads.push_back(L);
+          }
+      for (bool shrunk = true; shrunk;) {
+        SmallVector<Instruction*, 8> used;
+        for (Instruction *I : replaced)
+          if (any_of(I->users(), [&](User *U) { return !replaced.count(cast<Instruction>(U)); }))
+            used.push_back(I);
+        for (Instruction *I : used) replaced.erase(I);
+        shrunk = !used.empty();
+      }
+      if (!Legal(stores, last, loads)) return false;
+
+      StoreInst *S0 = stores[0];
+      FixedVectorType *VecTy = VectorOf(nodes[root]);
+      InstructionCost scalar = 0, vector = TTI.getMemoryOpCost(Instruction::Store, VecTy, S0->getAlign(),
+                                                               S0->getPointerAddressSpace());
+      for (Instruction *I : replaced) scalar += TTI.getInstructionCost(I, TargetTransformInfo::TCK_RecipThroughput);
+      for (Node &N : nodes) vector += Cost(N);
+      if (!vector.isValid() || !scalar.isValid() || vector >= scalar) return false;
+
+      IRBuilder<> B(order[last]);
+      Value *ptr = B.CreateBitCast(S0->getPointerOperand(), VecTy->getPointerTo(S0->getPointerAddressSpace()));
+      StoreInst *store = B.CreateAlignedStore(Emit(root, B), ptr, S0->getAlign());
+      SmallVector<Value*, 8> lanes(stores.begin(), stores.end());
+      propagateMetadata(store, lanes);
+      numBundles++;
+      numPacked += stores.size();
+      for (Node &N : nodes)
+        if (!N.gather) numPacked += N.lanes.size();
+      costBefore += *scalar.getValue();
+      costAfter += *vector.getValue();
+      unsigned first = last;
+      for (StoreInst *SI : stores) first = std::min(first, pos[SI]);
+      for (LoadInst *L : loads) first = std::min(first, pos[L]);
+      if (blockOf[first] != blockOf[last]) numAcross++;
+
+      Fallback(stores, last, loads);
+      return true;
+    }
+
+    // Copy the stores onto the exits they were moved across, in program
+    // order, then take the scalars the vector code replaced off the hot
+    // path: dead ones are deleted, the ones a fallback store still needs
+    // are copied onto the exits that need them.
+    void Fallback(ArrayRef<StoreInst*> stores, unsigned last, ArrayRef<LoadInst*> loads) {
+      SmallVector<StoreInst*, 8> inOrder(stores.begin(), stores.end());
+      llvm::sort(inOrder, [&](StoreInst *A, StoreInst *B) { return pos[A] < pos[B]; });
+      SmallVector<Exit, 8> exits;
+      CrossedExits(inOrder, last, exits);
+      DenseMap<std::pair<unsigned, BasicBlock*>, BasicBlock*> exitBlock;
+      for (Exit &exit : exits) {
+        BasicBlock *E = exit.to;
+        if (!compBlocks.count(E)) {
+          BasicBlock *&C = exitBlock[{exit.block, E}];
+          if (!C) {
+            C = SplitExitEdge(blocks[exit.block], E, DTU, ".vec.exit");
+            compBlocks.insert(C);
+          }
+          E = C;
+        }
+        exit.store->clone()->insertBefore(E->getTerminator());
+        numCopies++;
+      }
+
+      SmallPtrSet<Instruction*, 32> erased, candidates;
+      for (StoreInst *SI : stores) {
+        for (Value *op : SI->operands())
+          if (Instruction *I = dyn_cast<Instruction>(op)) candidates.insert(I);
+        SI->eraseFromParent();
+        erased.insert(SI);
+      }
+      for (Node &N : nodes)
+        if (!N.gather)
+          for (Value *V : N.lanes) candidates.insert(cast<Instruction>(V));
+      SmallPtrSet<LoadInst*, 16> packedLoads(loads.begin(), loads.end());
+      // backwards, so the users of an instruction have been dealt with
+      for (unsigned p = order.size(); p-- > 0;) {
+        Instruction *I = order[p];
+        if (erased.count(I) || !candidates.count(I) || isa<PHINode>(I) || I->mayHaveSideEffects()) continue;
+        if (!all_of(I->users(), [&](User *U) { return compBlocks.count(cast<Instruction>(U)->getParent()); }))
+          continue;
+        bool movable = isa<LoadInst>(I) ? packedLoads.count(cast<LoadInst>(I)) > 0
+                                         : isSafeToSpeculativelyExecute(I);
+        if (!I->use_empty() && !movable) continue;
+        SmallDenseMap<BasicBlock*, Instruction*, 4> copyIn;
+        for (Use &U : make_early_inc_range(I->uses())) {
+          BasicBlock *C = cast<Instruction>(U.getUser())->getParent();
+          Instruction *&copy = copyIn[C];
+          if (!copy) {
+            copy = I->clone();
+            copy->setName(I->getName());
+            copy->insertBefore(&*C->getFirstInsertionPt());
+          }
+          U.set(copy);
+        }
+        for (Value *op : I->operands())
+          if (Instruction *OI = dyn_cast<Instruction>(op)) candidates.insert(OI);
+        I->eraseFromParent();
+        erased.insert(I);
+      }
+    }
+  };
+}
+
+namespace TraceCache {
+  typedef std::array<uint8_t, 16> Key;
+
+  // The file: a header, an open addressed table of numBuckets buckets, and
+  // the records, arrays of 32-bit words in host byte order. A bucket without
+  // words is empty.
+  struct Header {
+    uint64_t magic, numBuckets;
+  };
+  struct Bucket {
+    Key key;
+    uint64_t offset, numWords; // in words, from the end of the table
+  };
+  static const uint64_t Magic = 0x3130454843415254ULL; // "TRACHE01"
+
+  void PutDouble(std::vector<uint32_t> &words, double d) {
+    uint64_t bits;
+    memcpy(&bits, &d, 8);
+    words.push_back(uint32_t(bits));
+    words.push_back(uint32_t(bits >> 32));
+  }
+
+  double GetDouble(const uint32_t *words) {
+    uint64_t bits = words[0] | uint64_t(words[1]) << 32;
+    double d;
+    memcpy(&d, &bits, 8);
+    return d;
+  }
+
+  class Cache {
+  public:
+    // Map the file, if there is one. A file that is not a cache is ignored
+    // and replaced on write.
+    explicit Cache(StringRef fileName) : path(fileName.str()) {
+      ErrorOr<std::unique_ptr<MemoryBuffer> > buf =
+          MemoryBuffer::getFile(path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+      if (buf && Valid(**buf)) file = std::move(*buf);
+    }
+
+    // The record of key, from this run or the file.
+    Optional<ArrayRef<uint32_t> > lookup(const Key &key) const {
+      auto it = added.find(key);
+      if (it != added.end()) return makeArrayRef(it->second);
+      if (!file) return None;
+      return Find(*file, key);
+    }
+
+    void insert(const Key &key, std::vector<uint32_t> record) {
+      added[key] = std::move(record);
+    }
+
+    // Merge the records of this run into the file. Runs sharing the file
+    // take turns through a lock file, which only excludes other processes,
+    // and threads of this one through a mutex; the file is replaced by a
+    // rename, so readers that mapped it keep their copy.
+    std::error_code write() {
+      if (added.empty()) return std::error_code();
+      static std::mutex threadLock;
+      std::lock_guard<std::mutex> guard(threadLock);
+      int lockFD;
+      if (std::error_code EC = sys::fs::openFileForReadWrite(path + ".lock", lockFD,
+                                                            sys::fs::CD_OpenAlways, sys::fs::OF_None))
+        return EC;
+      std::error_code EC = sys::fs::lockFile(lockFD);
+      if (!EC) {
+        EC = WriteLocked();
+        sys::fs::unlockFile(lockFD);
+      }
+      sys::Process::SafelyCloseFileDescriptor(lockFD);
+      return EC;
+    }
+
+    unsigned hits = 0, misses = 0;
+
+  private:
+    std::string path;
+    std::unique_ptr<MemoryBuffer> file;
+    std::map<Key, std::vector<uint32_t> > added;
+
+    static uint64_t BucketOf(const Key &key, uint64_t numBuckets) {
+      uint64_t h;
+      memcpy(&h, key.data(), 8);
+      return h & (numBuckets - 1);
+    }
+
+    static bool Valid(const MemoryBuffer &buf) {
+      Header H;
+      if (buf.getBufferSize() < sizeof(H)) return false;
+      memcpy(&H, buf.getBufferStart(), sizeof(H));
+      return H.magic == Magic && isPowerOf2_64(H.numBuckets) &&
+             H.numBuckets <= (buf.getBufferSize() - sizeof(H)) / sizeof(Bucket);
+    }
+
+    // Calls fn(bucket, words) for every record of the valid file buf.
+    template <typename Fn>
+    static void ForEach(const MemoryBuffer &buf, Fn fn) {
+      Header H;
+      memcpy(&H, buf.getBufferStart(), sizeof(H));
+      const char *table = buf.getBufferStart() + sizeof(H);
+      const char *data = table + H.numBuckets * sizeof(Bucket);
+      uint64_t dataWords = (buf.getBufferEnd() - data) / 4;
+      for (uint64_t b = 0; b < H.numBuckets; ++b) {
+        Bucket B;
+        memcpy(&B, table + b * sizeof(Bucket), sizeof(B));
+        if (!B.numWords || B.offset > dataWords || B.numWords > dataWords - B.offset) continue;
+        if (!fn(B, makeArrayRef(reinterpret_cast<const uint32_t*>(data) + B.offset, B.numWords)))
+          return;
+      }
+    }
+
+    static Optional<ArrayRef<uint32_t> > Find(const MemoryBuffer &buf, const Key &key) {
+      Header H;
+      memcpy(&H, buf.getBufferStart(), sizeof(H));
+      const char *table = buf.getBufferStart() + sizeof(H);
+      const char *data = table + H.numBuckets * sizeof(Bucket);
+      uint64_t dataWords = (buf.getBufferEnd() - data) / 4;
+      uint64_t b = BucketOf(key, H.numBuckets);
+      for (uint64_t n = 0; n < H.numBuckets; ++n, b = (b + 1) & (H.numBuckets - 1)) {
+        Bucket B;
+        memcpy(&B, table + b * sizeof(Bucket), sizeof(B));
+        if (!B.numWords) return None;
+        if (B.key != key) continue;
+        if (B.offset > dataWords || B.numWords > dataWords - B.offset) return None;
+        return makeArrayRef(reinterpret_cast<const uint32_t*>(data) + B.offset, B.numWords);
+      }
+      return None;
+    }
+
+    // The records of the file as it is now, which another run may have
+    // written since this one mapped it, and of this run.
+    std::error_code WriteLocked() {
+      std::map<Key, ArrayRef<uint32_t> > all;
+      ErrorOr<std::unique_ptr<MemoryBuffer> > current =
+          MemoryBuffer::getFile(path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+      if (current && Valid(**current))
+        ForEach(**current, [&](const Bucket &B, ArrayRef<uint32_t> words) {
+          all[B.key] = words;
+          return true;
+        });
+      for (auto &rec : added) all[rec.first] = rec.second;
+
+      // at most half full
+      Header H{Magic, NextPowerOf2(2 * all.size())};
+      std::vector<Bucket> table(H.numBuckets, Bucket{Key(), 0, 0});
+      uint64_t numWords = 0;
+      for (auto &rec : all) {
+        uint64_t b = BucketOf(rec.first, H.numBuckets);
+        while (table[b].numWords) b = (b + 1) & (H.numBuckets - 1);
+        table[b] = Bucket{rec.first, numWords, rec.second.size()};
+        numWords += rec.second.size();
+      }
+
+      int FD;
+      SmallString<128> tmpPath;
+      if (std::error_code EC = sys::fs::createUniqueFile(path + ".tmp-%%%%%%", FD, tmpPath))
+        return EC;
+      {
+        raw_fd_ostream OS(FD, /*shouldClose=*/true);
+        OS.write(reinterpret_cast<const char*>(&H), sizeof(H));
+        OS.write(reinterpret_cast<const char*>(table.data()), table.size() * sizeof(Bucket));
+        for (auto &rec : all)
+          OS.write(reinterpret_cast<const char*>(rec.second.data()), rec.second.size() * 4);
+        if (OS.has_error()) {
+          std::error_code EC = OS.error();
+          OS.clear_error();
+          sys::fs::remove(tmpPath);
+          return EC;
+        }
+      }
+      return sys::fs::rename(tmpPath, path);
+    }
+  };
+}
+
+namespace TraceConfig {
+  // The tunable parameters. Heuristics without a hit rate here keep the
+  // static predictor's default.
+  struct Params {
+    double threshold = 0.6;
+    std::map<std::string, double> hitRates; // by heuristic name
+  };
+
+  // Set by HW2SetTraceConfig: replaces the file and the options while set.
+  static std::mutex OverrideLock;
+  static std::string Override;
+
+  // Read JSON text into P. Returns an error message, or "" on success.
+  std::string Parse(StringRef text, Params &P) {
+    Expected<json::Value> V = json::parse(text);
+    if (!V) return toString(V.takeError());
+    const json::Object *root = V->getAsObject();
+    if (!root) return "not an object";
+    if (const json::Value *T = root->get("threshold")) {
+      Optional<double> t = T->getAsNumber();
+      if (!t || *t <= 0 || *t > 1) return "threshold must be in (0, 1]";
+      P.threshold = *t;
+    }
+    if (const json::Value *H = root->get("hitRates")) {
+      if (!H->getAsObject()) return "hitRates must be an object";
+      for (auto &rate : *H->getAsObject()) {
+        Optional<double> r = rate.second.getAsNumber();
+        if (!r || *r <= 0 || *r >= 1) return "hit rate of " + rate.first.str() + " must be in (0, 1)";
+        P.hitRates[rate.first.str()] = *r;
+      }
+    }
+    return "";
+  }
+
+  json::Value ToJSON(const Params &P) {
+    json::Object rates;
+    for (auto &rate : P.hitRates) rates[rate.first] = rate.second;
+    return json::Object{{"threshold", P.threshold}, {"hitRates", std::move(rates)}};
+  }
+
+  // The parameters of this run: the override if set, else the -trace-config
+  // file with the options over it. Errors are reported and leave the
+  // defaults in place.
+  Params Load() {
+    Params P;
+    {
+      std::lock_guard<std::mutex> lock(OverrideLock);
+      if (!Override.empty()) {
+        std::string err = Parse(Override, P);
+        if (!err.empty()) report() << "bad trace config override: " << err << '\n';
+        return P;
+      }
+    }
+    if (!TraceConfigFile.empty()) {
+      ErrorOr<std::unique_ptr<MemoryBuffer> > buf = MemoryBuffer::getFile(TraceConfigFile);
+      std::string err = buf ? Parse((*buf)->getBuffer(), P) : buf.getError().message();
+      if (!err.empty()) {
+        report() << "cannot read trace config " << TraceConfigFile << ": " << err << ", using defaults\n";
+        P = Params();
+      }
+    }
+    if (TraceThreshold.getNumOccurrences()) {
+      if (TraceThreshold > 0 && TraceThreshold <= 1) P.threshold = TraceThreshold;
+      else report() << "-trace-threshold must be in (0, 1], ignored\n";
+    }
+    for (StringRef arg : HeuristicHitRates) {
+      std::pair<StringRef, StringRef> nameRate = arg.split('=');
+      double r;
+      if (nameRate.second.getAsDouble(r) || r <= 0 || r >= 1) {
+        report() << "bad -heuristic-hit-rate " << arg << ", expected name=rate with rate in (0, 1)\n";
+        continue;
+      }
+      P.hitRates[nameRate.first.str()] = r;
+    }
+    // the options spell names with dashes
+    std::map<std::string, double> rates;
+    for (auto &rate : P.hitRates) {
+      std::string name = rate.first;
+      std::replace(name.begin(), name.end(), '-', ' ');
+      rates[name] = rate.second;
+    }
+    P.hitRates = std::move(rates);
+    return P;
+  }
+}
+
+namespace CycleEval {
+  // What a trace costs on the target, from the instruction selected code.
+  struct TraceCycles {
+    unsigned blocks = 0, instrs = 0;
+    unsigned criticalPath = 0;   // longest dependence chain, in cycles
+    unsigned resourceLength = 0; // cycles the trace's instructions need the units for
+    double completion = 0;       // probability of leaving at the end
+    double expected = 0;         // cycles per entry, side exits weighed in
+    double entries = 0;          // per function entry
+  };
+
+  // A machine trace along the blocks of an IR trace. Blocks instruction
+  // selection split stay together; like MachineTraceMetrics' own traces it
+  // does not follow back edges or leave a loop.
+  class SuperblockEnsemble : public MachineTraceMetrics::Ensemble {
+  public:
+    typedef DenseMap<const MachineBasicBlock*, std::pair<unsigned, unsigned> > Positions;
+
+    SuperblockEnsemble(MachineTraceMetrics *MTM, const Positions &where)
+        : Ensemble(MTM), where(where) {}
+
+    const char *getName() const override { return "Superblock"; }
+
+    // The blocks of the trace from head on, once getTrace(head) ran.
+    std::vector<const MachineBasicBlock*> chain(const MachineBasicBlock *head) {
+      std::vector<const MachineBasicBlock*> blocks;
+      for (const MachineBasicBlock *MBB = head; MBB && blocks.size() <= where.size();) {
+        blocks.push_back(MBB);
+        const MachineTraceMetrics::TraceBlockInfo *TBI = getHeightResources(MBB);
+        MBB = TBI ? TBI->Succ : nullptr;
+      }
+      return blocks;
+    }
+
+  private:
+    const Positions &where; // trace and place in it, by block
+
+    // Whether to is next to from on a trace: the next trace block, or more
+    // of the same one.
+    bool follows(const MachineBasicBlock *from, const MachineBasicBlock *to) const {
+      auto f = where.find(from), t = where.find(to);
+      if (f == where.end() || t == where.end() || f->second.first != t->second.first || from == to)
+        return false;
+      return t->second.second == f->second.second + 1 || t->second.second == f->second.second;
+    }
+
+    const MachineBasicBlock *pickTracePred(const MachineBasicBlock *MBB) override {
+      const MachineLoop *L = getLoopFor(MBB);
+      if (L && MBB == L->getHeader()) return nullptr;
+      for (const MachineBasicBlock *pred : MBB->predecessors())
+        if (follows(pred, MBB) && (!L || L->contains(pred)) && getDepthResources(pred))
+          return pred;
+      return nullptr;
+    }
+
+    const MachineBasicBlock *pickTraceSucc(const MachineBasicBlock *MBB) override {
+      const MachineLoop *L = getLoopFor(MBB);
+      for (const MachineBasicBlock *succ : MBB->successors()) {
+        if (!follows(MBB, succ) || (L && succ == L->getHeader())) continue;
+        if (L && !L->contains(succ)) continue;
+        if (getHeightResources(succ)) return succ;
+      }
+      return nullptr;
+    }
+  };
+
+  // Runs after instruction selection on the function traced; the IR blocks
+  // of each trace are held weakly, as the code generator's IR passes may
+  // fold some away.
+  struct CycleEvalPass : public MachineFunctionPass {
+    static char ID;
+    CycleEvalPass(const Function *F, std::vector<std::vector<WeakVH> > traces,
+                  std::vector<Optional<TraceCycles> > &results)
+        : MachineFunctionPass(ID), F(F), traces(std::move(traces)), results(results) {}
+
+    void getAnalysisUsage(AnalysisUsage &AU) const override {
+      AU.addRequired<MachineTraceMetrics>();
+      AU.addRequired<MachineBranchProbabilityInfo>();
+      AU.addRequired<MachineBlockFrequencyInfo>();
+      AU.addRequired<MachineLoopInfo>();
+      AU.setPreservesAll();
+      MachineFunctionPass::getAnalysisUsage(AU);
+    }
+
+    bool runOnMachineFunction(MachineFunction &MF) override {
+      if (&MF.getFunction() != F) return false;
+      // places among the blocks left, so the trace closes over folded ones
+      DenseMap<const BasicBlock*, std::pair<unsigned, unsigned> > irWhere;
+      for (unsigned idx = 0; idx < traces.size(); ++idx) {
+        unsigned pos = 0;
+        for (WeakVH &V : traces[idx])
+          if (BasicBlock *BB = cast_or_null<BasicBlock>(V)) irWhere[BB] = {idx, pos++};
+      }
+      // the first block of the earliest surviving part heads the trace
+      SuperblockEnsemble::Positions where;
+      std::vector<const MachineBasicBlock*> heads(traces.size(), nullptr);
+      for (MachineBasicBlock &MBB : MF) {
+        auto it = MBB.getBasicBlock() ? irWhere.find(MBB.getBasicBlock()) : irWhere.end();
+        if (it == irWhere.end()) continue;
+        where[&MBB] = it->second;
+        const MachineBasicBlock *&head = heads[it->second.first];
+        if (!head || where[head].second > it->second.second) head = &MBB;
+      }
+
+      MachineTraceMetrics &MTM = getAnalysis<MachineTraceMetrics>();
+      MachineBranchProbabilityInfo &MBPI = getAnalysis<MachineBranchProbabilityInfo>();
+      MachineBlockFrequencyInfo &MBFI = getAnalysis<MachineBlockFrequencyInfo>();
+      SuperblockEnsemble E(&MTM, where);
+      results.assign(traces.size(), None);
+      for (unsigned idx = 0; idx < traces.size(); ++idx) {
+        if (!heads[idx]) continue;
+        // centred at the head the trace has every height, at the tail every depth
+        MachineTraceMetrics::Trace fromHead = E.getTrace(heads[idx]);
+        std::vector<const MachineBasicBlock*> blocks = E.chain(heads[idx]);
+        MachineTraceMetrics::Trace fromTail = E.getTrace(blocks.back());
+        TraceCycles C;
+        C.blocks = blocks.size();
+        C.entries = double(MBFI.getBlockFreq(heads[idx]).getFrequency()) / MBFI.getEntryFreq();
+        C.instrs = fromHead.getInstrCount();
+        C.resourceLength = fromTail.getResourceLength();
+        for (const MachineBasicBlock *MBB : blocks)
+          for (const MachineInstr &MI : *MBB) {
+            MachineTraceMetrics::InstrCycles IC = fromTail.getInstrCycles(MI);
+            C.criticalPath = std::max(C.criticalPath, IC.Depth + IC.Height);
+          }
+        unsigned cycles = std::max(C.criticalPath, C.resourceLength);
+        // a side exit costs what it took to resolve its branch
+        double reach = 1;
+        for (unsigned i = 0; i + 1 < blocks.size(); ++i) {
+          BranchProbability stay = MBPI.getEdgeProbability(blocks[i], blocks[i + 1]);
+          double leave = reach * (1 - double(stay.getNumerator()) / stay.getDenominator());
+          MachineBasicBlock::const_iterator T = blocks[i]->getFirstTerminator();
+          unsigned exitCycles = T == blocks[i]->end() ? 0 : fromTail.getInstrCycles(*T).Depth + 1;
+          C.expected += leave * std::min(exitCycles, cycles);
+          reach -= leave;
+        }
+        C.completion = reach;
+        C.expected += reach * cycles;
+        results[idx] = C;
+      }
+      return false;
+    }
+
+    const Function *F;
+    std::vector<std::vector<WeakVH> > traces;
+    std::vector<Optional<TraceCycles> > &results;
+  };
+  char CycleEvalPass::ID = 0;
+
+  // Lower a copy of F, its module's other functions declared only, for the
+  // target of the module, and estimate the cycles of each of traces.
+  // Returns an error message, or "" on success.
+  std::string Estimate(Function &F, ArrayRef<std::vector<BasicBlock*> > traces,
+                       std::vector<Optional<TraceCycles> > &results) {
+    static std::once_flag initialized;
+    std::call_once(initialized, [] {
+      InitializeNativeTarget();
+      PassRegistry &Registry = *PassRegistry::getPassRegistry();
+      initializeCore(Registry);
+      initializeCodeGen(Registry);
+      initializeTarget(Registry);
+      initializeScalarOpts(Registry);
+      initializeTransformUtils(Registry);
+    });
+    Module &M = *F.getParent();
+    Triple TT(M.getTargetTriple().empty() ? sys::getDefaultTargetTriple() : M.getTargetTriple());
+    std::string err;
+    const Target *T = TargetRegistry::lookupTarget(TT.str(), err);
+    if (!T) return err;
+    std::string CPU = TraceCycleCPU.empty() ? sys::getHostCPUName().str() : TraceCycleCPU;
+    std::unique_ptr<TargetMachine> TM(T->createTargetMachine(TT.str(), CPU, "", TargetOptions(), None,
+                                                             None, CodeGenOpt::Default));
+    if (!TM) return "no target machine for " + TT.str();
+
+    ValueToValueMapTy VMap;
+    std::unique_ptr<Module> copy = CloneModule(M, VMap, [&](const GlobalValue *G) { return G == &F; });
+    copy->setTargetTriple(TT.str());
+    copy->setDataLayout(TM->createDataLayout());
+    std::vector<std::vector<WeakVH> > blocks;
+    for (ArrayRef<BasicBlock*> trace : traces) {
+      blocks.emplace_back();
+      for (BasicBlock *BB : trace) blocks.back().emplace_back(cast<BasicBlock>(VMap[BB]));
+    }
+
+    legacy::PassManager PM;
+    LLVMTargetMachine &LTM = static_cast<LLVMTargetMachine&>(*TM);
+    TargetPassConfig *TPC = LTM.createPassConfig(PM);
+    PM.add(TPC);
+    PM.add(new MachineModuleInfoWrapperPass(&LTM));
+    if (TPC->addISelPasses()) return "cannot select instructions for " + TT.str();
+    PM.add(new CycleEvalPass(cast<Function>(VMap[&F]), std::move(blocks), results));
+    TPC->setInitialized();
+    PM.run(*copy);
+    return "";
+  }
+}
+
+namespace BaseTrace {
+  // Why a trace stops growing: predict finds no successor past a hazard, or
+  // none likely enough, or none at all; or the predicted one is a loop
+  // header reached through a back edge, or already on a trace.
+  enum TraceEnd {
+    EndHazard,
+    EndLowProbability,
+    EndExit,
+    EndBackEdge,
+    EndVisited,
+    NumTraceEnds
+  };
+  static const char *TraceEndName[NumTraceEnds] = {
+    "hazard", "lowProbability", "exit", "backEdge", "visited"};
+
+  // The analyses of the function a trace pass runs on, from whichever pass
+  // manager runs it. The optional ones are only there when a flag or the
+  // pass asks for them.
+  struct FunctionAnalyses {
+    LoopInfo *LI;
+    DominatorTree *DT;
+    PostDominatorTree *PDT;
+    BranchProbabilityInfo *BPI;
+    BlockFrequencyInfo *BFI;
+    TargetLibraryInfo *TLI = nullptr;
+    const TargetTransformInfo *TTI = nullptr;
+    AAResults *AA = nullptr;
+    MemorySSA *MSSA = nullptr;
+    const CallSummary::CallSummaryInfo *CS = nullptr;
+  };
+
+  struct BaseTracePass : public FunctionPass {
+    static char ID;
+    BaseTracePass() : FunctionPass(ID) {};
+    BaseTracePass(char &id): FunctionPass(id) {};
+
+    // Grow a trace from seedBB and append it to the trace arrays.
+    void GrowTrace(BasicBlock* seedBB, DominatorTree &DT, PostDominatorTree &PDT, Function &F, BranchProbabilityInfo &BPI) {
+      unsigned idx = traceRanges.size();
+      traceRanges.push_back(TraceRange{unsigned(traceBlocks.size()), 0, nullptr});
+      BasicBlock *currBB = seedBB;
+      while (1) {
+        traceBlocks.push_back(currBB);
+        traceRanges[idx].size++;
+        traceOf[currBB] = idx;
+        BasicBlock *likelyBB = predict(currBB, F, PDT, BPI);
+        if (likelyBB && traceOf.count(likelyBB)) traceRanges[idx].next = likelyBB;
+        if (!likelyBB) {
+          traceRanges[idx].end = NoPrediction(currBB);
+          break;
+        }
+        if (DT.dominates(&likelyBB->front(), &currBB->front())) {
+          traceRanges[idx].end = EndBackEdge;
+          break;
+        }
+        if (traceOf.count(likelyBB)) {
+          traceRanges[idx].end = EndVisited;
+          break;
+        }
+        currBB = likelyBB;
+      }
+    }
+
+    // Hazard kinds of a block, by the same analyses as its hazard bit.
+    unsigned HazardKindsOf(BasicBlock *BB) {
+      if (!containHazard(BB)) return 0;
+      MemorySSA *MSSA = blockNum.count(BB) ? analyses.MSSA : nullptr;
+      return hazardKinds(BB, MSSA, MSSA ? analyses.AA : nullptr, CS);
+    }
+
+    // Metrics of trace idx, entered entries times and completed with
+    // probability completion, as a remark and appended to stats.
+    void ReportTraceMetrics(OptimizationRemarkEmitter &ORE, unsigned idx, uint64_t entries,
+                            double completion, Optional<double> measured, json::Array &stats) {
+      ArrayRef<BasicBlock*> trace = getTrace(idx);
+      unsigned instrs = 0, hazardBlocks = 0, kinds[NumHazardKinds] = {};
+      for (BasicBlock *BB : trace) {
+        instrs += BB->size();
+        unsigned K = HazardKindsOf(BB);
+        if (K) hazardBlocks++;
+        for (unsigned k = 0; k < NumHazardKinds; ++k)
+          if (K & 1u << k) kinds[k]++;
+      }
+      const char *end = TraceEndName[traceRanges[idx].end];
+      ORE.emit([&]() {
+        OptimizationRemarkAnalysis R(TraceRemarkPass, "Trace", &trace.front()->front());
+        R << "trace of " << ore::NV("Blocks", unsigned(trace.size())) << " blocks, "
+          << ore::NV("Instructions", instrs) << " instructions, "
+          << ore::NV("Hazards", hazardBlocks) << " hazard blocks";
+        const char *sep = " (";
+        for (unsigned k = 0; k < NumHazardKinds; ++k) {
+          if (!kinds[k]) continue;
+          R << sep << HazardKindName[k] << " " << ore::NV(HazardKindName[k], kinds[k]);
+          sep = ", ";
+        }
+        if (*sep == ',') R << ")";
+        R << ", entered " << ore::NV("EntryCount", entries) << " times, completes "
+          << ore::NV("PredictedCompletion", formatv("{0:f3}", completion).str());
+        if (measured) R << " (measured " << ore::NV("MeasuredCompletion", formatv("{0:f3}", *measured).str()) << ")";
+        R << ", ends at " << ore::NV("End", end);
+        return R;
+      });
+      if (TraceStatsJson.empty()) return;
+      json::Object hazardsByKind;
+      for (unsigned k = 0; k < NumHazardKinds; ++k) hazardsByKind[HazardKindName[k]] = kinds[k];
+      json::Object T{{"head", trace.front()->getName().str()},
+                     {"blocks", trace.size()},
+                     {"instructions", instrs},
+                     {"hazards", hazardBlocks},
+                     {"hazardsByKind", std::move(hazardsByKind)},
+                     {"entryCount", int64_t(entries)},
+                     {"predictedCompletion", completion},
+                     {"end", end}};
+      if (measured) T["measuredCompletion"] = *measured;
+      stats.push_back(std::move(T));
+    }
+
+    // The function's totals over its traces of more than one block, as a
+    // remark, and with traces, its entry in the JSON summary.
+    void ReportFunctionMetrics(OptimizationRemarkEmitter &ORE, Function &F, double completion,
+                               Optional<double> measured, json::Array traces) {
+      unsigned numTraces = 0, blocks = 0, instrs = 0, hazardBlocks = 0;
+      for (unsigned idx = 0; idx < traceRanges.size(); ++idx) {
+        ArrayRef<BasicBlock*> trace = getTrace(idx);
+        if (trace.size() <= 1) continue;
+        numTraces++;
+        blocks += trace.size();
+        for (BasicBlock *BB : trace) {
+          instrs += BB->size();
+          if (containHazard(BB)) hazardBlocks++;
+        }
+      }
+      ORE.emit([&]() {
+        OptimizationRemarkAnalysis R(TraceRemarkPass, "TraceSummary", F.getSubprogram(), &F.getEntryBlock());
+        R << ore::NV("Traces", numTraces) << " traces of " << ore::NV("Blocks", blocks) << " blocks, "
+          << ore::NV("Instructions", instrs) << " instructions, " << ore::NV("Hazards", hazardBlocks)
+          << " hazard blocks, average completion "
+          << ore::NV("AverageCompletion", formatv("{0:f3}", completion).str());
+        if (measured) R << " (measured " << ore::NV("MeasuredCompletion", formatv("{0:f3}", *measured).str()) << ")";
+        return R;
+      });
+      if (TraceStatsJson.empty()) return;
+      json::Object S{{"module", F.getParent()->getModuleIdentifier()},
+                     {"function", F.getName().str()},
+                     {"traces", numTraces},
+                     {"blocks", blocks},
+                     {"instructions", instrs},
+                     {"hazards", hazardBlocks},
+                     {"averageCompletion", completion},
+                     {"traceList", std::move(traces)}};
+      if (measured) S["measuredCompletion"] = *measured;
+      AddTraceStats(F, std::move(S));
+    }
+
+    // Why predict has no successor for BB: a hazard in it or on every way
+    // out, no way out, or none likely enough.
+    TraceEnd NoPrediction(BasicBlock *BB) {
+      if (containHazard(BB)) return EndHazard;
+      if (succ_empty(BB)) return EndExit;
+      for (BasicBlock *succ : successors(BB))
+        if (!containHazard(succ)) return EndLowProbability;
+      return EndHazard;
+    }
+
+    ArrayRef<BasicBlock*> getTrace(unsigned i) const {
+      return makeArrayRef(traceBlocks).slice(traceRanges[i].begin, traceRanges[i].size);
+    }
+
+    // Read the counters written by the profiling runtime.
+    void ReadProfile(StringRef fileName) {
+      ErrorOr<std::unique_ptr<MemoryBuffer> > buf = MemoryBuffer::getFile(fileName);
+      if (!buf) {
+        report() << "cannot read profile " << fileName << '\n';
+        return;
+      }
+      const char *p = (*buf)->getBufferStart(), *end = (*buf)->getBufferEnd();
+      auto read = [&](uint64_t &v) {
+        if (end - p < 8) return false;
+        memcpy(&v, p, 8);
+        p += 8;
+        return true;
+      };
+      uint64_t magic, numFns, len, checksum, numPaths;
+      if (!read(magic) || magic != 0x3130485441504c42ULL || !read(numFns)) {
+        report() << "not a profile: " << fileName << '\n';
+        return;
+      }
+      for (uint64_t i = 0; i < numFns; ++i) {
+        if (!read(len) || uint64_t(end - p) < len) break;
+        StringRef name(p, len);
+        p += (len + 7) & ~7ULL;
+        if (!read(checksum) || !read(numPaths) || uint64_t(end - p) / 8 < numPaths) break;
+        ProfileCounts &PC = profileCounts[name];
+        PC.checksum = checksum;
+        PC.counts.resize(numPaths);
+        memcpy(PC.counts.data(), p, numPaths * 8);
+        p += numPaths * 8;
+      }
+    }
+
+    // Decode the executed paths of F, if the profile was taken on this CFG.
+    void LoadPaths(Function &F) {
+      pathBlocks.clear();
+      pathRanges.clear();
+      pathsThrough.clear();
+      pathBackEdges.clear();
+      pathsLoaded = false;
+      auto it = profileCounts.find(F.getName());
+      if (it == profileCounts.end()) return;
+      std::vector<uint64_t> &counts = it->second.counts;
+      PathProfile::BallLarusDAG dag(F, counts.size());
+      if (!dag.valid || dag.numPaths != counts.size() || dag.checksum != it->second.checksum) {
+        report() << "path profile of " << F.getName() << " does not match its CFG\n";
+        return;
+      }
+      for (uint64_t id = 0; id < counts.size(); ++id) {
+        if (!counts[id]) continue;
+        std::vector<BasicBlock*> path = dag.decode(id);
+        for (unsigned pos = 0; pos < path.size(); ++pos)
+          pathsThrough[path[pos]].push_back({pathRanges.size(), pos});
+        pathRanges.push_back(PathRange{unsigned(pathBlocks.size()), unsigned(path.size()), counts[id]});
+        pathBlocks.insert(pathBlocks.end(), path.begin(), path.end());
+      }
+      pathBackEdges = std::move(dag.backEdges);
+      pathsLoaded = true;
+    }
+
+    // Calls fn(count, next) for every execution of blocks, next being the
+    // block after it on the path or null. Returns false if the path profile
+    // cannot tell: there is none, or blocks follows a back edge, which
+    // splits paths.
+    template <typename Fn>
+    bool ForEachPathThrough(ArrayRef<BasicBlock*> blocks, Fn fn) {
+      if (!pathsLoaded) return false;
+      for (unsigned i = 1; i < blocks.size(); ++i)
+        if (pathBackEdges.count({blocks[i-1], blocks[i]})) return false;
+      auto it = pathsThrough.find(blocks.front());
+      if (it == pathsThrough.end()) return true;
+      for (std::pair<unsigned, unsigned> &occ : it->second) {
+        PathRange &P = pathRanges[occ.first];
+        ArrayRef<BasicBlock*> path = makeArrayRef(pathBlocks).slice(P.begin, P.size);
+        if (occ.second + blocks.size() > path.size()) continue;
+        if (path.slice(occ.second, blocks.size()) != blocks) continue;
+        unsigned nextPos = occ.second + blocks.size();
+        fn(P.count, nextPos < path.size() ? path[nextPos] : nullptr);
+      }
+      return true;
+    }
+
+    // Traces the exit counters are for, those of more than one block, and a
+    // checksum of their blocks.
+    uint64_t MeasuredTraces(std::vector<unsigned> &ids) {
+      uint64_t checksum = 14695981039346656037ULL;
+      auto mix = [&](uint64_t v) { checksum = (checksum ^ v) * 1099511628211ULL; };
+      for (unsigned idx = 0; idx < traceRanges.size(); ++idx) {
+        if (traceRanges[idx].size <= 1) continue;
+        ids.push_back(idx);
+        for (BasicBlock *BB : getTrace(idx)) mix(blockNum[BB]);
+        mix(~0ULL);
+      }
+      return checksum;
+    }
+
+    // Count the entries into the head of every trace, and the exits off it
+    // before its last block. Only executions that entered at the head count:
+    // the head sets a per call register to the trace and side entrances
+    // clear it. Edges along a trace carry no code.
+    bool InstrumentTraceExits(Function &F) {
+      std::vector<unsigned> ids;
+      uint64_t checksum = MeasuredTraces(ids);
+      if (ids.empty()) return false;
+      DenseMap<BasicBlock*, std::pair<unsigned, unsigned> > where; // trace, position
+      for (unsigned k = 0; k < ids.size(); ++k) {
+        ArrayRef<BasicBlock*> trace = getTrace(ids[k]);
+        for (unsigned pos = 0; pos < trace.size(); ++pos) where[trace[pos]] = {k, pos};
+      }
+
+      // collect first: splitting edges changes the CFG
+      struct EdgeAction {
+        BasicBlock *from, *to;
+        int exitOf;  // trace left early, or -1
+        bool reset;  // side entrance
+      };
+      std::vector<EdgeAction> actions;
+      for (BasicBlock &BB : F) {
+        auto from = where.find(&BB);
+        SmallPtrSet<BasicBlock*, 4> seen;
+        for (BasicBlock *succ : successors(&BB)) {
+          if (!seen.insert(succ).second) continue;
+          auto to = where.find(succ);
+          if (from != where.end() && to != where.end() && from->second.first == to->second.first &&
+              to->second.second == from->second.second + 1)
+            continue;
+          int exitOf = -1;
+          if (from != where.end() && from->second.second + 1 < traceRanges[ids[from->second.first]].size)
+            exitOf = from->second.first;
+          bool reset = to != where.end() && to->second.second > 0;
+          if (exitOf >= 0 || reset) actions.push_back(EdgeAction{&BB, succ, exitOf, reset});
+        }
+      }
+
+      GlobalVariable *counts = PathProfile::CreateCounters(F, "traces", 2 * ids.size());
+      IRBuilder<> B(&*F.getEntryBlock().getFirstInsertionPt());
+      AllocaInst *cur = B.CreateAlloca(B.getInt32Ty(), nullptr, "curtrace");
+      StoreInst *init = B.CreateStore(B.getInt32(-1), cur);
+      // heads first, so that exit code placed at the top of a head runs
+      // before the head claims the register
+      for (unsigned k = 0; k < ids.size(); ++k) {
+        BasicBlock *head = getTrace(ids[k]).front();
+        IRBuilder<> HB(head == &F.getEntryBlock() ? init->getNextNode() : &*head->getFirstInsertionPt());
+        PathProfile::AddToCounter(HB, counts, 2 * k, HB.getInt64(1));
+        HB.CreateStore(HB.getInt32(k), cur);
+      }
+      for (EdgeAction &A : actions) {
+        IRBuilder<> EB(PathProfile::EdgeInsertPoint(A.from, A.to));
+        if (A.exitOf >= 0) {
+          Value *entered = EB.CreateICmpEQ(EB.CreateLoad(EB.getInt32Ty(), cur), EB.getInt32(A.exitOf));
+          PathProfile::AddToCounter(EB, counts, 2 * A.exitOf + 1, EB.CreateZExt(entered, EB.getInt64Ty()));
+        }
+        if (A.reset) EB.CreateStore(EB.getInt32(-1), cur);
+      }
+      // registered per function, a function pass has no later chance to
+      // change the module before it is written
+      Module &M = *F.getParent();
+      PathProfile::EmitCounterRegistration(
+          M, PathProfile::CounterTableEntry(M, ("trace:" + F.getName()).str(), checksum, counts));
+      report() << "trace counters: " << ids.size() << " traces, " << actions.size() << " instrumented edges\n\n";
+      return true;
+    }
+
+    // Measured entries and exits of the traces just formed, if the profile
+    // has counters for exactly these traces.
+    void LoadTraceCounts(Function &F) {
+      traceMeasured.clear();
+      auto it = profileCounts.find(("trace:" + F.getName()).str());
+      if (it == profileCounts.end()) return;
+      std::vector<unsigned> ids;
+      uint64_t checksum = MeasuredTraces(ids);
+      std::vector<uint64_t> &counts = it->second.counts;
+      if (checksum != it->second.checksum || counts.size() != 2 * ids.size()) {
+        report() << "trace counters of " << F.getName() << " were taken on other traces\n";
+        return;
+      }
+      for (unsigned k = 0; k < ids.size(); ++k)
+        traceMeasured[ids[k]] = {counts[2 * k], counts[2 * k + 1]};
+    }
+
+    // Exact entries into the trace head and runs through the whole trace.
+    bool PathCompletion(ArrayRef<BasicBlock*> trace, uint64_t &in, uint64_t &out) {
+      in = out = 0;
+      bool covered = ForEachPathThrough(trace.take_front(), [&](uint64_t count, BasicBlock *next) {
+        in += count;
+      });
+      return covered && ForEachPathThrough(trace, [&](uint64_t count, BasicBlock *next) {
+        out += count;
+      });
+    }
+
+    // Hash of what the traces of F depend on, for the trace cache: the pass
+    // and its options, the IR with values numbered in order, the branch
+    // weights and entry count, the hazards and the path profile. Names of
+    // local values and debug info do not count.
+    TraceCache::Key CacheKey(Function &F) {
+      MD5 Hash;
+      auto word = [&](uint64_t v) {
+        Hash.update(makeArrayRef(reinterpret_cast<const uint8_t*>(&v), sizeof(v)));
+      };
+      auto printed = [&](auto *X) {
+        std::string str;
+        raw_string_ostream OS(str);
+        X->print(OS);
+        Hash.update(OS.str());
+      };
+      Hash.update("trace-cache 3");
+      Hash.update(getPassName());
+      word(thresProb);
+      for (auto &rate : params.hitRates) {
+        Hash.update(rate.first);
+        word(DoubleToBits(rate.second));
+      }
+      word(PeelCases);
+      word(DominantCasePercent);
+
+      DenseMap<const Value*, unsigned> local;
+      DenseMap<Type*, unsigned> types; // printed once, then by number
+      for (Argument &A : F.args()) local[&A] = local.size();
+      for (BasicBlock &BB : F) {
+        local[&BB] = local.size();
+        for (Instruction &I : BB) local[&I] = local.size();
+      }
+      auto type = [&](Type *T) {
+        auto ins = types.insert({T, types.size()});
+        word(ins.first->second);
+        if (ins.second) printed(T);
+      };
+      auto operand = [&](Value *V) {
+        auto it = local.find(V);
+        if (it != local.end()) {
+          word(0);
+          word(it->second);
+        } else if (GlobalValue *G = dyn_cast<GlobalValue>(V)) {
+          word(1);
+          Hash.update(G->getName());
+        } else if (ConstantInt *C = dyn_cast<ConstantInt>(V)) {
+          word(2);
+          type(C->getType());
+          const APInt &val = C->getValue();
+          for (unsigned i = 0; i < val.getNumWords(); ++i) word(val.getRawData()[i]);
+        } else if (isa<MetadataAsValue>(V)) {
+          word(3); // debug info
+        } else {
+          word(4);
+          type(V->getType());
+          printed(V);
+        }
+      };
+
+      word(F.arg_size());
+      for (Argument &A : F.args()) type(A.getType());
+      Optional<Function::ProfileCount> entry = F.getEntryCount();
+      word(entry ? entry->getCount() + 1 : 0);
+      for (BasicBlock &BB : F) {
+        word(BB.size());
+        word(hazards[blockNum[&BB]]);
+        for (Instruction &I : BB) {
+          word(I.getOpcode());
+          type(I.getType());
+          if (CmpInst *C = dyn_cast<CmpInst>(&I)) word(C->getPredicate());
+          if (CallBase *CB = dyn_cast<CallBase>(&I)) {
+            word(CB->hasFnAttr(Attribute::Cold));
+            word(CB->doesNotReturn());
+          }
+          if (MDNode *prof = I.getMetadata(LLVMContext::MD_prof)) {
+            word(prof->getNumOperands());
+            for (const MDOperand &op : prof->operands()) {
+              if (MDString *str = dyn_cast<MDString>(op)) Hash.update(str->getString());
+              else if (ConstantInt *C = mdconst::dyn_extract<ConstantInt>(op)) word(C->getZExtValue());
+            }
+          }
+          word(I.getNumOperands());
+          for (Value *V : I.operands()) operand(V);
+        }
+      }
+
+      word(pathsLoaded);
+      if (pathsLoaded) {
+        ProfileCounts &PC = profileCounts.find(F.getName())->second;
+        word(PC.checksum);
+        for (uint64_t count : PC.counts) word(count);
+      }
+      MD5::MD5Result result;
+      Hash.final(result);
+      return result.Bytes;
+    }
+
+    // The traces of the function as words, blocks by their place in F.
+    void SaveTraces(Function &F, std::vector<uint32_t> &words) {
+      DenseMap<BasicBlock*, unsigned> index;
+      for (BasicBlock &BB : F) index[&BB] = index.size();
+      words.push_back(traceRanges.size());
+      for (TraceRange &range : traceRanges) {
+        words.push_back(range.size);
+        words.push_back(range.next ? index[range.next] + 1 : 0);
+        words.push_back(range.end);
+        for (BasicBlock *BB : makeArrayRef(traceBlocks).slice(range.begin, range.size))
+          words.push_back(index[BB]);
+      }
+    }
+
+    // Read back what SaveTraces wrote, in place of growing the traces.
+    // Returns false, with no traces, if the words do not fit F.
+    bool RestoreTraces(Function &F, ArrayRef<uint32_t> words) {
+      std::vector<BasicBlock*> blocks;
+      for (BasicBlock &BB : F) blocks.push_back(&BB);
+      auto fail = [&]() {
+        traceBlocks.clear();
+        traceRanges.clear();
+        traceOf.clear();
+        return false;
+      };
+      if (words.empty()) return fail();
+      uint32_t numTraces = words[0];
+      size_t pos = 1;
+      for (uint32_t t = 0; t < numTraces; ++t) {
+        if (words.size() - pos < 3) return fail();
+        uint32_t size = words[pos], next = words[pos + 1], end = words[pos + 2];
+        pos += 3;
+        if (!size || words.size() - pos < size || next > blocks.size() || end >= NumTraceEnds)
+          return fail();
+        traceRanges.push_back(TraceRange{unsigned(traceBlocks.size()), size,
+                                         next ? blocks[next - 1] : nullptr, TraceEnd(end)});
+        for (uint32_t i = 0; i < size; ++i, ++pos) {
+          if (words[pos] >= blocks.size() || !traceOf.insert({blocks[words[pos]], t}).second)
+            return fail();
+          traceBlocks.push_back(blocks[words[pos]]);
+        }
+      }
+      // every block is on exactly one trace
+      if (pos != words.size() || traceBlocks.size() != blocks.size()) return fail();
+      return true;
+    }
+
+    // Hazard bit of a block, computed once per function in runOnFunction.
+    bool containHazard(BasicBlock *BB) {
+      auto it = blockNum.find(BB);
+      if (it == blockNum.end()) return classifyHazard(BB, nullptr, nullptr, CS); // created since
+      return hazards[it->second];
+    }
+
+    bool runOnFunction(Function &F) override {
+      FunctionAnalyses FA;
+      FA.LI = &getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
+      FA.DT = &getAnalysis<DominatorTreeWrapperPass>().getDomTree();
+      FA.PDT = &getAnalysis<PostDominatorTreeWrapperPass>().getPostDomTree();
+      FA.BPI = &getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI();
+      FA.BFI = &getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
+      if (needsTLI()) FA.TLI = &getAnalysis<TargetLibraryInfoWrapperPass>().getTLI(F);
+      if (needsTTI()) FA.TTI = &getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
+      if (needsAA()) FA.AA = &getAnalysis<AAResultsWrapperPass>().getAAResults();
+      if (AliasHazards) FA.MSSA = &getAnalysis<MemorySSAWrapperPass>().getMSSA();
+      if (UseCallSummaries) FA.CS = &getAnalysis<CallSummary::CallSummaryPass>().getInfo();
+      return runTraces(F, FA);
+    }
+
+    // The work of runOnFunction, for either pass manager.
+    bool runTraces(Function &F, const FunctionAnalyses &FA) {
+      analyses = FA;
+      if (unsized.erase(&F)) moduleBudget += uint64_t(F.getInstructionCount()) * SBModuleGrowth / 100;
+      LoopInfo &LI = *FA.LI;
+      DominatorTree &DT = *FA.DT;
+      PostDominatorTree &PDT = *FA.PDT;
+      BranchProbabilityInfo &BPI = *FA.BPI;
+      BlockFrequencyInfo &BFI = *FA.BFI;
+
+      bool converted = Hyperblocks && FormHyperblocks(F, BPI);
+      if (converted) RecomputeAnalyses(F, LI, DT, PDT, BPI, BFI);
+
+      // all trace state is per function; the arrays keep their capacity, so
+      // memory stays flat over the module. Blocks of an earlier function may
+      // have been deleted by its transforms.
+      traceBlocks.clear();
+      traceRanges.clear();
+      traceOf.clear();
+      blockNum.clear();
+      hazards.clear();
+      hazards.resize(F.size());
+      MemorySSA *MSSA = FA.MSSA;
+      AAResults *AA = MSSA ? FA.AA : nullptr;
+      CS = FA.CS;
+      unsigned num = 0, aliasRemoved = 0, callRemoved = 0;
+      LoadPaths(F);
+      for (BasicBlock &BB : F) {
+        if (classifyHazard(&BB)) {
+          if ((MSSA || CS) && !classifyHazard(&BB, MSSA, AA, CS)) {
+            // credit alias analysis if it alone clears the block
+            if (MSSA && !classifyHazard(&BB, MSSA, AA)) aliasRemoved++;
+            else callRemoved++;
+          } else {
+            hazards.set(num);
+          }
+        }
+        blockNum[&BB] = num++;
+      }
+
+      // a cache record is the predictions, behind their length, then the
+      // traces; the predictions are still needed to annotate and peel
+      TraceCache::Key cacheKey;
+      Optional<ArrayRef<uint32_t> > cached;
+      std::vector<uint32_t> record;
+      if (cache) {
+        cacheKey = CacheKey(F);
+        cached = cache->lookup(cacheKey);
+        if (cached && (cached->empty() || (*cached)[0] >= cached->size() ||
+                       !loadPredictions(F, cached->slice(1, (*cached)[0]))))
+          cached.reset();
+      }
+      if (!cached) {
+        prepare(F, LI, PDT);
+        if (cache) {
+          record.push_back(0);
+          savePredictions(F, blockNum, record);
+          record[0] = record.size() - 1;
+        }
+      }
+      bool annotated = annotate(F);
+      bool peeled = PeelCases && PeelDominantCases(F, BPI, MSSA, AA);
+      if (peeled) RecomputeAnalyses(F, LI, DT, PDT, BPI, BFI);
+      bool restored = cached && RestoreTraces(F, cached->drop_front(1 + (*cached)[0]));
+
+      std::vector<Loop*> allLoops = FindAllLoops(LI);
+
+      // sort the loops based on depth
+      std::sort(allLoops.begin(), allLoops.end(), CompareLoopDepth);
+
+      // create block list based on loop
+      for (Loop* L : allLoops) {
+        report() << "\nLoop " << L->getLoopDepth() << '\n';
+        if (restored) continue;
+        for (BasicBlock* BB : L->getBlocksVector()) {
+          if (!traceOf.count(BB) && !inSubLoop(BB, L, &LI)) {
+            GrowTrace(BB, DT, PDT, F, BPI);
+          }
+          // errs() << BB->getName() << '\n';
+        }
+      }
+
+      // errs() << "\nFunc\n";
+      for (BasicBlock &BB : F) {
+        if (restored) break;
+        if (!traceOf.count(&BB)) {
+          GrowTrace(&BB, DT, PDT, F, BPI);
+        }
+        // errs() << BB.getName() << '\n';
+      }
+
+      if (cache && restored) {
+        cache->hits++;
+      } else if (cache) {
+        cache->misses++;
+        // a record that no longer fits keeps its predictions
+        if (cached) record.assign(cached->begin(), cached->begin() + 1 + (*cached)[0]);
+        SaveTraces(F, record);
+        cache->insert(cacheKey, std::move(record));
+      }
+
+      LoadTraceCounts(F);
+
+      // evaluation
+        double total_in = 0;
+        double total_out = 0;
+        uint64_t total_measured_in = 0, total_measured_out = 0;
+        int total_hazard = 0;
+        TraceTotals totals;
+        OptimizationRemarkEmitter ORE(&F, &BFI);
+        bool metrics = ORE.enabled() || !TraceStatsJson.empty();
+        json::Array traceStats;
+        for (unsigned idx = 0; idx < traceRanges.size(); ++idx) {
+            ArrayRef<BasicBlock*> trace = getTrace(idx);
+            if (trace.size() <= 1) continue;
+            BasicBlock *head = trace.front();
+            int totalHazard = 0;
+            // without a profile, fall back to the estimated block frequency
+            Optional<uint64_t> head_count = BFI.getBlockProfileCount(head);
+            uint64_t init_in_count = head_count ? *head_count : BFI.getBlockFreq(head).getFrequency();
+            uint64_t in_count = init_in_count;
+            double out_count = in_count;
+            for (BasicBlock *BB : trace) {
+                //errs() << "Starting at " << BB->getName() << '\n';
+                if (containHazard(BB)) {
+                    totalHazard++;
+                }
+                for (BasicBlock *succ : successors(BB)) {
+                    auto on = traceOf.find(succ);
+                    if (on != traceOf.end() && on->second == idx) {
+                        BranchProbability succ_bpi = BPI.getEdgeProbability(BB, succ);
+                        double bp_double = succ_bpi.getNumerator() / double(succ_bpi.getDenominator());
+                        //uint64_t succ_count = BFI.getBlockProfileCount(succ).getValue();
+                        //errs() << "succ: " << succ_count << succ->getName() << '\n';
+                        
+                        out_count = in_count * bp_double;
+                        
+                        //errs() << "new in_count: " << in_count << '\n';
+                        //errs() << "new out_count: " << out_count << '\n';
+                        in_count = out_count;
+                    }
+                }
+            }
+            // measured, where the path profile covers the trace
+            uint64_t path_in, path_out;
+            if (PathCompletion(trace, path_in, path_out)) {
+                init_in_count = path_in;
+                out_count = path_out;
+            }
+            total_in += init_in_count;
+            total_out += out_count;
+            total_hazard += totalHazard;
+            totals.blocks += double(init_in_count) * trace.size();
+            totals.traces++;
+            report() << "\nTrace: size " << trace.size() << '\n';
+            report() << "Num of hazards: " << totalHazard << '\n';
+            report() << "in_count: " << init_in_count << '\n';
+            report() << "out_count: " << format("%.3f" ,out_count) << '\n';
+            report() << "fall thru: " << format("%.3f" ,out_count / init_in_count) << '\n';
+            auto measured = traceMeasured.find(idx);
+            Optional<double> measuredFallThru;
+            if (measured != traceMeasured.end()) {
+                uint64_t entries = measured->second.first, completed = entries - measured->second.second;
+                total_measured_in += entries;
+                total_measured_out += completed;
+                measuredFallThru = entries ? double(completed) / entries : 0.0;
+                report() << "measured fall thru: " << format("%.3f", *measuredFallThru)
+                       << " (" << completed << " of " << entries << " entries)\n";
+            }
+            report() << '\n';
+            if (metrics)
+                ReportTraceMetrics(ORE, idx, init_in_count, init_in_count ? out_count / init_in_count : 0,
+                                   measuredFallThru, traceStats);
+        }
+        //errs() << "total in count: " << init_in_count << '\n';
+        report() << "total hazard: " << total_hazard << '\n';
+        totals.entries = total_in;
+        totals.completed = total_out;
+        totals.hazards = total_hazard;
+        AddTraceTotals(totals);
+        if (AliasHazards) report() << "hazards removed by alias analysis: " << aliasRemoved << '\n';
+        if (UseCallSummaries) report() << "hazards removed by call summaries: " << callRemoved << '\n';
+        report() << "average fall thru: " << format("%.3f" , total_out / total_in) << "\n";
+        if (!traceMeasured.empty() && total_measured_in)
+            report() << "average measured fall thru: "
+                   << format("%.3f", double(total_measured_out) / total_measured_in) << '\n';
+        report() << '\n';
+        if (metrics) {
+            Optional<double> measuredFallThru;
+            if (!traceMeasured.empty() && total_measured_in)
+                measuredFallThru = double(total_measured_out) / total_measured_in;
+            ReportFunctionMetrics(ORE, F, total_in ? total_out / total_in : 0, measuredFallThru,
+                                  std::move(traceStats));
+        }
+
+
+
+      //for (Trace trace : traces) {
+      //  errs() << "\nTraces:\n";
+      //  for (BasicBlock *traceBB : trace) {
+      //    errs() << traceBB->getName() << '\n';
+      //  }
+      //}
+
+      bool changed = annotated || converted || peeled;
+      if (TraceExitInstr) return InstrumentTraceExits(F) || changed;
+      std::vector<Optional<CycleEval::TraceCycles> > cyclesBefore;
+      if (TraceCycleEval) EstimateCycles(F, cyclesBefore);
+      changed |= optimize(F, LI, DT);
+      if (!TraceLayout && !SplitColdTraces && !FormSuperblocks && !EnlargeSuperblocks && !VectorizeSuperblocks &&
+          !ScheduleSuperblocks) {
+        if (TraceCycleEval) ReportCycles(F, cyclesBefore);
+        return changed;
+      }
+
+      // the transforms below invalidate BFI, so classify the traces first
+      std::vector<uint64_t> traceFreq;
+      std::vector<Optional<uint64_t> > traceCount;
+      std::vector<bool> traceCold;
+      std::vector<double> traceTrips; // average trips of a loop headed by the trace
+      for (unsigned idx = 0; idx < traceRanges.size(); ++idx) {
+        BasicBlock *head = getTrace(idx).front();
+        traceFreq.push_back(BFI.getBlockFreq(head).getFrequency());
+        traceCount.push_back(BFI.getBlockProfileCount(head));
+        traceCold.push_back(IsColdBlock(head, F, BFI));
+        double inFreq = 0;
+        if (EnlargeSuperblocks && LI.isLoopHeader(head))
+          for (BasicBlock *pred : predecessors(head))
+            if (!DT.dominates(head, pred)) {
+              BranchProbability prob = BPI.getEdgeProbability(pred, head);
+              inFreq += BFI.getBlockFreq(pred).getFrequency() * double(prob.getNumerator()) / prob.getDenominator();
+            }
+        traceTrips.push_back(inFreq > 0 ? traceFreq.back() / inFreq : 0);
+      }
+      // a function never entered is placed with the cold traces
+      if ((TraceLayout || SplitColdTraces) && F.getEntryCount() && F.getEntryCount()->getCount() == 0) {
+        F.setSectionPrefix("unlikely");
+        changed = true;
+      }
+
+      if (FormSuperblocks) changed |= FormAllSuperblocks(F, DT);
+      if (EnlargeSuperblocks)
+        changed |= EnlargeAllSuperblocks(F, DT, LI, traceFreq, traceCount, traceCold, traceTrips);
+      if (VectorizeSuperblocks) changed |= VectorizeAllSuperblocks(F, DT, traceCold);
+      if (ScheduleSuperblocks) changed |= ScheduleAllSuperblocks(F, DT);
+      if (SplitColdTraces) changed |= ExtractColdTraces(F, traceCold, traceCount);
+      if (TraceLayout) changed |= LayoutTraces(F, traceFreq, traceCold);
+      if (TraceCycleEval) ReportCycles(F, cyclesBefore);
+      return changed;
+    }
+
+    // Cycle estimates of the traces of more than one block as they are now;
+    // the others get none.
+    bool EstimateCycles(Function &F, std::vector<Optional<CycleEval::TraceCycles> > &cycles) {
+      std::vector<std::vector<BasicBlock*> > traces;
+      for (unsigned idx = 0; idx < traceRanges.size(); ++idx) {
+        traces.emplace_back();
+        if (getTrace(idx).size() > 1 || (idx < numTracesBefore && getTrace(idx).size()))
+          traces.back().assign(getTrace(idx).begin(), getTrace(idx).end());
+      }
+      std::string err = CycleEval::Estimate(F, traces, cycles);
+      if (err.empty()) return true;
+      report() << "no cycle estimates: " << err << "\n\n";
+      cycles.clear();
+      return false;
+    }
+
+    // Estimate the traces after the transforms and report them next to the
+    // estimates from before, by the cycles they save per function entry: an
+    // unrolled trace is entered less often.
+    void ReportCycles(Function &F, ArrayRef<Optional<CycleEval::TraceCycles> > before) {
+      if (before.empty()) return;
+      std::vector<Optional<CycleEval::TraceCycles> > after;
+      numTracesBefore = before.size();
+      bool estimated = EstimateCycles(F, after);
+      numTracesBefore = 0;
+      if (!estimated) return;
+      std::vector<std::pair<double, unsigned> > payoff;
+      for (unsigned idx = 0; idx < before.size(); ++idx)
+        if (before[idx] && idx < after.size() && after[idx])
+          payoff.push_back({before[idx]->entries * before[idx]->expected -
+                                after[idx]->entries * after[idx]->expected, idx});
+      std::stable_sort(payoff.begin(), payoff.end(),
+                       [](const std::pair<double, unsigned> &a, const std::pair<double, unsigned> &b) {
+                         return a.first > b.first;
+                       });
+      report() << "trace cycles (before -> after), by cycles saved per function entry:\n";
+      double saved = 0;
+      for (auto &p : payoff) {
+        const CycleEval::TraceCycles &B = *before[p.second], &A = *after[p.second];
+        report() << "trace " << p.second << ": blocks " << B.blocks << " -> " << A.blocks
+               << ", instrs " << B.instrs << " -> " << A.instrs
+               << ", critical path " << B.criticalPath << " -> " << A.criticalPath
+               << ", resource length " << B.resourceLength << " -> " << A.resourceLength
+               << ", expected " << format("%.2f -> %.2f", B.expected, A.expected)
+               << ", completion " << format("%.3f -> %.3f", B.completion, A.completion)
+               << ", entries " << format("%.3f -> %.3f", B.entries, A.entries)
+               << ", saved " << format("%.3f", p.first) << '\n';
+        saved += p.first;
+      }
+      report() << "cycles saved per function entry: " << format("%.3f", saved) << "\n\n";
+    }
+
+    bool IsColdBlock(BasicBlock *BB, Function &F, BlockFrequencyInfo &BFI) {
+      Optional<uint64_t> count = BFI.getBlockProfileCount(BB);
+      if (count && *count == 0 && F.getEntryCount() && F.getEntryCount()->getCount() > 0)
+        return true; // never entered, while the function is
+      uint64_t freq = BFI.getBlockFreq(BB).getFrequency();
+      return freq * 100 < BFI.getEntryFreq() * ColdTracePercent;
+    }
+
+    // Place each trace as one contiguous run of fall-through blocks: the trace
+    // holding the entry block first, then hot traces by decreasing frequency,
+    // then blocks outside any trace (tail duplicated copies), then cold traces.
+    bool LayoutTraces(Function &F, std::vector<uint64_t> &traceFreq, std::vector<bool> &traceCold) {
+      std::vector<unsigned> order;
+      for (unsigned i = 0; i < traceRanges.size(); ++i)
+        if (traceRanges[i].size) order.push_back(i);
+      std::stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+        if (traceCold[a] != traceCold[b]) return !traceCold[a];
+        return traceFreq[a] > traceFreq[b];
+      });
+
+      SmallPtrSet<BasicBlock*, 32> coldBlocks;
+      for (unsigned idx : order)
+        if (traceCold[idx]) coldBlocks.insert(getTrace(idx).begin(), getTrace(idx).end());
+
+      std::vector<BasicBlock*> layout;
+      SmallPtrSet<BasicBlock*, 32> placed;
+      auto place = [&](unsigned idx) {
+        for (BasicBlock *BB : getTrace(idx))
+          if (placed.insert(BB).second) layout.push_back(BB);
+      };
+      BasicBlock *entry = &F.getEntryBlock();
+      // block to trace map is stale after the transforms, but the entry block
+      // always heads its trace
+      for (unsigned idx : order)
+        if (getTrace(idx).front() == entry) place(idx);
+      for (unsigned idx : order)
+        if (!traceCold[idx]) place(idx);
+      for (BasicBlock &BB : F)
+        if (!placed.count(&BB) && !coldBlocks.count(&BB)) {
+          placed.insert(&BB);
+          layout.push_back(&BB);
+        }
+      for (unsigned idx : order) place(idx);
+      for (BasicBlock &BB : F)
+        if (placed.insert(&BB).second) layout.push_back(&BB);
+
+      bool changed = false;
+      for (unsigned i = 1; i < layout.size(); ++i) {
+        if (layout[i]->getPrevNode() == layout[i-1]) continue;
+        layout[i]->moveAfter(layout[i-1]);
+        changed = true;
+      }
+      return changed;
+    }
+
+    // Outline the single-entry prefix of every cold trace into a cold function
+    // in .text.unlikely, leaving a call in the hot function.
+    bool ExtractColdTraces(Function &F, std::vector<bool> &traceCold,
+                           std::vector<Optional<uint64_t> > &traceCount) {
+      bool changed = false;
+      unsigned numSplit = 0;
+      for (unsigned i = 0; i < traceRanges.size(); ++i) {
+        if (!traceCold[i] || !traceRanges[i].size) continue;
+        std::vector<BasicBlock*> region;
+        unsigned size = 0;
+        for (BasicBlock *BB : getTrace(i)) {
+          if (!region.empty() && BB->getUniquePredecessor() != region.back()) break;
+          region.push_back(BB);
+          size += BB->size();
+        }
+        if (region.front() == &F.getEntryBlock() || size < ColdSplitMinInstrs) continue;
+        CodeExtractorAnalysisCache CEAC(F);
+        CodeExtractor CE(region, nullptr, false, nullptr, nullptr, nullptr,
+                         false, false, "cold");
+        if (!CE.isEligible()) continue;
+        Function *outlined = CE.extractCodeRegion(CEAC);
+        if (!outlined) continue;
+        outlined->addFnAttr(Attribute::Cold);
+        outlined->addFnAttr(Attribute::NoInline);
+        outlined->setSectionPrefix("unlikely");
+        if (traceCount[i]) outlined->setEntryCount(*traceCount[i]);
+        for (User *U : outlined->users())
+          if (CallInst *CI = dyn_cast<CallInst>(U)) CI->addFnAttr(Attribute::Cold);
+        // the region is now a single block in F holding the call
+        traceRanges[i].size = 0;
+        numSplit++;
+        changed = true;
+      }
+      report() << "cold traces split: " << numSplit << "\n\n";
+      return changed;
+    }
+
+    bool doInitialization(Module &M) override {
+      uint64_t moduleSize = 0;
+      unsized.clear();
+      for (Function &F : M) {
+        if (F.isMaterializable()) unsized.insert(&F);
+        else moduleSize += F.getInstructionCount();
+      }
+      moduleBudget = moduleSize * SBModuleGrowth / 100;
+      profileCounts.clear();
+      if (!PathProfileFile.empty()) ReadProfile(PathProfileFile);
+      params = TraceConfig::Load();
+      thresProb = uint32_t(params.threshold * BranchProbability::getDenominator());
+      cache.reset();
+      if (!TraceCacheFile.empty()) cache = std::make_unique<TraceCache::Cache>(TraceCacheFile);
+      return false;
+    }
+
+    bool doFinalization(Module &M) override {
+      if (!TraceStatsJson.empty()) WriteTraceStats();
+      if (!cache) return false;
+      report() << "trace cache: hits " << cache->hits << ", misses " << cache->misses << '\n';
+      if (std::error_code EC = cache->write())
+        report() << "cannot write trace cache " << TraceCacheFile << ": " << EC.message() << '\n';
+      cache.reset();
+      return false;
+    }
+
+    // Remove the side entrances of every trace by tail duplication, then fold
+    // the fall-through chains. Returns true if the IR changed.
+    bool FormAllSuperblocks(Function &F, DominatorTree &DT) {
+      uint64_t funcBudget = uint64_t(F.getInstructionCount()) * SBFuncGrowth / 100;
+      unsigned numDup = 0, numMerged = 0, numSB = 0;
+      uint64_t dupInstrs = 0;
+      bool changed = false;
+      // the back edge test needs a dominator tree that knows the copies
+      DomTreeUpdater DTU(DT, DomTreeUpdater::UpdateStrategy::Eager);
+      for (TraceRange &range : traceRanges) {
+        if (range.size <= 1) continue;
+        std::vector<BasicBlock*> sb(&traceBlocks[range.begin], &traceBlocks[range.begin] + range.size);
+        // tail duplicate, front to back: the copy of block i becomes the side
+        // entrance of block i+1 and is duplicated again in the next step
+        unsigned len = 1;
+        for (; len < sb.size(); ++len) {
+          BasicBlock *BB = sb[len], *tracePred = sb[len-1];
+          if (BB->getUniquePredecessor() == tracePred) continue;
+          if (!CanTailDuplicate(BB, tracePred, DT)) break;
+          uint64_t cost = BB->size();
+          if (cost > funcBudget || cost > moduleBudget) break;
+          funcBudget -= cost;
+          moduleBudget -= cost;
+          dupInstrs += cost;
+          TailDuplicate(BB, tracePred, F, DTU);
+          numDup++;
+          changed = true;
+        }
+        if (len > 1) numSB++;
+        // straight-line the single-entry prefix where the branch is unconditional
+        std::vector<BasicBlock*> survivors(1, sb[0]);
+        for (unsigned i = 1; i < sb.size(); ++i) {
+          if (i < len && MergeBlockIntoPredecessor(sb[i], &DTU)) {
+            numMerged++;
+            changed = true;
+          } else {
+            survivors.push_back(sb[i]);
+          }
+        }
+        // the survivors keep their order and never outnumber the trace, so
+        // they fit in place
+        std::copy(survivors.begin(), survivors.end(), &traceBlocks[range.begin]);
+        range.size = survivors.size();
+      }
+      report() << "superblocks: " << numSB << ", tail duplicated blocks: " << numDup
+             << " (" << dupInstrs << " instrs), merged blocks: " << numMerged << "\n\n";
+      return changed;
+    }
+    
+    // If-convert, innermost first, every branch whose sides are short,
+    // hazard free and safe to speculate into selects, where the cost model
+    // finds running both sides cheaper. In post order a branch comes after
+    // those nested in its sides, which are converted by then, so one pass
+    // does; the sides it deletes were visited before it. Returns true if the
+    // IR changed.
+    bool FormHyperblocks(Function &F, BranchProbabilityInfo &BPI) {
+      unsigned numDiamonds = 0, numTriangles = 0;
+      std::vector<BasicBlock*> order(po_begin(&F.getEntryBlock()), po_end(&F.getEntryBlock()));
+      for (BasicBlock *block : order) {
+        BasicBlock &A = *block;
+        BranchInst *br = dyn_cast<BranchInst>(A.getTerminator());
+        if (!br || !br->isConditional()) continue;
+        BasicBlock *T = br->getSuccessor(0), *E = br->getSuccessor(1);
+        // a side is a block entered from A only and falling into the join
+        auto side = [&](BasicBlock *BB) {
+          return BB != &A && BB->getSinglePredecessor() == &A && BB->getUniqueSuccessor() &&
+                 isa<BranchInst>(BB->getTerminator()) && CanIfConvert(BB);
+        };
+        BasicBlock *join;
+        if (T == E) continue;
+        if (side(T) && side(E) && T->getUniqueSuccessor() == E->getUniqueSuccessor()) join = T->getUniqueSuccessor();
+        else if (side(T) && T->getUniqueSuccessor() == E) join = E, E = &A;
+        else if (side(E) && E->getUniqueSuccessor() == T) join = T, T = &A;
+        else continue;
+        if (join == &A || join == T || join == E) continue;
+
+        // each side costs its instructions, and every join phi a select
+        unsigned lenT = T == &A ? 0 : T->size() - 1, lenE = E == &A ? 0 : E->size() - 1, selects = 0;
+        for (PHINode &PN : join->phis())
+          if (PN.getIncomingValueForBlock(T) != PN.getIncomingValueForBlock(E)) selects++;
+        BranchProbability probT = BPI.getEdgeProbability(&A, unsigned(0));
+        double p = double(probT.getNumerator()) / probT.getDenominator();
+        double branched = p * lenT + (1 - p) * lenE + std::min(p, 1 - p) * MispredictPenalty;
+        if (lenT + lenE + selects > branched) continue;
+
+        Value *cond = br->getCondition();
+        for (BasicBlock *BB : {T, E}) {
+          if (BB == &A) continue;
+          while (BB->size() > 1) BB->front().moveBefore(br);
+        }
+        for (PHINode &PN : join->phis()) {
+          Value *VT = PN.getIncomingValueForBlock(T), *VE = PN.getIncomingValueForBlock(E);
+          Value *V = VT == VE ? VT : SelectInst::Create(cond, VT, VE, PN.getName() + ".sel", br);
+          if (T == &A || E == &A) PN.setIncomingValueForBlock(&A, V);
+          else PN.addIncoming(V, &A);
+        }
+        BranchInst::Create(join, br);
+        br->eraseFromParent();
+        for (BasicBlock *BB : {T, E})
+          if (BB != &A) DeleteDeadBlock(BB);
+        if (T == &A || E == &A) numTriangles++;
+        else numDiamonds++;
+      }
+      report() << "hyperblocks: if-converted diamonds: " << numDiamonds << ", triangles: " << numTriangles << "\n";
+      return numDiamonds + numTriangles > 0;
+    }
+
+    // A side of a branch can be executed unconditionally if it is short,
+    // not a hazard and every instruction is safe to speculate. MemorySSA
+    // was built for the original CFG, so under alias hazards it must not
+    // touch memory.
+    bool CanIfConvert(BasicBlock *BB) {
+      if (BB->size() - 1 > HyperblockMaxInstrs || classifyHazard(BB) || !BB->phis().empty()) return false;
+      for (Instruction &I : *BB) {
+        if (I.isTerminator()) continue;
+        if (!isSafeToSpeculativelyExecute(&I) || (AliasHazards && I.mayReadOrWriteMemory())) return false;
+      }
+      return true;
+    }
+
+    // The CFG changed under the analyses the pass was handed.
+    void RecomputeAnalyses(Function &F, LoopInfo &LI, DominatorTree &DT, PostDominatorTree &PDT,
+                           BranchProbabilityInfo &BPI, BlockFrequencyInfo &BFI) {
+      const TargetLibraryInfo &TLI = *analyses.TLI;
+      DT.recalculate(F);
+      PDT.recalculate(F);
+      LI.releaseMemory();
+      LI.analyze(DT);
+      BPI.calculate(F, LI, &TLI, &DT, &PDT);
+      BFI.calculate(F, BPI, LI);
+    }
+
+    // Peel the dominant case of every switch and indirectbr: the block ends
+    // in a compare against the hot case value or address instead, and the
+    // multi-way branch, less that case, moves to a block of its own. The
+    // branch weights are split between the two. Returns true if the IR
+    // changed.
+    bool PeelDominantCases(Function &F, BranchProbabilityInfo &BPI, MemorySSA *MSSA, AAResults *AA) {
+      SmallVector<Instruction*, 8> multiway;
+      for (BasicBlock &BB : F) {
+        Instruction *T = BB.getTerminator();
+        if ((isa<SwitchInst>(T) || isa<IndirectBrInst>(T)) && T->getNumSuccessors() > 2)
+          multiway.push_back(T);
+      }
+      unsigned numPeeled = 0;
+      for (Instruction *T : multiway) {
+        SmallMapVector<BasicBlock*, double, 8> probs;
+        caseProbabilities(T, BPI, probs);
+        BasicBlock *hot = nullptr;
+        double p = 0;
+        for (auto &succ : probs)
+          if (succ.second > p) {
+            hot = succ.first;
+            p = succ.second;
+          }
+        if (!hot || p * 100 < DominantCasePercent || hot->isEHPad()) continue;
+
+        // the hot case needs a single edge and a value to compare against
+        Value *cond;
+        Constant *val;
+        unsigned idx = 0;
+        if (SwitchInst *SI = dyn_cast<SwitchInst>(T)) {
+          ConstantInt *C = SI->findCaseDest(hot); // null for the default, or several values
+          if (!C) continue;
+          cond = SI->getCondition();
+          val = C;
+          idx = SI->findCaseValue(C)->getSuccessorIndex();
+        } else {
+          IndirectBrInst *IBI = cast<IndirectBrInst>(T);
+          if (count(successors(IBI), hot) != 1) continue;
+          cond = IBI->getAddress();
+          val = BlockAddress::get(&F, hot);
+          while (IBI->getDestination(idx) != hot) idx++;
+        }
+        SmallVector<uint64_t, 8> weights;
+        if (MDNode *MD = T->getMetadata(LLVMContext::MD_prof))
+          if (MD->getNumOperands() == T->getNumSuccessors() + 1)
+            for (unsigned i = 1; i < MD->getNumOperands(); ++i)
+              weights.push_back(mdconst::extract<ConstantInt>(MD->getOperand(i))->getZExtValue());
+
+        BasicBlock *BB = T->getParent();
+        BasicBlock *rest = BB->splitBasicBlock(T, BB->getName() + ".cases");
+        for (PHINode &PN : hot->phis()) PN.setIncomingBlock(PN.getBasicBlockIndex(rest), BB);
+        Instruction *jump = BB->getTerminator();
+        Value *isHot = new ICmpInst(jump, ICmpInst::ICMP_EQ, cond, val, BB->getName() + ".hot");
+        BranchInst *br = BranchInst::Create(hot, rest, isHot, jump);
+        jump->eraseFromParent();
+        // both drop the case by moving the last one into its place
+        if (SwitchInst *SI = dyn_cast<SwitchInst>(T)) SI->removeCase(SI->case_begin() + (idx - 1));
+        else cast<IndirectBrInst>(T)->removeDestination(idx);
+
+        MDBuilder MDB(F.getContext());
+        if (!weights.empty()) {
+          uint64_t hotWeight = weights[idx], restWeight = 0;
+          weights[idx] = weights.back();
+          weights.pop_back();
+          for (uint64_t w : weights) restWeight += w;
+          unsigned shift = 0;
+          while ((std::max(hotWeight, restWeight) >> shift) > UINT32_MAX) shift++;
+          br->setMetadata(LLVMContext::MD_prof,
+                          MDB.createBranchWeights(uint32_t(hotWeight >> shift), uint32_t(restWeight >> shift)));
+          SmallVector<uint32_t, 8> restWeights;
+          for (uint64_t w : weights) restWeights.push_back(uint32_t(w >> shift));
+          T->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(restWeights));
+        } else {
+          // without weights the compare would look like x == const failing
+          uint32_t w = std::min(999u, std::max(1u, unsigned(p * 1000 + 0.5)));
+          br->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(w, 1000 - w));
+        }
+        // an indirect jump no longer ends BB
+        auto it = blockNum.find(BB);
+        if (it != blockNum.end() && hazards[it->second] && !classifyHazard(BB, MSSA, AA, CS))
+          hazards.reset(it->second);
+        casePeeled(T, hot, br, p);
+        numPeeled++;
+      }
+      report() << "peeled dominant cases: " << numPeeled << "\n";
+      return numPeeled > 0;
+    }
+
+    // Enlarge the hot single-entry superblocks, hottest first, within the
+    // growth budget: a superblock looping back to its head is peeled if it
+    // averages few trips and unrolled otherwise, any other has the
+    // superblock its trace ran into copied onto its end. Peeled copies form
+    // a new trace. Returns true if the IR changed.
+    bool EnlargeAllSuperblocks(Function &F, DominatorTree &DT, LoopInfo &LI, std::vector<uint64_t> &traceFreq,
+                               std::vector<Optional<uint64_t> > &traceCount, std::vector<bool> &traceCold,
+                               std::vector<double> &traceTrips) {
+      uint64_t budget = uint64_t(F.getInstructionCount()) * SBEnlargeGrowth / 100;
+      unsigned numUnrolled = 0, numPeeled = 0, numExpanded = 0;
+      uint64_t added = 0;
+      std::vector<unsigned> order;
+      for (unsigned i = 0; i < traceRanges.size(); ++i)
+        if (!traceCold[i]) order.push_back(i);
+      std::stable_sort(order.begin(), order.end(),
+                       [&](unsigned a, unsigned b) { return traceFreq[a] > traceFreq[b]; });
+      auto sizeOf = [](ArrayRef<BasicBlock*> sb) {
+        uint64_t size = 0;
+        for (BasicBlock *BB : sb) size += BB->size();
+        return size;
+      };
+      auto take = [&](uint64_t cost) {
+        if (cost > budget || cost > moduleBudget) return false;
+        budget -= cost;
+        moduleBudget -= cost;
+        added += cost;
+        return true;
+      };
+
+      for (unsigned idx : order) {
+        std::vector<BasicBlock*> sb(getTrace(idx).begin(), getTrace(idx).end());
+        if (!IsCopyable(sb)) continue;
+        BasicBlock *head = sb[0], *tail = sb.back();
+        uint64_t cost = sizeOf(sb);
+        std::vector<BasicBlock*> copies;
+        if (is_contained(successors(tail), head)) {
+          if (traceTrips[idx] > 0 && traceTrips[idx] <= SBPeelMaxTrips) {
+            BasicBlock *entering = nullptr;
+            for (BasicBlock *pred : predecessors(head))
+              if (!DT.dominates(head, pred) && pred != entering) {
+                if (entering) entering = head; // more than one, do not peel
+                else entering = pred;
+              }
+            if (!entering || entering == head || !isa<BranchInst>(entering->getTerminator())) continue;
+            // a trip at least once, then as many as the average asks for
+            unsigned peel = std::max(1u, unsigned(traceTrips[idx] + 0.5));
+            while (peel && !take(cost * peel)) peel--;
+            if (!peel) continue;
+            AppendTrace(CopySuperblock(sb, entering, peel, F), nullptr);
+            traceFreq.push_back(uint64_t(traceFreq[idx] / traceTrips[idx]));
+            traceCount.push_back(None);
+            traceCold.push_back(false);
+            traceTrips.push_back(0);
+            numPeeled++;
+            continue;
+          }
+          unsigned unroll = SBUnrollFactor ? SBUnrollFactor - 1 : 0;
+          while (unroll && !take(cost * unroll)) unroll--;
+          if (!unroll) continue;
+          copies = CopySuperblock(sb, tail, unroll, F);
+          numUnrolled++;
+        } else {
+          // the trace stopped at the head of a hot superblock it would have
+          // gone on into
+          BasicBlock *next = traceRanges[idx].next;
+          auto target = traceOf.find(next);
+          if (!next || target == traceOf.end() || target->second == idx || traceCold[target->second]) continue;
+          std::vector<BasicBlock*> tsb(getTrace(target->second).begin(), getTrace(target->second).end());
+          // a head entered from the tail alone would only be moved
+          if (tsb.empty() || tsb[0] != next || !is_contained(successors(tail), next) ||
+              all_of(predecessors(next), [&](BasicBlock *pred) { return pred == tail; }) || !IsCopyable(tsb) ||
+              is_contained(successors(tsb.back()), next) || !isa<BranchInst>(tail->getTerminator()) ||
+              !take(sizeOf(tsb)))
+            continue;
+          copies = CopySuperblock(tsb, tail, 1, F);
+          numExpanded++;
+        }
+        sb.insert(sb.end(), copies.begin(), copies.end());
+        traceRanges[idx] = TraceRange{unsigned(traceBlocks.size()), unsigned(sb.size()), traceRanges[idx].next,
+                                      traceRanges[idx].end};
+        traceBlocks.insert(traceBlocks.end(), sb.begin(), sb.end());
+      }
+      report() << "enlarged superblocks: unrolled " << numUnrolled << ", peeled " << numPeeled
+             << ", target expanded " << numExpanded << " (" << added << " instrs)\n\n";
+      if (!added) return false;
+      // unrolled and peeled copies change the loops of the function
+      DT.recalculate(F);
+      LI.releaseMemory();
+      LI.analyze(DT);
+      return true;
+    }
+
+    // Run fn on each trace in single-entry stretches of at most maxInstrs
+    // instructions: without superblock formation a side entrance starts a
+    // new one. An EH pad must stay first in its block, so a block holding one
+    // is in no stretch. Returns true if fn changed the IR.
+    bool ForEachSuperblock(unsigned maxInstrs, function_ref<bool(unsigned, ArrayRef<BasicBlock*>)> fn) {
+      bool changed = false;
+      for (unsigned idx = 0; idx < traceRanges.size(); ++idx) {
+        ArrayRef<BasicBlock*> trace = getTrace(idx);
+        unsigned begin = 0, size = 0;
+        for (unsigned i = 0; i < trace.size(); ++i) {
+          bool joins = i > begin && trace[i]->getSinglePredecessor() == trace[i-1] &&
+                       !trace[i]->isEHPad() &&
+                       (isa<BranchInst>(trace[i-1]->getTerminator()) ||
+                        isa<SwitchInst>(trace[i-1]->getTerminator()));
+          if (joins && size + trace[i]->size() <= maxInstrs) {
+            size += trace[i]->size();
+            continue;
+          }
+          if (i > begin && size <= maxInstrs) changed |= fn(idx, trace.slice(begin, i - begin));
+          begin = trace[i]->isEHPad() ? i + 1 : i;
+          size = trace[i]->isEHPad() ? 0 : trace[i]->size();
+        }
+        if (begin < trace.size() && size <= maxInstrs) changed |= fn(idx, trace.slice(begin));
       }
-      return Trace(trace);
+      return changed;
     }
 
-    bool runOnFunction(Function &F) override {
-      LoopInfo &LI = getAnalysis<LoopInfoWrapperPass>().getLoopInfo();
-      DominatorTree &DT = getAnalysis<DominatorTreeWrapperPass>().getDomTree();
-      PostDominatorTree &PDT = getAnalysis<PostDominatorTreeWrapperPass>().getPostDomTree();
-      BranchProbabilityInfo &BPI = getAnalysis<BranchProbabilityInfoWrapperPass>().getBPI();
-      BlockFrequencyInfo &BFI = getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI();
+    // SLP vectorize the single-entry stretches of the hot traces that hold no
+    // hazard but ambiguous stores; alias analysis decides which stores move.
+    // Returns true if the IR changed.
+    bool VectorizeAllSuperblocks(Function &F, DominatorTree &DT, std::vector<bool> &traceCold) {
+      // the loops as they are now, for SCEV to place the addresses
+      LoopInfo LI(DT);
+      AssumptionCache AC(F);
+      ScalarEvolution SE(F, *analyses.TLI, AC, DT, LI);
+      DomTreeUpdater DTU(DT, DomTreeUpdater::UpdateStrategy::Eager);
+      SuperblockVectorize::Vectorizer vec(*analyses.TTI, *analyses.AA, SE, DTU, F.getParent()->getDataLayout());
+      bool changed = ForEachSuperblock(VectorMaxInstrs, [&](unsigned idx, ArrayRef<BasicBlock*> sb) {
+        if (traceCold[idx]) return false;
+        for (BasicBlock *BB : sb)
+          if (hazardKinds(BB, nullptr, nullptr, CS) & (SyncHazard | CallHazard | IndirectJumpHazard)) return false;
+        return vec.run(sb);
+      });
+      report() << "vectorized regions: " << vec.numRegions << ", bundles: " << vec.numBundles << " ("
+             << vec.numAcross << " across blocks), packed scalars: " << vec.numPacked
+             << ", fallback stores: " << vec.numCopies << ", estimated cost: " << vec.costBefore << " -> "
+             << vec.costAfter << "\n\n";
+      return changed;
+    }
 
-      prepare(F, LI, PDT);
+    // Schedule each trace in single-entry stretches. Returns true if the IR
+    // changed.
+    bool ScheduleAllSuperblocks(Function &F, DominatorTree &DT) {
+      const TargetTransformInfo &TTI = *analyses.TTI;
+      AAResults &AA = *analyses.AA;
+      DomTreeUpdater DTU(DT, DomTreeUpdater::UpdateStrategy::Eager);
+      SuperblockSchedule::Scheduler sched(TTI, &AA, DTU, SchedWidth);
+      bool changed = ForEachSuperblock(SchedMaxInstrs, [&](unsigned, ArrayRef<BasicBlock*> sb) {
+        return sched.run(sb);
+      });
+      report() << "scheduled regions: " << sched.numRegions << ", hoisted: " << sched.numHoisted
+             << ", sunk: " << sched.numSunk << " (" << sched.numCopies << " compensation copies)"
+             << ", estimated cycles: " << sched.cyclesBefore << " -> " << sched.cyclesAfter << "\n\n";
+      return changed;
+    }
 
-      std::vector<Loop*> allLoops = FindAllLoops(LI);
+    virtual void prepare(Function &F, LoopInfo &LI, PostDominatorTree &PDT) {
 
-      // sort the loops based on depth
-      std::sort(allLoops.begin(), allLoops.end(), CompareLoopDepth);
+    }
 
-      // create block list based on loop
-      for (Loop* L : allLoops) {
-        errs() << "\nLoop " << L->getLoopDepth() << '\n';
-        for (BasicBlock* BB : L->getBlocksVector()) {
-          if (visited.find(BB) == visited.end() && !inSubLoop(BB, L, &LI)) {
-            traces.push_back(GrowTrace(BB, DT, PDT, F, BPI));
-          }
-          // errs() << BB->getName() << '\n';
-        }
-      }
+    virtual BasicBlock* predict(BasicBlock *BB, Function &F, PostDominatorTree &PDT, BranchProbabilityInfo &BPI) {
+      return nullptr;
+    }
 
-      // errs() << "\nFunc\n";
-      for (BasicBlock &BB : F) {
-        if (visited.find(&BB) == visited.end()) {
-          traces.push_back(GrowTrace(&BB, DT, PDT, F, BPI));
-        }
-        // errs() << BB.getName() << '\n';
+    // Attach the predictor's view of the branches to the IR, returns true if
+    // metadata was changed. Runs after prepare.
+    virtual bool annotate(Function &F) {
+      return false;
+    }
+
+    // Probability of each distinct successor of the switch or indirectbr T.
+    virtual void caseProbabilities(Instruction *T, BranchProbabilityInfo &BPI,
+                                   SmallMapVector<BasicBlock*, double, 8> &probs) {
+      for (BasicBlock *Succ : successors(T)) {
+        if (probs.count(Succ)) continue;
+        BranchProbability prob = BPI.getEdgeProbability(T->getParent(), Succ);
+        probs[Succ] = double(prob.getNumerator()) / prob.getDenominator();
       }
+    }
 
-      // evaluation
-        double total_in = 0;
-        double total_out = 0;
-        int total_hazard = 0;
-        for (Trace trace : traces) {
-            if (trace.size() <= 1) continue;
-            BasicBlock *head = *(trace.begin());
-            int totalHazard = 0;
-            uint64_t init_in_count = BFI.getBlockProfileCount(head).getValue();
-            uint64_t in_count = init_in_count;
-            double out_count = in_count;
-            for (Trace::iterator TI = trace.begin(); TI != trace.end(); ++TI) {
-                BasicBlock *BB = *TI;
-                //errs() << "Starting at " << BB->getName() << '\n';
-                if (containHazard(BB)) {
-                    totalHazard++;
-                }
-                for (BasicBlock *succ : successors(BB)) {
-                    if (trace.contains(succ)) {
-                        BranchProbability succ_bpi = BPI.getEdgeProbability(BB, succ);
-                        double bp_double = succ_bpi.getNumerator() / double(succ_bpi.getDenominator());
-                        //uint64_t succ_count = BFI.getBlockProfileCount(succ).getValue();
-                        //errs() << "succ: " << succ_count << succ->getName() << '\n';
-                        
-                        out_count = in_count * bp_double;
-                        
-                        //errs() << "new in_count: " << in_count << '\n';
-                        //errs() << "new out_count: " << out_count << '\n';
-                        in_count = out_count;
-                    }
-                }
-            }
-            total_in += init_in_count;
-            total_out += out_count;
-            total_hazard += totalHazard;
-            errs() << "\nTrace: size " << trace.size() << '\n';
-            errs() << "Num of hazards: " << totalHazard << '\n';
-            errs() << "in_count: " << init_in_count << '\n';
-            errs() << "out_count: " << format("%.3f" ,out_count) << '\n';
-            errs() << "fall thru: " << format("%.3f" ,out_count / init_in_count) << "\n\n";
-        }
-        //errs() << "total in count: " << init_in_count << '\n';
-        errs() << "total hazard: " << total_hazard << '\n';
-        errs() << "average fall thru: " << format("%.3f" , total_out / total_in) << "\n\n";
+    // The case hot of T was peeled into br, taken with probability p.
+    virtual void casePeeled(Instruction *T, BasicBlock *hot, BranchInst *br, double p) {
 
+    }
 
+    // The predictor's state after prepare, for the trace cache, appended to
+    // words with blocks by their number in index.
+    virtual void savePredictions(Function &F, const DenseMap<BasicBlock*, unsigned> &index,
+                                 std::vector<uint32_t> &words) {
 
-      //for (Trace trace : traces) {
-      //  errs() << "\nTraces:\n";
-      //  for (BasicBlock *traceBB : trace) {
-      //    errs() << traceBB->getName() << '\n';
-      //  }
-      //}
-      
-      return false;
     }
-    
-    virtual void prepare(Function &F, LoopInfo &LI, PostDominatorTree &PDT) {
 
+    // Restore what savePredictions wrote, in place of prepare. Returns false
+    // if the words do not fit F.
+    virtual bool loadPredictions(Function &F, ArrayRef<uint32_t> words) {
+      return words.empty();
     }
 
-    virtual BasicBlock* predict(BasicBlock *BB, Function &F, PostDominatorTree &PDT, BranchProbabilityInfo &BPI) {
-      return nullptr;
+    // Transform the function along its traces, returns true if the IR
+    // changed. Runs after trace formation, before the trace transforms.
+    virtual bool optimize(Function &F, LoopInfo &LI, DominatorTree &DT) {
+      return false;
     }
 
     void getAnalysisUsage(AnalysisUsage &AU) const override {
@@ -238,12 +3541,284 @@ namespace BaseTrace {
       AU.addRequired<LoopInfoWrapperPass>();
       AU.addRequired<DominatorTreeWrapperPass>();
       AU.addRequired<PostDominatorTreeWrapperPass>();
+      if (needsTLI()) AU.addRequired<TargetLibraryInfoWrapperPass>();
+      if (needsTTI()) AU.addRequired<TargetTransformInfoWrapperPass>();
+      if (needsAA()) AU.addRequired<AAResultsWrapperPass>();
+      if (AliasHazards) AU.addRequired<MemorySSAWrapperPass>();
+      if (UseCallSummaries) AU.addRequired<CallSummary::CallSummaryPass>();
+      if (!TraceSampleProfile.empty()) AU.addRequired<SampleInput::SampleProfileInputPass>();
     }
+
+    // The optional analyses the flags, or a derived pass, call for.
+    bool needsTLI() const { return Hyperblocks || PeelCases || VectorizeSuperblocks; }
+    bool needsTTI() const { return ScheduleSuperblocks || VectorizeSuperblocks; }
+    virtual bool needsAA() const { return ScheduleSuperblocks || VectorizeSuperblocks || AliasHazards; }
     protected:
+    TraceConfig::Params params; // of the module being run on
     uint32_t thresProb = uint32_t((1u << 31) * 0.6);
+    FunctionAnalyses analyses; // of the function being run on
+
+    // The trace being grown, ending at the block predict is asked about.
+    ArrayRef<BasicBlock*> currentTrace() const {
+      return getTrace(traceRanges.size() - 1);
+    }
+
+    // The trace holding BB, from BB on.
+    ArrayRef<BasicBlock*> TraceFrom(BasicBlock *BB) const {
+      auto it = traceOf.find(BB);
+      if (it == traceOf.end()) return None;
+      ArrayRef<BasicBlock*> trace = getTrace(it->second);
+      return trace.drop_front(std::find(trace.begin(), trace.end(), BB) - trace.begin());
+    }
+
+    // Successor the executions of prefix continue to at least thresProb of
+    // the time, or null. Returns false if the path profile has no say.
+    bool PredictFromPaths(ArrayRef<BasicBlock*> prefix, BasicBlock *&next) {
+      uint64_t total = 0;
+      SmallDenseMap<BasicBlock*, uint64_t, 4> nextCount;
+      if (!ForEachPathThrough(prefix, [&](uint64_t count, BasicBlock *succ) {
+            total += count;
+            if (succ) nextCount[succ] += count;
+          }) || !total)
+        return false;
+      next = nullptr;
+      uint64_t best = 0;
+      for (BasicBlock *succ : successors(prefix.back()))
+        if (nextCount.lookup(succ) > best) {
+          best = nextCount.lookup(succ);
+          next = succ;
+        }
+      if (double(best) / total < double(thresProb) / BranchProbability::getDenominator())
+        next = nullptr;
+      return true;
+    }
+
     private:
-    std::set<BasicBlock*> visited;
-    std::vector<Trace> traces;
+    struct TraceRange {
+      unsigned begin, size; // slice of traceBlocks
+      BasicBlock *next;     // where the trace would have gone on, if visited
+      TraceEnd end = EndExit;
+    };
+    // the traces of the current function, back to back
+    std::vector<BasicBlock*> traceBlocks;
+    std::vector<TraceRange> traceRanges;
+    DenseMap<BasicBlock*, unsigned> traceOf; // visited blocks, by trace index
+    // per function hazard bitmap, indexed by block number
+    DenseMap<BasicBlock*, unsigned> blockNum;
+    BitVector hazards;
+    // counters from the profile file by name: path counts under the function
+    // name, trace counters under "trace:" and the function name
+    struct ProfileCounts {
+      uint64_t checksum;
+      std::vector<uint64_t> counts;
+    };
+    StringMap<ProfileCounts> profileCounts;
+    // the executed paths of the current function as slices of pathBlocks,
+    // indexed by the blocks on them
+    struct PathRange {
+      unsigned begin, size;
+      uint64_t count;
+    };
+    std::vector<BasicBlock*> pathBlocks;
+    std::vector<PathRange> pathRanges;
+    DenseMap<BasicBlock*, SmallVector<std::pair<unsigned, unsigned>, 2> > pathsThrough;
+    DenseSet<std::pair<BasicBlock*, BasicBlock*> > pathBackEdges;
+    bool pathsLoaded = false;
+    // measured (entries, exits) of the current function's traces, by index
+    DenseMap<unsigned, std::pair<uint64_t, uint64_t> > traceMeasured;
+    const CallSummary::CallSummaryInfo *CS = nullptr;
+    uint64_t moduleBudget = 0;
+    // bodies not read in yet at initialization, whose share of the budget
+    // comes when they are run on
+    SmallPtrSet<Function*, 8> unsized;
+    std::unique_ptr<TraceCache::Cache> cache; // with -trace-cache
+    // while estimating after the transforms: the traces estimated before,
+    // single blocks by now included
+    unsigned numTracesBefore = 0;
+
+    /// A side entrance can be removed unless the block is a loop header
+    /// reached through a back edge (duplicating it would make the loop
+    /// irreducible) or the block or its predecessors cannot be retargeted.
+    bool CanTailDuplicate(BasicBlock *BB, BasicBlock *tracePred, DominatorTree &DT) {
+      for (BasicBlock *pred : predecessors(BB)) {
+        if (pred == BB || DT.dominates(BB, pred)) return false;
+        if (pred == tracePred) continue;
+        if (isa<IndirectBrInst>(pred->getTerminator()) || isa<CallBrInst>(pred->getTerminator()))
+          return false;
+      }
+      return CanClone(BB);
+    }
+
+    bool CanClone(BasicBlock *BB) {
+      if (BB->hasAddressTaken() || BB->isEHPad()) return false;
+      for (Instruction &I : *BB) {
+        if (I.getType()->isTokenTy()) return false;
+        if (CallBase *CB = dyn_cast<CallBase>(&I))
+          if (CB->cannotDuplicate() || CB->isConvergent()) return false;
+      }
+      return true;
+    }
+
+    // A superblock can be copied if it is a chain of blocks entered at the
+    // head only, left through branches and returns.
+    bool IsCopyable(ArrayRef<BasicBlock*> sb) {
+      for (unsigned i = 0; i < sb.size(); ++i) {
+        if (i && sb[i]->getSinglePredecessor() != sb[i-1]) return false;
+        Instruction *T = sb[i]->getTerminator();
+        if (!isa<BranchInst>(T) && !isa<SwitchInst>(T) && !isa<ReturnInst>(T) && !isa<UnreachableInst>(T))
+          return false;
+        if (!CanClone(sb[i])) return false;
+      }
+      return !sb.empty();
+    }
+
+    void AppendTrace(ArrayRef<BasicBlock*> blocks, BasicBlock *next) {
+      traceRanges.push_back(TraceRange{unsigned(traceBlocks.size()), unsigned(blocks.size()), next});
+      traceBlocks.insert(traceBlocks.end(), blocks.begin(), blocks.end());
+    }
+
+    /// Copy the superblock sb n times onto the edge from -> head, chained
+    /// through the edge from its tail back to the head: from enters the
+    /// first copy, the tail of each copy the next, the last one the head.
+    /// The copies leave through the exits of sb. Values defined in sb are
+    /// merged in SSA form wherever copies meet. Returns the copies in order.
+    std::vector<BasicBlock*> CopySuperblock(ArrayRef<BasicBlock*> sb, BasicBlock *from, unsigned n, Function &F) {
+      BasicBlock *head = sb[0], *tail = sb.back();
+      // below the head, a phi could only name the head as the block before
+      for (BasicBlock *BB : sb.drop_front()) FoldSingleEntryPHINodes(BB);
+      std::vector<ValueToValueMapTy> VMaps(n);
+      std::vector<BasicBlock*> copies;
+      for (unsigned k = 0; k < n; ++k)
+        for (BasicBlock *BB : sb) {
+          copies.push_back(CloneBasicBlock(BB, VMaps[k], ".sbx", &F));
+          if (BB != head) VMaps[k][BB] = copies.back();
+        }
+      auto copyOf = [&](unsigned k, unsigned i) { return copies[k * sb.size() + i]; };
+      auto mapped = [&](unsigned k, Value *V) {
+        auto it = VMaps[k].find(V);
+        return it != VMaps[k].end() ? (Value*)it->second : V;
+      };
+      // a copied head is only entered from from or the tail of the copy
+      // before, with what that passes
+      for (unsigned k = 0; k < n; ++k) {
+        BasicBlock *pred = k ? copyOf(k - 1, sb.size() - 1) : from;
+        auto headPN = head->phis().begin();
+        for (PHINode &PN : copyOf(k, 0)->phis()) {
+          Value *V = k ? mapped(k - 1, headPN->getIncomingValueForBlock(tail))
+                       : headPN->getIncomingValueForBlock(from);
+          for (int i = PN.getNumIncomingValues() - 1; i >= 0; --i) PN.removeIncomingValue(i, false);
+          PN.addIncoming(V, pred);
+          ++headPN;
+        }
+        for (unsigned i = 0; i < sb.size(); ++i)
+          for (Instruction &I : *copyOf(k, i))
+            if (i || !isa<PHINode>(I))
+              RemapInstruction(&I, VMaps[k], RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+        if (k) copyOf(k - 1, sb.size() - 1)->getTerminator()->replaceSuccessorWith(head, copyOf(k, 0));
+      }
+
+      // the exits, and the head, are also reached from the copies
+      SmallPtrSet<BasicBlock*, 16> copySet(copies.begin(), copies.end());
+      for (unsigned k = 0; k < n; ++k)
+        for (unsigned i = 0; i < sb.size(); ++i) {
+          SmallPtrSet<BasicBlock*, 4> succs;
+          for (BasicBlock *succ : successors(copyOf(k, i))) {
+            if (!succs.insert(succ).second || copySet.count(succ)) continue;
+            for (PHINode &PN : succ->phis())
+              for (unsigned j = 0, e = PN.getNumIncomingValues(); j != e; ++j)
+                if (PN.getIncomingBlock(j) == sb[i])
+                  PN.addIncoming(mapped(k, PN.getIncomingValue(j)), copyOf(k, i));
+          }
+        }
+      from->getTerminator()->replaceSuccessorWith(head, copies[0]);
+      for (PHINode &PN : head->phis())
+        for (int i = PN.getNumIncomingValues() - 1; i >= 0; --i)
+          if (PN.getIncomingBlock(i) == from) PN.removeIncomingValue(i, false);
+
+      SSAUpdater SSA;
+      SmallVector<Use*, 16> usesToRename;
+      for (unsigned i = 0; i < sb.size(); ++i)
+        for (Instruction &I : *sb[i]) {
+          usesToRename.clear();
+          for (Use &U : I.uses()) {
+            Instruction *user = cast<Instruction>(U.getUser());
+            if (PHINode *UPN = dyn_cast<PHINode>(user)) {
+              if (UPN->getIncomingBlock(U) == sb[i]) continue;
+            } else if (user->getParent() == sb[i]) continue;
+            usesToRename.push_back(&U);
+          }
+          if (usesToRename.empty()) continue;
+          SSA.Initialize(I.getType(), I.getName());
+          SSA.AddAvailableValue(sb[i], &I);
+          for (unsigned k = 0; k < n; ++k) SSA.AddAvailableValue(copyOf(k, i), VMaps[k][&I]);
+          for (Use *U : usesToRename) SSA.RewriteUse(*U);
+        }
+      return copies;
+    }
+
+    /// Clone BB for every predecessor except tracePred, so that BB is only
+    /// entered from the trace. Values defined in BB are merged in SSA form
+    /// wherever both copies reach.
+    BasicBlock* TailDuplicate(BasicBlock *BB, BasicBlock *tracePred, Function &F, DomTreeUpdater &DTU) {
+      ValueToValueMapTy VMap;
+      BasicBlock *dup = CloneBasicBlock(BB, VMap, ".sb", &F);
+      for (Instruction &I : *dup)
+        RemapInstruction(&I, VMap, RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+
+      SmallPtrSet<BasicBlock*, 4> sidePreds;
+      for (BasicBlock *pred : predecessors(BB))
+        if (pred != tracePred) sidePreds.insert(pred);
+
+      // the original keeps the trace edge, the copy takes the side entrances
+      for (PHINode &PN : BB->phis()) {
+        PHINode *dupPN = cast<PHINode>(VMap[&PN]);
+        for (int i = PN.getNumIncomingValues() - 1; i >= 0; --i) {
+          if (sidePreds.count(PN.getIncomingBlock(i))) PN.removeIncomingValue(i, false);
+          else dupPN->removeIncomingValue(i, false);
+        }
+      }
+      SmallVector<DominatorTree::UpdateType, 8> updates;
+      for (BasicBlock *pred : sidePreds) {
+        pred->getTerminator()->replaceSuccessorWith(BB, dup);
+        updates.push_back({DominatorTree::Delete, pred, BB});
+        updates.push_back({DominatorTree::Insert, pred, dup});
+      }
+
+      // every successor is now also reached from the copy
+      SmallPtrSet<BasicBlock*, 4> succs;
+      for (BasicBlock *succ : successors(dup)) {
+        if (!succs.insert(succ).second) continue;
+        updates.push_back({DominatorTree::Insert, dup, succ});
+        for (PHINode &PN : succ->phis()) {
+          for (unsigned i = 0, e = PN.getNumIncomingValues(); i != e; ++i) {
+            if (PN.getIncomingBlock(i) != BB) continue;
+            Value *V = PN.getIncomingValue(i);
+            auto mapped = VMap.find(V);
+            PN.addIncoming(mapped != VMap.end() ? (Value*)mapped->second : V, dup);
+          }
+        }
+      }
+      DTU.applyUpdates(updates);
+
+      SSAUpdater SSA;
+      SmallVector<Use*, 16> usesToRename;
+      for (Instruction &I : *BB) {
+        usesToRename.clear();
+        for (Use &U : I.uses()) {
+          Instruction *user = cast<Instruction>(U.getUser());
+          if (PHINode *UPN = dyn_cast<PHINode>(user)) {
+            if (UPN->getIncomingBlock(U) == BB) continue;
+          } else if (user->getParent() == BB) continue;
+          usesToRename.push_back(&U);
+        }
+        if (usesToRename.empty()) continue;
+        SSA.Initialize(I.getType(), I.getName());
+        SSA.AddAvailableValue(BB, &I);
+        SSA.AddAvailableValue(dup, VMap[&I]);
+        for (Use *U : usesToRename) SSA.RewriteUse(*U);
+      }
+      return dup;
+    }
     /// Little predicate that returns true if the specified basic block is in
     /// a subloop of the current one, not the current one itself.
     bool inSubLoop(BasicBlock *BB, Loop *CurLoop, LoopInfo *LI) {
@@ -259,240 +3834,100 @@ static RegisterPass<BaseTrace::BaseTracePass>
       "base trace formation", false, false);
 
 namespace StaticTrace {
+  // Branch prediction heuristics of Ball and Larus, with the hit rates Wu and
+  // Larus use to turn them into edge probabilities.
+  enum Heuristic {
+    LoopBranchH,  // a loop back edge is taken
+    PointerH,     // pointers compare unequal
+    CallH,        // a successor with a call is not taken
+    OpcodeH,      // x < 0, x <= 0 and x == const fail
+    LoopExitH,    // a loop exit edge is not taken
+    ReturnH,      // a successor with a return is not taken
+    StoreH,       // a successor with a store is not taken
+    LoopHeaderH,  // a loop header or preheader successor is taken
+    GuardH,       // a successor using a compared value is taken
+    NumHeuristics
+  };
+  static const char *HeuristicName[NumHeuristics] = {
+    "loop branch", "pointer", "call", "opcode", "loop exit", "return", "store",
+    "loop header", "guard"};
+  static const double HeuristicHitRate[NumHeuristics] = {
+    0.88, 0.60, 0.78, 0.84, 0.80, 0.72, 0.55, 0.75, 0.62};
+
+  struct BranchPrediction {
+    double prob[2] = {0.5, 0.5}; // probability of successor 0 (true) and 1 (false)
+    unsigned heuristics = 0;     // bit i set if Heuristic i applied
+  };
+
+  struct SwitchPrediction {
+    SmallMapVector<BasicBlock*, double, 8> prob; // probability of each distinct successor
+    unsigned heuristics = 0;                     // bit i set if Heuristic i applied
+  };
+
   struct StaticTracePass : public BaseTrace::BaseTracePass {
     static char ID;
     StaticTracePass() : BaseTracePass(ID) {};
-    StaticTracePass(char id): BaseTracePass(id) {};
+    StaticTracePass(char &id): BaseTracePass(id) {};
+
+    bool doInitialization(Module &M) override {
+      BaseTracePass::doInitialization(M);
+      std::copy(HeuristicHitRate, HeuristicHitRate + NumHeuristics, hitRate);
+      for (auto &rate : params.hitRates) {
+          const char **name = std::find_if(HeuristicName, HeuristicName + NumHeuristics,
+                                           [&](const char *N) { return rate.first == N; });
+          if (name == HeuristicName + NumHeuristics) report() << "unknown heuristic " << rate.first << '\n';
+          else hitRate[name - HeuristicName] = rate.second;
+      }
+      return false;
+    }
 
     virtual void prepare(Function &F, LoopInfo &LI, PostDominatorTree &PDT) override {
-      for (Function::iterator bb = F.begin(), e = F.end(); bb != e; ++bb) {
-          for (BasicBlock::iterator i = bb->begin(), e = bb->end(); i != e; ++i) {
-              if (BranchInst *Ibr = dyn_cast<BranchInst>(&(*i))) { // branch instr
-                  if (Ibr->isConditional()) { // conditional branch
-                      Value *cond = Ibr->getCondition();
-                      Instruction *Icond = dyn_cast<Instruction>(cond);
-                      Value *op0 = Icond->getOperand(0);
-                      Value *op1 = Icond->getOperand(1);
-                      pair<Value*, Value*> brOps = make_pair(op0, op1);
-                      pair<int, bool> brPred;
-                      auto res = brdirMap.find(brOps);
-                      if (ICmpInst *ICC = dyn_cast<ICmpInst>(Icond)) {
-                          if (op0->getType()->isPointerTy()) {
-                          // the two operands must be the same type, enough to check one
-                              if (ICC->getPredicate()==CmpInst::ICMP_EQ) { // beq
-                                  brPred = make_pair(1, true); // label2 is likely
-                                  brdirMap[brOps] = brPred;
-                              }
-                              if (ICC->getPredicate()==CmpInst::ICMP_NE) { // bne
-                                  brPred = make_pair(1, false); // label1 is likely
-                                  brdirMap[brOps] = brPred;
-                              }
-                          }
-                          if (Constant *const0 = dyn_cast<Constant>(op0)) {
-                              if (const0->isZeroValue()) {
-                                  if (ICC->getPredicate()==CmpInst::ICMP_SGT | 
-                                      ICC->getPredicate()==CmpInst::ICMP_UGT) { // greater than
-                                      brPred = make_pair(3, true); // label2 is likely
-                                      res = brdirMap.find(brOps);
-                                      if (res != brdirMap.end()) {
-                                          if ((res->second).first<3) {}
-                                          else brdirMap[brOps] = brPred;
-                                      }
-                                      else brdirMap[brOps] = brPred;
-                                  }
-                                  if (ICC->getPredicate()==CmpInst::ICMP_SLE |
-                                      ICC->getPredicate()==CmpInst::ICMP_ULE) { // less or equal
-                                      brPred = make_pair(3, false); // label1 is likely
-                                      res = brdirMap.find(brOps);
-                                      if (res != brdirMap.end()) {
-                                          if ((res->second).first<3) {}
-                                          else brdirMap[brOps] = brPred;
-                                      }
-                                      else brdirMap[brOps] = brPred;
-                                  }
-                              }
-                          }
-                          if (Constant *const1 = dyn_cast<Constant>(op1)) {
-                              if (const1->isZeroValue()) {
-                                  if (ICC->getPredicate()==CmpInst::ICMP_SLT |
-                                      ICC->getPredicate()==CmpInst::ICMP_ULT) { // less than
-                                      brPred = make_pair(3, true); // label2 is likely
-                                      res = brdirMap.find(brOps);
-                                      if (res != brdirMap.end()) {
-                                          if ((res->second).first<3) {}
-                                          else brdirMap[brOps] = brPred;
-                                      }
-                                      else brdirMap[brOps] = brPred;
-                                  }
-                                  if (ICC->getPredicate()==CmpInst::ICMP_SGE |
-                                      ICC->getPredicate()==CmpInst::ICMP_UGE) { // greater or equal
-                                      brPred = make_pair(3, false); // label1 is likely
-                                      res = brdirMap.find(brOps);
-                                      if (res != brdirMap.end()) {
-                                          if ((res->second).first<3) {}
-                                          else brdirMap[brOps] = brPred;
-                                      }
-                                      else brdirMap[brOps] = brPred;
-                                  }
-                              }
-                          }
-                      }
-                      if (FCmpInst *FCC = dyn_cast<FCmpInst>(Icond)) {
-                          if (FCC->getPredicate()==CmpInst::FCMP_OEQ |
-                              FCC->getPredicate()==CmpInst::FCMP_UEQ) { // beq
-                              brPred = make_pair(3, true); // label2 is likely
-                              res = brdirMap.find(brOps);
-                              if (res != brdirMap.end()) {
-                                  if ((res->second).first<3) {}
-                                  else brdirMap[brOps] = brPred;
-                              }
-                              else brdirMap[brOps] = brPred;
-                          }
-                          if (FCC->getPredicate()==CmpInst::FCMP_ONE |
-                              FCC->getPredicate()==CmpInst::FCMP_UNE) { // bne
-                              brPred = make_pair(3, false); // label1 is likely
-                              res = brdirMap.find(brOps);
-                              if (res != brdirMap.end()) {
-                                  if ((res->second).first<3) {}
-                                  else brdirMap[brOps] = brPred;
-                              }
-                              else brdirMap[brOps] = brPred;
-                          }
-                          if (Constant *const0 = dyn_cast<Constant>(op0)) {
-                              if (const0->isZeroValue()) {
-                                  if (FCC->getPredicate()==CmpInst::FCMP_OGT |
-                                      FCC->getPredicate()==CmpInst::FCMP_UGT) { // greater than
-                                      brPred = make_pair(3, true); // label2 is likely
-                                      res = brdirMap.find(brOps);
-                                      if (res != brdirMap.end()) {
-                                          if ((res->second).first<3) {}
-                                          else brdirMap[brOps] = brPred;
-                                      }
-                                      else brdirMap[brOps] = brPred;
-                                  }
-                                  if (FCC->getPredicate()==CmpInst::FCMP_OLE |
-                                      FCC->getPredicate()==CmpInst::FCMP_ULE) { // less or equal
-                                      brPred = make_pair(3, false); // label1 is likely
-                                      res = brdirMap.find(brOps);
-                                      if (res != brdirMap.end()) {
-                                          if ((res->second).first<3) {}
-                                          else brdirMap[brOps] = brPred;
-                                      }
-                                      else brdirMap[brOps] = brPred;
-                                  }
-                              }
-                          }
-                          if (Constant *const1 = dyn_cast<Constant>(op1)) {
-                              if (const1->isZeroValue()) {
-                                  if (FCC->getPredicate()==CmpInst::FCMP_OLT |
-                                      FCC->getPredicate()==CmpInst::FCMP_ULT) { // less than
-                                      brPred = make_pair(3, true); // label2 is likely
-                                      res = brdirMap.find(brOps);
-                                      if (res != brdirMap.end()) {
-                                          if ((res->second).first<3) {}
-                                          else brdirMap[brOps] = brPred;
-                                      }
-                                      else brdirMap[brOps] = brPred;
-                                  }
-                                  if (FCC->getPredicate()==CmpInst::FCMP_OGE |
-                                      FCC->getPredicate()==CmpInst::FCMP_UGE) { // greater or equal
-                                      brPred = make_pair(3, false); // label1 is likely
-                                      res = brdirMap.find(brOps);
-                                      if (res != brdirMap.end()) {
-                                          if ((res->second).first<3) {}
-                                          else brdirMap[brOps] = brPred;
-                                      }
-                                      else brdirMap[brOps] = brPred;
-                                  }
-                              }
-                          }
-                      }
-                      
-                      bool inloop[2] = {0, 0}; // for branch direction heuristic
-                      bool inloopPrehead[2] = {0, 0}; // for loop heuristic
-                      for (unsigned bridx = 0; bridx < 2; bridx++) {
-                          BasicBlock *Succ = Ibr->getSuccessor(bridx);
-                          for (Loop* L : LI) {
-                              BasicBlock *preHead = L->getLoopPreheader();
-                              if (preHead==Succ) inloopPrehead[bridx] = 1;
-                              vector<BasicBlock *> allBlocks = L->getBlocks();
-                              if (find(allBlocks.begin(), allBlocks.end(), Succ) != allBlocks.end())
-                                  inloop[bridx] = 1;
-                          }
-                      }
-                      res = brdirMap.find(brOps);
-                      if (inloopPrehead[0] & !inloopPrehead[1]) {
-                          brPred = make_pair(2, false); // label1 is likely
-                          if (res != brdirMap.end()) {
-                              if ((res->second).first<2) {}
-                              else brdirMap[brOps] = brPred;
-                          }
-                          else brdirMap[brOps] = brPred;
-                      }
-                      if (!inloopPrehead[0] & inloopPrehead[1]) {
-                          brPred = make_pair(2, true); // label2 is likely
-                          if (res != brdirMap.end()) {
-                              if ((res->second).first<2) {}
-                              else brdirMap[brOps] = brPred;
-                          }
-                          else brdirMap[brOps] = brPred;
-                      }
-                      res = brdirMap.find(brOps);
-                      if (inloop[0] & !inloop[1]) {
-                          brPred = make_pair(5, false); // label1 is likely
-                          if (res != brdirMap.end()) {
-                              if ((res->second).first<5) {}
-                              else brdirMap[brOps] = brPred;
-                          }
-                          else brdirMap[brOps] = brPred;
-                      }
-                      if (!inloop[0] & inloop[1]) {
-                          brPred = make_pair(5, true); // label2 is likely
-                          if (res != brdirMap.end()) {
-                              if ((res->second).first<5) {}
-                              else brdirMap[brOps] = brPred;
-                          }
-                          else brdirMap[brOps] = brPred;
-                      }
-                      
-                      bool leadtouse[2] = {0, 0}; // for guard heuristic
-                      for (unsigned bridx = 0; bridx < 2; bridx++) {
-                          for (Function::iterator bIt = F.begin(), END = F.end(); bIt != END; ++bIt) {
-                              if (PDT.dominates(&bIt->front(), &Ibr->getSuccessor(bridx)->front())) {
-                                  for (User *op0User : op0->users()) {
-                                      if (Instruction *Iop0User = dyn_cast<Instruction>(op0User)) {
-                                          BasicBlock *Iop0UserBlock = Iop0User->getParent();
-                                          if (&(*bIt)==Iop0UserBlock) leadtouse[bridx] = 1;
-                                      }
-                                  }
-                                  for (User *op1User : op1->users()) {
-                                      if (Instruction *Iop1User = dyn_cast<Instruction>(op1User)) {
-                                          BasicBlock *Iop1UserBlock = Iop1User->getParent();
-                                          if (&(*bIt)==Iop1UserBlock) leadtouse[bridx] = 1;
-                                      }
-                                  }
-                              }
-                          }
-                      }
-                      res = brdirMap.find(brOps);
-                      if (leadtouse[0] & !leadtouse[1]) {
-                          brPred = make_pair(4, false); // label1 is likely
-                          if (res != brdirMap.end()) {
-                              if ((res->second).first<4) {}
-                              else brdirMap[brOps] = brPred;
-                          }
-                          else brdirMap[brOps] = brPred;
-                      }
-                      if (!leadtouse[0] & leadtouse[1]) {
-                          brPred = make_pair(4, true); // label2 is likely
-                          if (res != brdirMap.end()) {
-                              if ((res->second).first<4) {}
-                              else brdirMap[brOps] = brPred;
-                          }
-                          else brdirMap[brOps] = brPred;
-                      }
-                  }
-              }
+      brdirMap.clear();
+      swdirMap.clear();
+      useBlocks.clear();
+      // one pass over the function for what the heuristics look for in a
+      // successor, and O(1) post-dominance queries from here on
+      blockKinds.clear();
+      for (BasicBlock &BB : F) {
+          unsigned kinds = 0;
+          for (Instruction &I : BB) {
+              if (isa<CallBase>(I) && !isa<IntrinsicInst>(I)) kinds |= HasCall;
+              else if (isa<StoreInst>(I)) kinds |= HasStore;
+              else if (isa<ReturnInst>(I)) kinds |= HasReturn;
+          }
+          blockKinds[&BB] = kinds;
+      }
+      PDT.updateDFSNumbers();
+
+      for (BasicBlock &BB : F) {
+          if (SwitchInst *SI = dyn_cast<SwitchInst>(BB.getTerminator())) {
+              predictSwitch(SI, LI, PDT);
+              continue;
+          }
+          BranchInst *Ibr = dyn_cast<BranchInst>(BB.getTerminator());
+          if (!Ibr || !Ibr->isConditional()) continue;
+          BranchPrediction &pred = brdirMap[Ibr];
+          int dir[NumHeuristics];
+          dir[LoopBranchH] = loopBranchHeuristic(Ibr, LI);
+          dir[PointerH] = pointerHeuristic(Ibr);
+          dir[CallH] = avoidHeuristic(Ibr, PDT, HasCall);
+          dir[OpcodeH] = opcodeHeuristic(Ibr);
+          dir[LoopExitH] = dir[LoopBranchH] < 0 ? loopExitHeuristic(Ibr, LI) : -1;
+          dir[ReturnH] = avoidHeuristic(Ibr, PDT, HasReturn);
+          dir[StoreH] = avoidHeuristic(Ibr, PDT, HasStore);
+          dir[LoopHeaderH] = loopHeaderHeuristic(Ibr, LI, PDT);
+          dir[GuardH] = guardHeuristic(Ibr, PDT);
+          // Dempster-Shafer: fold every applicable heuristic into the estimate
+          for (unsigned h = 0; h < NumHeuristics; h++) {
+              if (dir[h] < 0) continue;
+              double p = hitRate[h];
+              double taken = pred.prob[dir[h]] * p;
+              double notTaken = pred.prob[1 - dir[h]] * (1 - p);
+              pred.prob[dir[h]] = taken / (taken + notTaken);
+              pred.prob[1 - dir[h]] = notTaken / (taken + notTaken);
+              pred.heuristics |= 1u << h;
+              LLVM_DEBUG(dbgs() << BB.getName() << ": " << HeuristicName[h]
+                                << " predicts successor " << dir[h] << '\n');
           }
       }
     }
@@ -502,37 +3937,389 @@ namespace StaticTrace {
       Instruction *T = BB->getTerminator();
       if (BranchInst *brInst = dyn_cast<BranchInst>(T)) {
           if (brInst->isConditional()) { // conditional branch
-              Instruction *Icond = dyn_cast<Instruction>(brInst->getCondition());
-              pair<Value*, Value*> brOps = make_pair(Icond->getOperand(0), Icond->getOperand(1));
               bool hasHazard[2] = {0, 0};
               for (unsigned bridx = 0; bridx < 2; bridx++) {
                   BasicBlock *Succ = brInst->getSuccessor(bridx);
                   if (containHazard(Succ)) hasHazard[bridx] = 1;
-                  /*for (Function::iterator bb = F.begin(), e = F.end(); bb != e; ++bb) {
-                      if (PDT.dominates(&bb->front(), &Succ->front()))
-                          if (containHazard(&(*bb))) hasHazard[bridx] = 1;
-                  }*/
               }
               if (hasHazard[0] & !hasHazard[1]) return brInst->getSuccessor(1);
               if (!hasHazard[0] & hasHazard[1]) return brInst->getSuccessor(0);
               if (hasHazard[0] & hasHazard[1]) return nullptr;
-              
-              auto res = brdirMap.find(brOps);
-              if (res != brdirMap.end()) {
-                  if ((res->second).second) return brInst->getSuccessor(1);
-                  else return brInst->getSuccessor(0);
-              }
+
+              // same threshold as the profile predictor
+              double thres = double(thresProb) / BranchProbability::getDenominator();
+              auto res = brdirMap.find(brInst);
+              if (res == brdirMap.end()) return nullptr;
+              if ((res->second).prob[0] >= thres) return brInst->getSuccessor(0);
+              if ((res->second).prob[1] >= thres) return brInst->getSuccessor(1);
+              return nullptr;
           }
       }
+      if (SwitchInst *SI = dyn_cast<SwitchInst>(T)) {
+          // the likeliest hazard-free case, however likely: a switch took
+          // one of them
+          auto res = swdirMap.find(SI);
+          BasicBlock *best = nullptr;
+          double bestProb = -1;
+          if (res != swdirMap.end())
+              for (auto &succ : (res->second).prob)
+                  if (succ.second > bestProb && !containHazard(succ.first)) {
+                      best = succ.first;
+                      bestProb = succ.second;
+                  }
+          return best;
+      }
       for (BasicBlock *Succ : successors(BB)) {
           if (!containHazard(Succ)) return Succ;
       } // if no applicable heuristic, return the first hazard-free succ
       return nullptr; // if no any, return nullptr
     }
 
+    // Turn the combined predictions into branch_weights; branches without a
+    // prediction are uniform.
+    virtual bool annotate(Function &F) override {
+      if (!StaticBranchWeights) return false;
+      MDBuilder MDB(F.getContext());
+      bool changed = false;
+      for (BasicBlock &BB : F) {
+          Instruction *T = BB.getTerminator();
+          if (!T || T->getNumSuccessors() < 2) continue;
+          if (T->getMetadata(LLVMContext::MD_prof) && !OverwriteBranchWeights) continue;
+          if (BranchInst *brInst = dyn_cast<BranchInst>(T)) {
+              uint32_t w0 = 500;
+              auto res = brdirMap.find(brInst);
+              if (res != brdirMap.end())
+                  w0 = std::min(999u, std::max(1u, unsigned((res->second).prob[0] * 1000 + 0.5)));
+              T->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(w0, 1000 - w0));
+              changed = true;
+          } else if (SwitchInst *SI = dyn_cast<SwitchInst>(T)) {
+              // a successor's probability is shared by the edges into it
+              SmallDenseMap<BasicBlock*, unsigned, 8> edges;
+              for (BasicBlock *Succ : successors(SI)) edges[Succ]++;
+              SwitchPrediction &pred = swdirMap[SI];
+              SmallVector<uint32_t, 8> weights;
+              for (BasicBlock *Succ : successors(SI))
+                  weights.push_back(std::max(1u, unsigned(pred.prob.lookup(Succ) / edges[Succ] * 1000 + 0.5)));
+              T->setMetadata(LLVMContext::MD_prof, MDB.createBranchWeights(weights));
+              changed = true;
+          }
+      }
+      return changed;
+    }
+
+    virtual void caseProbabilities(Instruction *T, BranchProbabilityInfo &BPI,
+                                   SmallMapVector<BasicBlock*, double, 8> &probs) override {
+      auto res = isa<SwitchInst>(T) ? swdirMap.find(cast<SwitchInst>(T)) : swdirMap.end();
+      if (res == swdirMap.end()) return BaseTracePass::caseProbabilities(T, BPI, probs);
+      probs = (res->second).prob;
+    }
+
+    // The compare takes over the hot case; the rest of the switch keeps the
+    // odds among the other cases.
+    virtual void casePeeled(Instruction *T, BasicBlock *hot, BranchInst *br, double p) override {
+      BranchPrediction &pred = brdirMap[br];
+      pred.prob[0] = p;
+      pred.prob[1] = 1 - p;
+      auto res = isa<SwitchInst>(T) ? swdirMap.find(cast<SwitchInst>(T)) : swdirMap.end();
+      if (res == swdirMap.end()) return;
+      SmallMapVector<BasicBlock*, double, 8> &prob = (res->second).prob;
+      prob.erase(hot);
+      double total = 0;
+      for (auto &succ : prob) total += succ.second;
+      if (total > 0)
+          for (auto &succ : prob) succ.second /= total;
+    }
+
+    // Per branch: block, heuristics and the two probabilities; per switch:
+    // block, heuristics, and successor and probability of each case, in
+    // order, as predict breaks ties by it.
+    virtual void savePredictions(Function &F, const DenseMap<BasicBlock*, unsigned> &index,
+                                 std::vector<uint32_t> &words) override {
+      words.push_back(brdirMap.size());
+      for (auto &br : brdirMap) {
+          words.push_back(index.lookup(br.first->getParent()));
+          words.push_back(br.second.heuristics);
+          TraceCache::PutDouble(words, br.second.prob[0]);
+          TraceCache::PutDouble(words, br.second.prob[1]);
+      }
+      words.push_back(swdirMap.size());
+      for (auto &sw : swdirMap) {
+          words.push_back(index.lookup(sw.first->getParent()));
+          words.push_back(sw.second.heuristics);
+          words.push_back(sw.second.prob.size());
+          for (auto &succ : sw.second.prob) {
+              words.push_back(index.lookup(succ.first));
+              TraceCache::PutDouble(words, succ.second);
+          }
+      }
+    }
+
+    virtual bool loadPredictions(Function &F, ArrayRef<uint32_t> words) override {
+      brdirMap.clear();
+      swdirMap.clear();
+      std::vector<BasicBlock*> blocks;
+      for (BasicBlock &BB : F) blocks.push_back(&BB);
+      size_t pos = 0;
+      auto take = [&](size_t n) { return words.size() - pos >= n; };
+      if (!take(1)) return false;
+      for (uint32_t n = words[pos++]; n; --n) {
+          if (!take(6) || words[pos] >= blocks.size()) return false;
+          BranchInst *br = dyn_cast<BranchInst>(blocks[words[pos]]->getTerminator());
+          if (!br || !br->isConditional()) return false;
+          BranchPrediction &pred = brdirMap[br];
+          pred.heuristics = words[pos + 1];
+          pred.prob[0] = TraceCache::GetDouble(&words[pos + 2]);
+          pred.prob[1] = TraceCache::GetDouble(&words[pos + 4]);
+          pos += 6;
+      }
+      if (!take(1)) return false;
+      for (uint32_t n = words[pos++]; n; --n) {
+          if (!take(3) || words[pos] >= blocks.size()) return false;
+          SwitchInst *SI = dyn_cast<SwitchInst>(blocks[words[pos]]->getTerminator());
+          if (!SI) return false;
+          SwitchPrediction &pred = swdirMap[SI];
+          pred.heuristics = words[pos + 1];
+          uint32_t numSuccs = words[pos + 2];
+          pos += 3;
+          for (; numSuccs; --numSuccs, pos += 3) {
+              if (!take(3) || words[pos] >= blocks.size()) return false;
+              pred.prob[blocks[words[pos]]] = TraceCache::GetDouble(&words[pos + 1]);
+          }
+      }
+      return pos == words.size();
+    }
+
+    protected:
+    // The heuristics return the index of the successor they predict taken, or
+    // -1 if they do not apply.
+
+    int loopBranchHeuristic(BranchInst *Ibr, LoopInfo &LI) {
+      Loop *L = LI.getLoopFor(Ibr->getParent());
+      if (!L) return -1;
+      bool back0 = Ibr->getSuccessor(0) == L->getHeader();
+      bool back1 = Ibr->getSuccessor(1) == L->getHeader();
+      if (back0 == back1) return -1;
+      return back0 ? 0 : 1;
+    }
+
+    int loopExitHeuristic(BranchInst *Ibr, LoopInfo &LI) {
+      Loop *L = LI.getLoopFor(Ibr->getParent());
+      if (!L) return -1;
+      bool exit0 = !L->contains(Ibr->getSuccessor(0));
+      bool exit1 = !L->contains(Ibr->getSuccessor(1));
+      if (exit0 == exit1) return -1;
+      return exit0 ? 1 : 0;
+    }
+
+    int pointerHeuristic(BranchInst *Ibr) {
+      ICmpInst *ICC = dyn_cast<ICmpInst>(Ibr->getCondition());
+      if (!ICC || !ICC->getOperand(0)->getType()->isPointerTy()) return -1;
+      if (ICC->getPredicate() == CmpInst::ICMP_EQ) return 1;
+      if (ICC->getPredicate() == CmpInst::ICMP_NE) return 0;
+      return -1;
+    }
+
+    int opcodeHeuristic(BranchInst *Ibr) {
+      CmpInst *Icond = dyn_cast<CmpInst>(Ibr->getCondition());
+      if (!Icond) return -1;
+      Value *op0 = Icond->getOperand(0);
+      Value *op1 = Icond->getOperand(1);
+      // put a constant on the right so that "x pred 0" covers both forms
+      CmpInst::Predicate P = Icond->getPredicate();
+      if (isa<Constant>(op0) && !isa<Constant>(op1)) {
+          std::swap(op0, op1);
+          P = CmpInst::getSwappedPredicate(P);
+      }
+      Constant *C = dyn_cast<Constant>(op1);
+      if (!C) return -1;
+      if (isa<ICmpInst>(Icond)) {
+          if (op0->getType()->isPointerTy()) return -1; // pointer heuristic
+          if (P == CmpInst::ICMP_EQ) return 1; // x == const fails
+          if (P == CmpInst::ICMP_NE) return 0;
+          if (!C->isZeroValue()) return -1;
+          if (P == CmpInst::ICMP_SLT || P == CmpInst::ICMP_SLE) return 1; // x < 0, x <= 0 fail
+          if (P == CmpInst::ICMP_SGT || P == CmpInst::ICMP_SGE) return 0;
+          return -1;
+      }
+      if (P == CmpInst::FCMP_OEQ || P == CmpInst::FCMP_UEQ) return 1; // float == fails
+      if (P == CmpInst::FCMP_ONE || P == CmpInst::FCMP_UNE) return 0;
+      if (!C->isZeroValue()) return -1;
+      if (P == CmpInst::FCMP_OLT || P == CmpInst::FCMP_ULT ||
+          P == CmpInst::FCMP_OLE || P == CmpInst::FCMP_ULE) return 1;
+      if (P == CmpInst::FCMP_OGT || P == CmpInst::FCMP_UGT ||
+          P == CmpInst::FCMP_OGE || P == CmpInst::FCMP_UGE) return 0;
+      return -1;
+    }
+
+    // Call, return and store: predict the successor that does not contain an
+    // instruction of the given kind, unless it post-dominates the branch.
+    int avoidHeuristic(BranchInst *Ibr, PostDominatorTree &PDT, unsigned kind) {
+      bool has[2] = {0, 0};
+      for (unsigned bridx = 0; bridx < 2; bridx++) {
+          BasicBlock *Succ = Ibr->getSuccessor(bridx);
+          if (PDT.dominates(Succ, Ibr->getParent())) continue;
+          has[bridx] = blockKinds.lookup(Succ) & kind;
+      }
+      if (has[0] == has[1]) return -1;
+      return has[0] ? 1 : 0;
+    }
+
+    int loopHeaderHeuristic(BranchInst *Ibr, LoopInfo &LI, PostDominatorTree &PDT) {
+      bool header[2] = {0, 0};
+      Loop *L = LI.getLoopFor(Ibr->getParent());
+      for (unsigned bridx = 0; bridx < 2; bridx++) {
+          BasicBlock *Succ = Ibr->getSuccessor(bridx);
+          if (PDT.dominates(Succ, Ibr->getParent())) continue;
+          if (L && Succ == L->getHeader()) continue; // back edge, loop branch heuristic
+          if (LI.isLoopHeader(Succ)) header[bridx] = 1;
+          BasicBlock *next = Succ->getSingleSuccessor();
+          if (next && LI.isLoopHeader(next) && LI.getLoopFor(next)->getLoopPreheader() == Succ)
+              header[bridx] = 1;
+      }
+      if (header[0] == header[1]) return -1;
+      return header[0] ? 0 : 1;
+    }
+
+    // Switches start from one share per case value, the default counting as
+    // one; unreachable cases get none. Every heuristic judging a successor on
+    // its own then scales the successors it predicts taken by its hit rate
+    // and the others by the miss rate, the n-way form of the combination
+    // for two-way branches.
+    void predictSwitch(SwitchInst *SI, LoopInfo &LI, PostDominatorTree &PDT) {
+      SwitchPrediction &pred = swdirMap[SI];
+      pred.prob[SI->getDefaultDest()] += 1;
+      for (auto &Case : SI->cases()) pred.prob[Case.getCaseSuccessor()] += 1;
+      auto unreachable = [](BasicBlock *Succ) { return isa<UnreachableInst>(Succ->getTerminator()); };
+      if (!all_of(successors(SI), unreachable))
+          for (auto &succ : pred.prob)
+              if (unreachable(succ.first)) succ.second = 0;
+      auto combine = [&](Heuristic h, function_ref<bool(BasicBlock*)> taken) {
+          unsigned numTaken = 0;
+          for (auto &succ : pred.prob) numTaken += taken(succ.first);
+          if (numTaken == 0 || numTaken == pred.prob.size()) return;
+          double total = 0;
+          for (auto &succ : pred.prob) {
+              succ.second *= taken(succ.first) ? hitRate[h] : 1 - hitRate[h];
+              total += succ.second;
+          }
+          if (total > 0)
+              for (auto &succ : pred.prob) succ.second /= total;
+          pred.heuristics |= 1u << h;
+          LLVM_DEBUG(dbgs() << SI->getParent()->getName() << ": " << HeuristicName[h]
+                            << " predicts " << numTaken << " cases\n");
+      };
+      BasicBlock *BB = SI->getParent();
+      Loop *L = LI.getLoopFor(BB);
+      auto avoid = [&](unsigned kind) {
+          return [&, kind](BasicBlock *Succ) {
+              return PDT.dominates(Succ, BB) || !(blockKinds.lookup(Succ) & kind);
+          };
+      };
+      if (L) combine(LoopBranchH, [&](BasicBlock *Succ) { return Succ == L->getHeader(); });
+      combine(CallH, avoid(HasCall));
+      if (L && !(pred.heuristics & (1u << LoopBranchH)))
+          combine(LoopExitH, [&](BasicBlock *Succ) { return L->contains(Succ); });
+      combine(ReturnH, avoid(HasReturn));
+      combine(StoreH, avoid(HasStore));
+      combine(LoopHeaderH, [&](BasicBlock *Succ) {
+          if (PDT.dominates(Succ, BB) || (L && Succ == L->getHeader())) return false;
+          BasicBlock *next = Succ->getSingleSuccessor();
+          return LI.isLoopHeader(Succ) ||
+                 (next && LI.isLoopHeader(next) && LI.getLoopFor(next)->getLoopPreheader() == Succ);
+      });
+      double total = 0;
+      for (auto &succ : pred.prob) total += succ.second;
+      if (total > 0)
+          for (auto &succ : pred.prob) succ.second /= total;
+    }
+
+    // A successor is guarded if a block post-dominating it uses one of the
+    // compared values. Per value, the user blocks are kept sorted by their
+    // post-dominator DFS number, so each branch is answered by binary search.
+    int guardHeuristic(BranchInst *Ibr, PostDominatorTree &PDT) {
+      CmpInst *Icond = dyn_cast<CmpInst>(Ibr->getCondition());
+      if (!Icond) return -1;
+      bool leadtouse[2] = {0, 0};
+      BasicBlock *cmpBB = Icond->getParent();
+      for (Value *op : {Icond->getOperand(0), Icond->getOperand(1)}) {
+          if (isa<Constant>(op)) continue;
+          UseBlocks &uses = getUseBlocks(op, PDT);
+          // the compare itself is not a use on either side
+          auto cmpUses = uses.count.find(cmpBB);
+          BasicBlock *exclude = cmpUses != uses.count.end() && cmpUses->second == 1 ? cmpBB : nullptr;
+          for (unsigned bridx = 0; bridx < 2; bridx++) {
+              if (usePostDominates(uses, Ibr->getSuccessor(bridx), PDT, exclude)) leadtouse[bridx] = 1;
+          }
+      }
+      if (leadtouse[0] == leadtouse[1]) return -1;
+      return leadtouse[0] ? 0 : 1;
+    }
+
+    // branch: probabilities of its two successors after combining the heuristics
+    map<BranchInst*, BranchPrediction> brdirMap;
+    // switch: probabilities of its distinct successors
+    map<SwitchInst*, SwitchPrediction> swdirMap;
+
     private:
-    // <op0, op1>: <heuristic priority (1:highest), branch to label1(false)/label2(true)>
-    map<pair<Value*, Value*>, pair<int, bool> > brdirMap;
+    double hitRate[NumHeuristics]; // of the module being run on
+    enum BlockKind { HasCall = 1, HasStore = 2, HasReturn = 4 };
+    DenseMap<BasicBlock*, unsigned> blockKinds;
+    // A user block's post-dominator subtree, with the two largest DFS out
+    // numbers among it and all user blocks sorted before it.
+    struct UseInterval {
+      unsigned in;
+      unsigned maxOut = 0, secondOut = 0;
+      BasicBlock *maxBB = nullptr;
+    };
+    struct UseBlocks {
+      DenseMap<BasicBlock*, unsigned> count; // user block: number of users in it
+      SmallVector<UseInterval, 4> intervals; // sorted by DFS in
+    };
+    DenseMap<Value*, UseBlocks> useBlocks;
+
+    UseBlocks &getUseBlocks(Value *V, PostDominatorTree &PDT) {
+      auto res = useBlocks.find(V);
+      if (res != useBlocks.end()) return res->second;
+      UseBlocks &uses = useBlocks[V];
+      for (User *U : V->users())
+          if (Instruction *I = dyn_cast<Instruction>(U)) uses.count[I->getParent()]++;
+      for (auto &userBlock : uses.count) {
+          if (DomTreeNode *N = PDT.getNode(userBlock.first)) {
+              UseInterval UI;
+              UI.in = N->getDFSNumIn();
+              UI.maxOut = N->getDFSNumOut();
+              UI.maxBB = userBlock.first;
+              uses.intervals.push_back(UI);
+          }
+      }
+      std::sort(uses.intervals.begin(), uses.intervals.end(),
+                [](const UseInterval &a, const UseInterval &b) { return a.in < b.in; });
+      for (unsigned i = 1; i < uses.intervals.size(); i++) {
+          UseInterval &prev = uses.intervals[i-1], &cur = uses.intervals[i];
+          if (cur.maxOut >= prev.maxOut) {
+              cur.secondOut = prev.maxOut;
+          } else {
+              cur.secondOut = std::max(cur.maxOut, prev.secondOut);
+              cur.maxOut = prev.maxOut;
+              cur.maxBB = prev.maxBB;
+          }
+      }
+      return uses;
+    }
+
+    // Post-dominator subtrees nest, so a user block is an ancestor of BB iff
+    // it starts no later than BB and ends no earlier. exclude, if set, is a
+    // user block that does not count.
+    bool usePostDominates(UseBlocks &uses, BasicBlock *BB, PostDominatorTree &PDT, BasicBlock *exclude) {
+      DomTreeNode *N = PDT.getNode(BB);
+      if (!N) return false;
+      auto it = std::upper_bound(uses.intervals.begin(), uses.intervals.end(), N->getDFSNumIn(),
+                                 [](unsigned in, const UseInterval &UI) { return in < UI.in; });
+      if (it == uses.intervals.begin()) return false;
+      --it;
+      unsigned out = it->maxBB == exclude ? it->secondOut : it->maxOut;
+      return out >= N->getDFSNumOut();
+    }
   };
 }
 char StaticTrace::StaticTracePass::ID = 0;
@@ -540,12 +4327,32 @@ static RegisterPass<StaticTrace::StaticTracePass>
     C("static",
       "hazard avoidance + path selection", false, false);
 
+// For sb-trace-driver -tune: the parameters the passes would run with, every
+// heuristic's hit rate included, and an override for the next runs ("" to
+// drop it), both as TraceConfig JSON.
+extern "C" void HW2GetTraceConfig(raw_ostream *OS) {
+  TraceConfig::Params P = TraceConfig::Load();
+  for (unsigned h = 0; h < StaticTrace::NumHeuristics; ++h)
+    P.hitRates.insert({StaticTrace::HeuristicName[h], StaticTrace::HeuristicHitRate[h]});
+  *OS << TraceConfig::ToJSON(P);
+}
+
+extern "C" void HW2SetTraceConfig(const char *json) {
+  std::lock_guard<std::mutex> lock(TraceConfig::OverrideLock);
+  TraceConfig::Override = json;
+}
+
 namespace ProfileTrace {
     struct ProfileTracePass : public BaseTrace::BaseTracePass {
         static char ID;
         ProfileTracePass() : BaseTracePass(ID) {};
+        ProfileTracePass(char &id) : BaseTracePass(id) {};
 
         virtual BasicBlock* predict(BasicBlock *BB, Function &F, PostDominatorTree &PDT, BranchProbabilityInfo &BPI) override {
+            // a path profile sees branch correlation along the trace
+            BasicBlock *pathSucc;
+            if (PredictFromPaths(currentTrace(), pathSucc)) return pathSucc;
+
             BasicBlock *bestSucc = nullptr;
             uint32_t maxProb = 0;
             for (BasicBlock *Succ : successors(BB)) {
@@ -567,6 +4374,168 @@ static RegisterPass<ProfileTrace::ProfileTracePass>
     P("profile",
       "use profile info", false, false);
 
+namespace FPLICM {
+  // Frequent path LICM: hoist the loads on the hot path of a loop whose
+  // address is loop invariant and that only stores off the hot path may
+  // overwrite. Each hoisted value lives in a stack slot set in the preheader
+  // and reloaded after every such store (the repair code); the slots are
+  // promoted to registers afterwards. The performance variant also hoists
+  // the computations on the hot path that depend only on hoisted and
+  // invariant values, recomputing them in the repair code.
+  struct FPLICMCorrectnessPass : public ProfileTrace::ProfileTracePass {
+    static char ID;
+    FPLICMCorrectnessPass() : ProfileTracePass(ID) {};
+    FPLICMCorrectnessPass(char &id) : ProfileTracePass(id) {};
+
+    virtual bool optimize(Function &F, LoopInfo &LI, DominatorTree &DT) override {
+      AAResults &AA = *analyses.AA;
+      numLoads = numComputations = numRepairs = 0;
+      bool changed = false;
+      std::vector<Loop*> allLoops = FindAllLoops(LI);
+      std::sort(allLoops.begin(), allLoops.end(), CompareLoopDepth);
+      for (Loop *L : allLoops) changed |= HoistHotPath(L, F, AA, DT);
+      report() << "fplicm: hoisted loads: " << numLoads << ", hoisted computations: " << numComputations
+             << ", repair sites: " << numRepairs << "\n\n";
+      return changed;
+    }
+
+    virtual bool needsAA() const override { return true; }
+
+    protected:
+    virtual bool hoistDependents() const { return false; }
+
+    private:
+    unsigned numLoads = 0, numComputations = 0, numRepairs = 0;
+
+    // A load of a loop invariant address is hoistable if it executes on
+    // every iteration or is safe to speculate, and everything in the loop
+    // that may overwrite it is a plain store off the hot path.
+    bool CanHoistLoad(LoadInst *LI, Loop *L, SmallPtrSetImpl<BasicBlock*> &hot, AAResults &AA,
+                      DominatorTree &DT, LoopSafetyInfo &safety, std::vector<Instruction*> &clobbers) {
+      if (!LI->isSimple() || !L->isLoopInvariant(LI->getPointerOperand())) return false;
+      if (!isSafeToSpeculativelyExecute(LI) && !safety.isGuaranteedToExecute(*LI, &DT, L)) return false;
+      MemoryLocation loc = MemoryLocation::get(LI);
+      for (BasicBlock *BB : L->blocks())
+        for (Instruction &I : *BB) {
+          if (!I.mayWriteToMemory() || !isModSet(AA.getModRefInfo(&I, loc))) continue;
+          StoreInst *SI = dyn_cast<StoreInst>(&I);
+          if (!SI || !SI->isSimple() || hot.count(BB)) return false;
+          clobbers.push_back(SI);
+        }
+      return true;
+    }
+
+    bool HoistHotPath(Loop *L, Function &F, AAResults &AA, DominatorTree &DT) {
+      BasicBlock *preheader = L->getLoopPreheader();
+      if (!preheader) return false;
+      SmallPtrSet<BasicBlock*, 8> hot;
+      std::vector<BasicBlock*> path;
+      for (BasicBlock *BB : TraceFrom(L->getHeader())) {
+        if (!L->contains(BB)) break;
+        hot.insert(BB);
+        path.push_back(BB);
+      }
+      SimpleLoopSafetyInfo safety;
+      safety.computeLoopSafetyInfo(L);
+
+      // the hoisted instructions in path order, so operands come first, and
+      // the stores after which each load is repaired
+      std::vector<Instruction*> hoisted;
+      SmallPtrSet<Instruction*, 16> isHoisted;
+      DenseMap<Instruction*, std::vector<Instruction*> > clobbersOf;
+      for (BasicBlock *BB : path)
+        for (Instruction &I : *BB) {
+          if (LoadInst *LI = dyn_cast<LoadInst>(&I)) {
+            std::vector<Instruction*> clobbers;
+            if (!CanHoistLoad(LI, L, hot, AA, DT, safety, clobbers)) continue;
+            clobbersOf[LI] = clobbers;
+            numLoads++;
+          } else {
+            if (!hoistDependents() || isa<PHINode>(I) || I.isTerminator() || I.mayReadOrWriteMemory() ||
+                !isSafeToSpeculativelyExecute(&I))
+              continue;
+            if (!all_of(I.operands(), [&](Value *op) {
+                  Instruction *def = dyn_cast<Instruction>(op);
+                  return L->isLoopInvariant(op) || (def && isHoisted.count(def));
+                }))
+              continue;
+            numComputations++;
+          }
+          hoisted.push_back(&I);
+          isHoisted.insert(&I);
+        }
+      if (hoisted.empty()) return false;
+
+      // preheader copies, each kept in its slot
+      IRBuilder<> entryB(&*F.getEntryBlock().getFirstInsertionPt());
+      DenseMap<Instruction*, AllocaInst*> slotOf;
+      std::vector<AllocaInst*> slots;
+      ValueToValueMapTy VMap;
+      for (Instruction *I : hoisted) {
+        AllocaInst *slot = entryB.CreateAlloca(I->getType(), nullptr, I->getName() + ".fplicm");
+        slotOf[I] = slot;
+        slots.push_back(slot);
+        Instruction *copy = I->clone();
+        copy->insertBefore(preheader->getTerminator());
+        copy->setName(I->getName());
+        RemapInstruction(copy, VMap, RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+        VMap[I] = copy;
+        new StoreInst(copy, slot, preheader->getTerminator());
+      }
+
+      // after a store that may overwrite hoisted loads, reload them and
+      // recompute what depends on them
+      MapVector<Instruction*, SmallPtrSet<Instruction*, 4> > repairs;
+      for (Instruction *I : hoisted)
+        for (Instruction *SI : clobbersOf.lookup(I)) repairs[SI].insert(I);
+      for (auto &site : repairs) {
+        IRBuilder<> B(site.first->getNextNode());
+        DenseMap<Instruction*, Value*> current;
+        for (Instruction *I : hoisted) {
+          bool affected = site.second.count(I);
+          for (Value *op : I->operands())
+            if (Instruction *def = dyn_cast<Instruction>(op)) affected |= current.count(def) > 0;
+          if (!affected) continue;
+          Instruction *copy = I->clone();
+          for (Use &U : copy->operands()) {
+            Instruction *def = dyn_cast<Instruction>(U.get());
+            if (!def || !isHoisted.count(def)) continue;
+            auto it = current.find(def);
+            U.set(it != current.end() ? it->second : B.CreateLoad(def->getType(), slotOf[def]));
+          }
+          B.Insert(copy, I->getName() + ".repair");
+          B.CreateStore(copy, slotOf[I]);
+          current[I] = copy;
+        }
+        numRepairs++;
+      }
+
+      for (Instruction *I : hoisted) {
+        I->replaceAllUsesWith(new LoadInst(I->getType(), slotOf[I], I->getName() + ".reload", I));
+        I->eraseFromParent();
+      }
+      PromoteMemToReg(slots, DT);
+      return true;
+    }
+  };
+
+  struct FPLICMPerformancePass : public FPLICMCorrectnessPass {
+    static char ID;
+    FPLICMPerformancePass() : FPLICMCorrectnessPass(ID) {};
+
+    protected:
+    virtual bool hoistDependents() const override { return true; }
+  };
+}
+char FPLICM::FPLICMCorrectnessPass::ID = 0;
+static RegisterPass<FPLICM::FPLICMCorrectnessPass>
+    FC("fplicm-correctness",
+       "frequent path LICM of loads, with repair code", false, false);
+char FPLICM::FPLICMPerformancePass::ID = 0;
+static RegisterPass<FPLICM::FPLICMPerformancePass>
+    FP("fplicm-performance",
+       "frequent path LICM of loads and their dependent computation", false, false);
+
 
 namespace HazardProfileTrace {
     struct HazardProfileTracePass : public StaticTrace::StaticTracePass {
@@ -578,8 +4547,6 @@ namespace HazardProfileTrace {
             Instruction *T = BB->getTerminator();
             if (BranchInst *brInst = dyn_cast<BranchInst>(T)) {
                 if (brInst->isConditional()) { // conditional branch
-                    Instruction *Icond = dyn_cast<Instruction>(brInst->getCondition());
-                    pair<Value*, Value*> brOps = make_pair(Icond->getOperand(0), Icond->getOperand(1));
                     bool hasHazard[2] = {0, 0};
                     for (unsigned bridx = 0; bridx < 2; bridx++) {
                         BasicBlock *Succ = brInst->getSuccessor(bridx);
@@ -604,12 +4571,130 @@ namespace HazardProfileTrace {
                     bestSucc = Succ;
                 }
             }
-            if ((maxProb >= thresProb) & !containHazard(bestSucc)) return bestSucc;
+            if (maxProb >= thresProb && !containHazard(bestSucc)) return bestSucc;
             else return nullptr;
         }
+
+        // the profiled odds, as predict uses them
+        virtual void caseProbabilities(Instruction *T, BranchProbabilityInfo &BPI,
+                                       SmallMapVector<BasicBlock*, double, 8> &probs) override {
+            BaseTracePass::caseProbabilities(T, BPI, probs);
+        }
     };
 }
 char HazardProfileTrace::HazardProfileTracePass::ID = 0;
 static RegisterPass<HazardProfileTrace::HazardProfileTracePass>
     HP("hazardprofile",
       "testing inheritence", false, false);
+
+namespace NewPM {
+  // The successors of every block, to tell whether a pass kept the CFG.
+  // Moving blocks around does not change it.
+  typedef DenseMap<BasicBlock*, SmallVector<BasicBlock*, 2> > CFGEdges;
+  CFGEdges TakeCFG(Function &F) {
+    CFGEdges edges;
+    for (BasicBlock &BB : F) edges[&BB].append(succ_begin(&BB), succ_end(&BB));
+    return edges;
+  }
+
+  bool SameCFG(const CFGEdges &before, const CFGEdges &after) {
+    if (before.size() != after.size()) return false;
+    for (auto &block : before) {
+      auto it = after.find(block.first);
+      if (it == after.end() || it->second != block.second) return false;
+    }
+    return true;
+  }
+
+  // A trace pass under the new pass manager. It runs over the module, as the
+  // growth budget, the profile and the call summaries are the module's, and
+  // takes the analyses of each function from the function analysis manager,
+  // cached ones included. A function keeps the CFG analyses if its CFG did
+  // not change, and everything if nothing did.
+  template <class TracePass>
+  struct TracePassAdaptor : public PassInfoMixin<TracePassAdaptor<TracePass> > {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+      bool changed = false;
+      if (!TraceSampleProfile.empty() && SampleInput::LoadSampleProfile(M, MAM)) {
+        MAM.invalidate(M, PreservedAnalyses::none());
+        changed = true;
+      }
+      TracePass P;
+      P.doInitialization(M);
+      FunctionAnalysisManager &FAM = MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
+      const CallSummary::CallSummaryInfo *CS =
+          UseCallSummaries ? &MAM.getResult<CallSummary::CallSummaryAnalysis>(M) : nullptr;
+      // functions split off cold traces are not revisited
+      std::vector<Function*> functions;
+      for (Function &F : M)
+        if (!F.isDeclaration() && !F.hasOptNone()) functions.push_back(&F);
+      for (Function *F : functions) {
+        BaseTrace::FunctionAnalyses FA;
+        FA.LI = &FAM.getResult<LoopAnalysis>(*F);
+        FA.DT = &FAM.getResult<DominatorTreeAnalysis>(*F);
+        FA.PDT = &FAM.getResult<PostDominatorTreeAnalysis>(*F);
+        FA.BPI = &FAM.getResult<BranchProbabilityAnalysis>(*F);
+        FA.BFI = &FAM.getResult<BlockFrequencyAnalysis>(*F);
+        if (P.needsTLI()) FA.TLI = &FAM.getResult<TargetLibraryAnalysis>(*F);
+        if (P.needsTTI()) FA.TTI = &FAM.getResult<TargetIRAnalysis>(*F);
+        if (P.needsAA()) FA.AA = &FAM.getResult<AAManager>(*F);
+        if (AliasHazards) FA.MSSA = &FAM.getResult<MemorySSAAnalysis>(*F).getMSSA();
+        FA.CS = CS;
+        CFGEdges before = TakeCFG(*F);
+        if (!P.runTraces(*F, FA)) continue;
+        changed = true;
+        // instructions or branch weights changed: probabilities, frequencies
+        // and memory SSA are stale
+        PreservedAnalyses PA;
+        if (SameCFG(before, TakeCFG(*F))) {
+          PA.preserve<DominatorTreeAnalysis>();
+          PA.preserve<PostDominatorTreeAnalysis>();
+          PA.preserve<LoopAnalysis>();
+        }
+        FAM.invalidate(*F, PA);
+      }
+      P.doFinalization(M);
+      if (!changed) return PreservedAnalyses::all();
+      PreservedAnalyses PA;
+      PA.preserve<FunctionAnalysisManagerModuleProxy>();
+      return PA;
+    }
+  };
+
+  struct PathProfileInstrAdaptor : public PassInfoMixin<PathProfileInstrAdaptor> {
+    PreservedAnalyses run(Module &M, ModuleAnalysisManager &MAM) {
+      PathProfile::PathProfileInstrPass P;
+      return P.runOnModule(M) ? PreservedAnalyses::none() : PreservedAnalyses::all();
+    }
+  };
+
+  bool AddPass(StringRef name, ModulePassManager &MPM) {
+    if (name == "base") MPM.addPass(TracePassAdaptor<BaseTrace::BaseTracePass>());
+    else if (name == "static") MPM.addPass(TracePassAdaptor<StaticTrace::StaticTracePass>());
+    else if (name == "profile") MPM.addPass(TracePassAdaptor<ProfileTrace::ProfileTracePass>());
+    else if (name == "hazardprofile") MPM.addPass(TracePassAdaptor<HazardProfileTrace::HazardProfileTracePass>());
+    else if (name == "fplicm-correctness") MPM.addPass(TracePassAdaptor<FPLICM::FPLICMCorrectnessPass>());
+    else if (name == "fplicm-performance") MPM.addPass(TracePassAdaptor<FPLICM::FPLICMPerformancePass>());
+    else if (name == "path-profile-instr") MPM.addPass(PathProfileInstrAdaptor());
+    else if (name == "require<call-summary>")
+      MPM.addPass(RequireAnalysisPass<CallSummary::CallSummaryAnalysis, Module>());
+    else return false;
+    return true;
+  }
+}
+
+extern "C" LLVM_ATTRIBUTE_WEAK ::llvm::PassPluginLibraryInfo llvmGetPassPluginInfo() {
+  return {LLVM_PLUGIN_API_VERSION, "HW2", LLVM_VERSION_STRING, [](PassBuilder &PB) {
+    PB.registerAnalysisRegistrationCallback([](ModuleAnalysisManager &MAM) {
+      MAM.registerPass([] { return CallSummary::CallSummaryAnalysis(); });
+    });
+    PB.registerPipelineParsingCallback(
+        [](StringRef name, ModulePassManager &MPM, ArrayRef<PassBuilder::PipelineElement>) {
+          return NewPM::AddPass(name, MPM);
+        });
+    PB.registerOptimizerLastEPCallback([](ModulePassManager &MPM, OptimizationLevel level) {
+      if (!TracePipelinePass.empty() && !NewPM::AddPass(TracePipelinePass, MPM))
+        errs() << "unknown trace pass " << TracePipelinePass << '\n';
+    });
+  }};
+}
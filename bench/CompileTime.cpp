@@ -0,0 +1,178 @@
+//===-- Compile-time benchmark for the trace formation passes -------------===//
+//
+// Builds synthetic functions of growing size, the shape of machine-generated
+// code: groups of blocks forming natural loops, chains of diamonds, and a
+// handful of values compared by every branch. Each size runs in a forked
+// child that loads the pass plugin and runs one pass on the function, so the
+// reported peak memory belongs to that size alone.
+//
+//   sb-compile-time -plugin build/HW2/LLVMHW2.so -pass static -sizes 1000,10000
+//
+//===----------------------------------------------------------------------===//
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Pass.h"
+#include "llvm/PassInfo.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace llvm;
+
+static cl::opt<std::string> PluginPath("plugin", cl::Required,
+                                       cl::desc("Path to LLVMHW2.so"));
+static cl::opt<std::string> PassName("pass", cl::init("static"),
+                                     cl::desc("Pass to time"));
+static cl::list<unsigned> Sizes("sizes", cl::CommaSeparated,
+                                cl::desc("Function sizes in blocks"));
+static cl::opt<unsigned> GroupSize("group", cl::init(8),
+                                   cl::desc("Blocks per synthetic loop"));
+static cl::list<std::string> PassArgs("pass-arg", cl::desc("Option passed on to the plugin"));
+
+// One function of roughly numBlocks blocks. Every branch compares one of four
+// arguments, so each argument has O(numBlocks) users.
+static Function *buildSynthetic(Module &M, unsigned numBlocks) {
+  LLVMContext &Ctx = M.getContext();
+  Type *I32 = Type::getInt32Ty(Ctx);
+  FunctionType *FT = FunctionType::get(I32, {I32, I32, I32, I32}, false);
+  Function *F = Function::Create(FT, Function::ExternalLinkage, "synthetic", M);
+  FunctionCallee ext = M.getOrInsertFunction(
+      "ext", FunctionType::get(Type::getVoidTy(Ctx), {I32}, false));
+
+  std::vector<Value *> args;
+  for (Argument &A : F->args()) args.push_back(&A);
+  BasicBlock *entry = BasicBlock::Create(Ctx, "entry", F);
+  std::vector<BasicBlock *> blocks;
+  for (unsigned i = 0; i < numBlocks; ++i)
+    blocks.push_back(BasicBlock::Create(Ctx, "b" + Twine(i), F));
+  BasicBlock *exit = BasicBlock::Create(Ctx, "exit", F);
+
+  IRBuilder<> B(entry);
+  AllocaInst *slot = B.CreateAlloca(I32);
+  B.CreateStore(args[0], slot);
+  B.CreateBr(blocks[0]);
+
+  for (unsigned i = 0; i < numBlocks; ++i) {
+    B.SetInsertPoint(blocks[i]);
+    Value *x = B.CreateLoad(I32, slot);
+    Value *y = B.CreateAdd(x, B.getInt32(i));
+    B.CreateStore(y, slot);
+    if (i % 7 == 3) B.CreateCall(ext, {y});
+    Value *cond = B.CreateICmpSLT(args[i % 4], y);
+
+    unsigned group = i / GroupSize, pos = i % GroupSize;
+    unsigned groupHead = group * GroupSize;
+    unsigned next = i + 1;
+    BasicBlock *nextBB = next < numBlocks ? blocks[next] : exit;
+    if (pos == GroupSize - 1 || next == numBlocks) {
+      // group latch: loop back to the group head or leave the group
+      B.CreateCondBr(cond, blocks[groupHead], nextBB);
+    } else if (pos + 2 < GroupSize && i + 2 < numBlocks) {
+      // skip one block: a triangle inside the loop body
+      B.CreateCondBr(cond, nextBB, blocks[i + 2]);
+    } else {
+      B.CreateBr(nextBB);
+    }
+  }
+  B.SetInsertPoint(exit);
+  B.CreateRet(B.CreateLoad(I32, slot));
+  return F;
+}
+
+struct Sample {
+  double passMs;
+  long rssBeforeKB;
+  unsigned numInstrs;
+};
+
+// Child side: build the function, run the pass, report through fd.
+static int runChild(unsigned numBlocks, int fd) {
+  LLVMContext Ctx;
+  Module M("bench", Ctx);
+  Function *F = buildSynthetic(M, numBlocks);
+  if (verifyFunction(*F, &errs())) return 1;
+
+  const PassInfo *PI = PassRegistry::getPassRegistry()->getPassInfo(PassName);
+  if (!PI) {
+    errs() << "pass '" << PassName << "' is not registered by the plugin\n";
+    return 1;
+  }
+  legacy::PassManager PM;
+  PM.add(PI->createPass());
+
+  // the passes report on stderr, which would dominate the timing
+  int devnull = open("/dev/null", O_WRONLY);
+  dup2(devnull, STDERR_FILENO);
+
+  struct rusage before;
+  getrusage(RUSAGE_SELF, &before);
+  auto start = std::chrono::steady_clock::now();
+  PM.run(M);
+  auto end = std::chrono::steady_clock::now();
+
+  Sample S;
+  S.passMs = std::chrono::duration<double, std::milli>(end - start).count();
+  S.rssBeforeKB = before.ru_maxrss;
+  S.numInstrs = F->getInstructionCount();
+  return write(fd, &S, sizeof(S)) == sizeof(S) ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "trace pass compile-time benchmark\n");
+  // the analyses the trace passes require
+  PassRegistry &Registry = *PassRegistry::getPassRegistry();
+  initializeCore(Registry);
+  initializeAnalysis(Registry);
+  std::string err;
+  if (sys::DynamicLibrary::LoadLibraryPermanently(PluginPath.c_str(), &err)) {
+    errs() << "cannot load " << PluginPath << ": " << err << "\n";
+    return 1;
+  }
+  // options registered by the plugin
+  if (!PassArgs.empty()) {
+    std::vector<const char *> pargv = {argv[0]};
+    for (std::string &A : PassArgs) pargv.push_back(A.c_str());
+    cl::ParseCommandLineOptions(pargv.size(), pargv.data());
+  }
+  std::vector<unsigned> sizes(Sizes.begin(), Sizes.end());
+  if (sizes.empty()) sizes = {1000, 2000, 5000, 10000, 20000};
+
+  outs() << "pass: " << PassName << "\n";
+  outs() << "    blocks     instrs      pass ms    peak RSS MB    pass RSS MB\n";
+  for (unsigned numBlocks : sizes) {
+    int fds[2];
+    if (pipe(fds)) return 1;
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(fds[0]);
+      _exit(runChild(numBlocks, fds[1]));
+    }
+    close(fds[1]);
+    Sample S;
+    bool ok = read(fds[0], &S, sizeof(S)) == sizeof(S);
+    close(fds[0]);
+    int status;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    if (!ok || !WIFEXITED(status) || WEXITSTATUS(status)) {
+      errs() << "run with " << numBlocks << " blocks failed\n";
+      return 1;
+    }
+    outs() << format("%10u %10u %12.1f %14.1f %14.1f\n", numBlocks, S.numInstrs,
+                     S.passMs, usage.ru_maxrss / 1024.0,
+                     (usage.ru_maxrss - S.rssBeforeKB) / 1024.0);
+  }
+  return 0;
+}
@@ -0,0 +1,231 @@
+//===-- Runtime benchmark harness for the trace formation passes ----------===//
+//
+// Runs the baseline of a kernel and its variants, as built by the
+// runtime-bench targets. Every variant must print what the baseline prints.
+// Then all of them are timed in interleaved rounds, so drift hits them
+// alike, pinned to one CPU. Reported per variant: the median wall time with
+// a 95% confidence interval from order statistics, the speedup of the
+// median over the baseline, and the predicted fall through of its traces,
+// the entry weighted mean over the -trace-stats-json summary it was built
+// with.
+//
+//   sb-runtime-bench -name lexer -cpu 2 -runs 21 -baseline lexer.base
+//       -variant static/profile=lexer.static.profile,lexer.static.profile.json
+//       -arg 4000000
+//
+//===----------------------------------------------------------------------===//
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace llvm;
+
+static cl::opt<std::string> KernelName("name", cl::init("kernel"),
+                                       cl::desc("Kernel name for the report"));
+static cl::opt<std::string> Baseline("baseline", cl::Required,
+                                     cl::desc("Binary built without the trace passes"));
+static cl::list<std::string> Variants("variant",
+                                      cl::desc("label=binary[,stats.json] of a variant"));
+static cl::list<std::string> RunArgs("arg", cl::desc("Argument passed to every binary"));
+static cl::opt<unsigned> Runs("runs", cl::init(21), cl::desc("Timed runs per binary"));
+static cl::opt<int> CPU("cpu", cl::init(-1), cl::desc("CPU to pin the runs to (-1: none)"));
+static cl::opt<std::string> OutputFile("o", cl::init(""),
+                                       cl::desc("File for the results as JSON"));
+
+struct Variant {
+  std::string label, binary, stats;
+  std::vector<double> ms;
+  Optional<double> fallThru;
+  bool outputMatches = true;
+};
+
+// Run binary with RunArgs and stdout to outFile; returns the wall time in
+// ms, or a negative value if it did not exit with 0.
+static double run(const std::string &binary, const char *outFile) {
+  std::vector<const char *> argv = {binary.c_str()};
+  for (std::string &A : RunArgs) argv.push_back(A.c_str());
+  argv.push_back(nullptr);
+  auto start = std::chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (pid == 0) {
+    int fd = open(outFile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || dup2(fd, 1) < 0) _exit(127);
+    execv(binary.c_str(), const_cast<char *const *>(argv.data()));
+    _exit(127);
+  }
+  int status;
+  if (pid < 0 || waitpid(pid, &status, 0) != pid) return -1;
+  auto end = std::chrono::steady_clock::now();
+  if (!WIFEXITED(status) || WEXITSTATUS(status)) return -1;
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+// Entry weighted mean of the predicted completion of every trace in a
+// -trace-stats-json summary.
+static Optional<double> readFallThru(StringRef file) {
+  ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFile(file);
+  if (!buf) return None;
+  Expected<json::Value> V = json::parse((*buf)->getBuffer());
+  if (!V) {
+    consumeError(V.takeError());
+    return None;
+  }
+  double weighted = 0, entries = 0;
+  const json::Object *root = V->getAsObject();
+  const json::Array *functions = root ? root->getArray("functions") : nullptr;
+  if (!functions) return None;
+  for (const json::Value &F : *functions) {
+    const json::Array *traces = F.getAsObject() ? F.getAsObject()->getArray("traceList") : nullptr;
+    if (!traces) continue;
+    for (const json::Value &T : *traces) {
+      const json::Object *O = T.getAsObject();
+      if (!O) continue;
+      double count = O->getNumber("entryCount").getValueOr(0);
+      weighted += count * O->getNumber("predictedCompletion").getValueOr(0);
+      entries += count;
+    }
+  }
+  if (!entries) return None;
+  return weighted / entries;
+}
+
+static double median(std::vector<double> ms) {
+  std::sort(ms.begin(), ms.end());
+  size_t n = ms.size();
+  return n % 2 ? ms[n / 2] : (ms[n / 2 - 1] + ms[n / 2]) / 2;
+}
+
+// 95% confidence interval of the median: the order statistics whose ranks
+// bound n/2 +- 1.96 sqrt(n)/2, by the normal approximation of the binomial.
+static std::pair<double, double> medianInterval(std::vector<double> ms) {
+  std::sort(ms.begin(), ms.end());
+  double n = ms.size(), half = 1.96 * std::sqrt(n) / 2;
+  long lo = std::max(0L, long(std::floor(n / 2 - half)) - 1);
+  long hi = std::min(long(n) - 1, long(std::ceil(n / 2 + half)));
+  return {ms[lo], ms[hi]};
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "trace pass runtime benchmark\n");
+  if (!Runs) {
+    errs() << "-runs must be at least 1\n";
+    return 1;
+  }
+  std::vector<Variant> variants;
+  variants.push_back(Variant{"baseline", Baseline, "", {}, None, true});
+  for (StringRef V : Variants) {
+    std::pair<StringRef, StringRef> labelBinary = V.split('=');
+    std::pair<StringRef, StringRef> binaryStats = labelBinary.second.split(',');
+    if (labelBinary.second.empty() || binaryStats.first.empty()) {
+      errs() << "bad -variant " << V << ", expected label=binary[,stats.json]\n";
+      return 1;
+    }
+    variants.push_back(Variant{labelBinary.first.str(), binaryStats.first.str(), binaryStats.second.str(), {},
+                               None, true});
+    if (!variants.back().stats.empty()) variants.back().fallThru = readFallThru(variants.back().stats);
+  }
+
+#ifdef __linux__
+  // the children inherit the mask
+  if (CPU >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(CPU, &set);
+    if (sched_setaffinity(0, sizeof(set), &set)) {
+      errs() << "cannot pin to cpu " << CPU << "\n";
+      return 1;
+    }
+  }
+#endif
+
+  // outputs first: a wrong binary is not worth timing
+  SmallString<128> expectedFile, outFile;
+  if (sys::fs::createTemporaryFile("bench-" + KernelName, "out", expectedFile) ||
+      sys::fs::createTemporaryFile("bench-" + KernelName, "out", outFile)) {
+    errs() << "cannot create temporary files\n";
+    return 1;
+  }
+  FileRemover removeExpected(expectedFile), removeOut(outFile);
+  if (run(Baseline, expectedFile.c_str()) < 0) {
+    errs() << Baseline << " failed\n";
+    return 1;
+  }
+  ErrorOr<std::unique_ptr<MemoryBuffer>> expected = MemoryBuffer::getFile(expectedFile);
+  bool allMatch = true;
+  for (Variant &V : variants) {
+    if (&V == &variants.front()) continue;
+    ErrorOr<std::unique_ptr<MemoryBuffer>> output = nullptr;
+    if (run(V.binary, outFile.c_str()) >= 0) output = MemoryBuffer::getFile(outFile);
+    V.outputMatches = expected && output && *output &&
+                      (*output)->getBuffer() == (*expected)->getBuffer();
+    allMatch &= V.outputMatches;
+  }
+
+  for (unsigned round = 0; round < Runs; ++round)
+    for (Variant &V : variants) {
+      if (!V.outputMatches) continue;
+      double ms = run(V.binary, "/dev/null");
+      if (ms < 0) {
+        errs() << V.binary << " failed in round " << round << "\n";
+        return 1;
+      }
+      V.ms.push_back(ms);
+    }
+
+  double baseMedian = median(variants.front().ms);
+  outs() << "kernel: " << KernelName << ", runs: " << Runs;
+  if (CPU >= 0) outs() << ", cpu: " << CPU;
+  outs() << "\n";
+  outs() << "variant                      median ms           95% CI ms    speedup   fall thru  output\n";
+  json::Array results;
+  for (Variant &V : variants) {
+    if (!V.outputMatches) {
+      const char *none = "-";
+      outs() << format("%-24s %14s %19s %10s %11s  DIFFERS\n", V.label.c_str(), none, none, none, none);
+      results.push_back(json::Object{{"label", V.label}, {"outputMatches", false}});
+      continue;
+    }
+    double med = median(V.ms);
+    std::pair<double, double> ci = medianInterval(V.ms);
+    std::string fallThru = V.fallThru ? formatv("{0:f3}", *V.fallThru).str() : "-";
+    outs() << format("%-24s %14.2f %9.2f - %7.2f %10.3f %11s  ok\n", V.label.c_str(), med, ci.first,
+                     ci.second, baseMedian / med, fallThru.c_str());
+    json::Object R{{"label", V.label},
+                   {"outputMatches", true},
+                   {"medianMs", med},
+                   {"ciLowMs", ci.first},
+                   {"ciHighMs", ci.second},
+                   {"speedup", baseMedian / med}};
+    if (V.fallThru) R["fallThru"] = *V.fallThru;
+    results.push_back(std::move(R));
+  }
+
+  if (!OutputFile.empty()) {
+    std::error_code EC;
+    raw_fd_ostream OS(OutputFile, EC, sys::fs::OF_Text);
+    if (EC) {
+      errs() << "cannot write " << OutputFile << ": " << EC.message() << "\n";
+      return 1;
+    }
+    OS << formatv("{0:2}", json::Value(json::Object{{"kernel", KernelName},
+                                                     {"runs", int64_t(Runs)},
+                                                     {"cpu", int64_t(CPU)},
+                                                     {"variants", std::move(results)}}))
+       << "\n";
+  }
+  return allMatch ? 0 : 1;
+}
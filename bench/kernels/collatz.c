@@ -0,0 +1,24 @@
+// Collatz trajectory lengths: a loop around one unpredictable branch, and a
+// rarely taken one for new maxima.
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char **argv) {
+  long n = argc > 1 ? atol(argv[1]) : 1000000;
+  unsigned long total = 0, best = 0, bestStart = 0;
+  for (unsigned long start = 1; start <= (unsigned long)n; ++start) {
+    unsigned long x = start, steps = 0;
+    while (x != 1) {
+      if (x & 1) x = 3 * x + 1;
+      else x >>= 1;
+      steps++;
+    }
+    total += steps;
+    if (steps > best) {
+      best = steps;
+      bestStart = start;
+    }
+  }
+  printf("%lu %lu %lu\n", total, best, bestStart);
+  return 0;
+}
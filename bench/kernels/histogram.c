@@ -0,0 +1,39 @@
+// Classify skewed samples through an if-else chain and a switch: most land
+// in the first two classes, a few fall through to the end.
+#include <stdio.h>
+#include <stdlib.h>
+
+static unsigned long state = 88172645463325252UL;
+static unsigned long next(void) {
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state;
+}
+
+int main(int argc, char **argv) {
+  long n = argc > 1 ? atol(argv[1]) : 1000000;
+  long classes[8] = {0};
+  long sum = 0;
+  for (long i = 0; i < n; ++i) {
+    unsigned v = next() % 1000;
+    int c;
+    if (v < 600) c = 0;
+    else if (v < 850) c = 1;
+    else if (v < 930) c = 2;
+    else if (v < 970) c = 3;
+    else if (v < 990) c = 4;
+    else c = 5 + v % 3;
+    classes[c]++;
+    switch (c) {
+    case 0: sum += v; break;
+    case 1: sum -= v / 2; break;
+    case 2: sum ^= v; break;
+    case 3: sum += v * 3; break;
+    default: sum = sum / 2 + v; break;
+    }
+  }
+  for (int c = 0; c < 8; ++c) printf("%ld ", classes[c]);
+  printf("%ld\n", sum);
+  return 0;
+}
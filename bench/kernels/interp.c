@@ -0,0 +1,46 @@
+// Bytecode interpreter: a dispatch switch dominated by a few opcodes, and
+// loops whose trip counts come from the program.
+#include <stdio.h>
+#include <stdlib.h>
+
+enum { PUSH, ADD, SUB, MUL, DUP, SWAP, JNZ, DEC, POP, HALT };
+
+int main(int argc, char **argv) {
+  long reps = argc > 1 ? atol(argv[1]) : 100000;
+  // acc = acc * 3 + 1 while k counts down by two from 40, or 41 on odd
+  // repetitions; PUSH adds r & 1 to its operand
+  static const int code[] = {
+    PUSH, 0,             // acc
+    PUSH, 40,            // acc k
+    SWAP, PUSH, 3, MUL,  // k acc*3
+    SWAP, DUP,           // acc*3 k k
+    SWAP, POP,           // acc*3 k
+    DUP, PUSH, 1, SUB,   // acc*3 k k-1
+    SWAP, POP,           // acc*3 k-1
+    SWAP, PUSH, 1, ADD,  // k-1 acc*3+1
+    SWAP, DEC, DUP,      // acc' k-2 k-2
+    JNZ, 4,              // acc' k-2
+    POP, HALT};
+  long stack[64];
+  unsigned long total = 0;
+  for (long r = 0; r < reps; ++r) {
+    int sp = 0, pc = 0, running = 1;
+    while (running) {
+      switch (code[pc++]) {
+      case PUSH: stack[sp++] = code[pc++] + (r & 1); break;
+      case ADD: sp--; stack[sp - 1] += stack[sp]; break;
+      case SUB: sp--; stack[sp - 1] -= stack[sp]; break;
+      case MUL: sp--; stack[sp - 1] *= stack[sp]; break;
+      case DUP: stack[sp] = stack[sp - 1]; sp++; break;
+      case SWAP: { long t = stack[sp - 1]; stack[sp - 1] = stack[sp - 2]; stack[sp - 2] = t; break; }
+      case JNZ: sp--; if (stack[sp] > 0) pc = code[pc]; else pc++; break;
+      case DEC: stack[sp - 1]--; break;
+      case POP: sp--; break;
+      default: running = 0; break;
+      }
+    }
+    total = total * 31 + (unsigned long)stack[0];
+  }
+  printf("%lu\n", total);
+  return 0;
+}
@@ -0,0 +1,71 @@
+// Tokenizer over generated source text: a state machine whose transitions
+// are dominated by identifier and whitespace characters.
+#include <stdio.h>
+#include <stdlib.h>
+
+static unsigned state = 12345;
+static unsigned next(void) {
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+static char pick(void) {
+  unsigned r = next() % 100;
+  if (r < 55) return 'a' + next() % 26;
+  if (r < 75) return ' ';
+  if (r < 85) return '0' + next() % 10;
+  if (r < 90) return '\n';
+  if (r < 95) return "+-*/=<>"[next() % 7];
+  if (r < 98) return "()[]{};,"[next() % 8];
+  return '"';
+}
+
+int main(int argc, char **argv) {
+  long n = argc > 1 ? atol(argv[1]) : 1000000;
+  char *text = malloc(n + 1);
+  for (long i = 0; i < n; ++i) text[i] = pick();
+  text[n] = 0;
+  long idents = 0, numbers = 0, ops = 0, puncts = 0, strings = 0, lines = 0;
+  unsigned long hash = 0;
+  for (long i = 0; i < n;) {
+    char c = text[i];
+    if (c == ' ') {
+      i++;
+    } else if (c == '\n') {
+      lines++;
+      i++;
+    } else if (c >= 'a' && c <= 'z') {
+      unsigned long h = 0;
+      while (i < n && ((text[i] >= 'a' && text[i] <= 'z') || (text[i] >= '0' && text[i] <= '9')))
+        h = h * 31 + text[i++];
+      hash ^= h;
+      idents++;
+    } else if (c >= '0' && c <= '9') {
+      long v = 0;
+      while (i < n && text[i] >= '0' && text[i] <= '9') v = v * 10 + (text[i++] - '0');
+      hash += v;
+      numbers++;
+    } else if (c == '"') {
+      i++;
+      while (i < n && text[i] != '"' && text[i] != '\n') i++;
+      if (i < n) i++;
+      strings++;
+    } else {
+      switch (c) {
+      case '+': case '-': case '*': case '/': case '=': case '<': case '>':
+        if (i + 1 < n && text[i + 1] == '=') i++;
+        ops++;
+        break;
+      default:
+        puncts++;
+        break;
+      }
+      i++;
+    }
+  }
+  printf("%ld %ld %ld %ld %ld %ld %lu\n", idents, numbers, ops, puncts, strings, lines, hash);
+  free(text);
+  return 0;
+}
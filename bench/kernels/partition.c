@@ -0,0 +1,64 @@
+// Quicksort with a branchy partition and an insertion sort for short runs.
+#include <stdio.h>
+#include <stdlib.h>
+
+static unsigned state = 2463534242u;
+static unsigned next(void) {
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+static void sort(int *a, long lo, long hi) {
+  while (hi - lo > 16) {
+    int pivot = a[lo + (hi - lo) / 2];
+    long i = lo, j = hi - 1;
+    while (i <= j) {
+      while (a[i] < pivot) i++;
+      while (a[j] > pivot) j--;
+      if (i <= j) {
+        int t = a[i];
+        a[i] = a[j];
+        a[j] = t;
+        i++;
+        j--;
+      }
+    }
+    // recurse into the smaller side
+    if (j - lo < hi - i) {
+      sort(a, lo, j + 1);
+      lo = i;
+    } else {
+      sort(a, i, hi);
+      hi = j + 1;
+    }
+  }
+  for (long k = lo + 1; k < hi; ++k) {
+    int v = a[k];
+    long m = k - 1;
+    while (m >= lo && a[m] > v) {
+      a[m + 1] = a[m];
+      m--;
+    }
+    a[m + 1] = v;
+  }
+}
+
+int main(int argc, char **argv) {
+  long n = argc > 1 ? atol(argv[1]) : 1000000;
+  int *a = malloc(n * sizeof(int));
+  for (long i = 0; i < n; ++i) a[i] = next() % 1000000;
+  sort(a, 0, n);
+  unsigned long check = 0;
+  for (long i = 0; i < n; ++i) {
+    if (i && a[i] < a[i - 1]) {
+      printf("not sorted\n");
+      return 1;
+    }
+    check = check * 1000003 + a[i];
+  }
+  printf("%lu\n", check);
+  free(a);
+  return 0;
+}
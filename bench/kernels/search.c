@@ -0,0 +1,46 @@
+// Binary searches over a sorted table, most keys present, with an early
+// exit on a hit and a linear scan for the short tail.
+#include <stdio.h>
+#include <stdlib.h>
+
+static unsigned state = 1013904223u;
+static unsigned next(void) {
+  state = state * 1664525u + 1013904223u;
+  return state >> 8;
+}
+
+static long find(const int *table, long n, int key) {
+  long lo = 0, hi = n;
+  while (hi - lo > 8) {
+    long mid = lo + (hi - lo) / 2;
+    if (table[mid] == key) return mid;
+    if (table[mid] < key) lo = mid + 1;
+    else hi = mid;
+  }
+  for (; lo < hi; ++lo)
+    if (table[lo] == key) return lo;
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  long lookups = argc > 1 ? atol(argv[1]) : 1000000;
+  long n = 1 << 16;
+  int *table = malloc(n * sizeof(int));
+  for (long i = 0; i < n; ++i) table[i] = 3 * i;
+  long hits = 0;
+  unsigned long sum = 0;
+  for (long i = 0; i < lookups; ++i) {
+    // three in four keys are in the table
+    unsigned slot = next() % n;
+    int miss = next() % 4 == 0;
+    int key = slot * 3 + miss;
+    long at = find(table, n, key);
+    if (at >= 0) {
+      hits++;
+      sum += at;
+    }
+  }
+  printf("%ld %lu\n", hits, sum);
+  free(table);
+  return 0;
+}
@@ -0,0 +1,533 @@
+//===-- Parallel trace formation over whole modules -----------------------===//
+//
+// Runs a trace pass of the plugin on every function of one or more IR files,
+// the functions spread over a thread pool. IR is not thread safe, so every
+// worker reads the files into an LLVMContext of its own, lazily: a function
+// body is only materialized by the worker that runs the pass on it, and
+// dropped after. The report of every function is captured on its own and
+// printed in module order, so the output does not depend on the thread count.
+//
+// Trace formation and evaluation are independent per function; the
+// transforms are not, as they share the module growth budget in the order
+// functions are run, and call summaries and sample profile loading need the
+// whole module, so -form-superblocks, -enlarge-superblocks, -call-summaries
+// and -trace-sample-profile are refused.
+//
+// -tune searches the trace threshold and the hit rates of the static
+// heuristics for the configuration that scores best over the input files,
+// profiled bitcode best, and writes it for -trace-config. A threshold sweep
+// comes first, then rounds of coordinate search with halving steps. The
+// score is the average fall through of the traces, plus a bonus for the
+// average length of the trace entered and a penalty for hazards per trace;
+// with -tune-runtime, a command timing the configuration adds its speedup
+// over the starting one.
+//
+//   sb-trace-driver -plugin build/HW2/LLVMHW2.so -pass static -j 8 a.bc b.bc
+//   sb-trace-driver -plugin build/HW2/LLVMHW2.so -scaling -j 16 a.bc
+//   sb-trace-driver -plugin build/HW2/LLVMHW2.so -tune -tune-output best.json a.bc b.bc
+//
+//===----------------------------------------------------------------------===//
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Pass.h"
+#include "llvm/PassInfo.h"
+#include "llvm/PassRegistry.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/FormatVariadic.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <mutex>
+
+using namespace llvm;
+
+static cl::opt<std::string> PluginPath("plugin", cl::Required,
+                                       cl::desc("Path to LLVMHW2.so"));
+static cl::opt<std::string> PassName("pass", cl::init("static"),
+                                     cl::desc("Trace pass to run"));
+static cl::list<std::string> InputFiles(cl::Positional, cl::desc("<IR files>"));
+static cl::opt<unsigned> Threads("j", cl::init(0),
+                                 cl::desc("Worker threads (0: one per hardware thread)"));
+static cl::opt<bool> Scaling("scaling", cl::init(false),
+                             cl::desc("Time 1, 2, 4, ... up to -j threads and compare "
+                                      "every run with the serial one"));
+static cl::opt<std::string> OutputFile("o", cl::init("-"),
+                                       cl::desc("File for the reports"));
+static cl::list<std::string> PassArgs("pass-arg", cl::desc("Option passed on to the plugin"));
+static cl::opt<bool> Tune("tune", cl::init(false),
+                          cl::desc("Search the trace threshold and heuristic hit rates "
+                                   "for the best score over the inputs"));
+static cl::opt<std::string> TuneOutput("tune-output", cl::init("trace-config.json"),
+                                       cl::desc("File for the best configuration"));
+static cl::opt<unsigned> TuneRounds("tune-rounds", cl::init(3),
+                                    cl::desc("Rounds of coordinate search"));
+static cl::opt<double> TuneLengthWeight("tune-length-weight", cl::init(0.01),
+                                        cl::desc("Score per block of the average trace entered"));
+static cl::opt<double> TuneHazardWeight("tune-hazard-weight", cl::init(0.05),
+                                        cl::desc("Score lost per hazard block per trace"));
+static cl::opt<std::string> TuneRuntime("tune-runtime", cl::init(""),
+                                        cl::desc("Command timing a configuration: run with the "
+                                                 "config file appended, prints seconds"));
+static cl::opt<double> TuneRuntimeWeight("tune-runtime-weight", cl::init(1.0),
+                                         cl::desc("Score per unit of speedup over the start"));
+
+// exported by the plugin: where the passes of the calling thread report
+typedef void (*SetReportStreamFn)(raw_ostream *);
+static SetReportStreamFn SetReportStream;
+// for -tune: the configuration, an override of it, and the evaluation totals
+typedef void (*GetTraceConfigFn)(raw_ostream *);
+typedef void (*SetTraceConfigFn)(const char *);
+typedef void (*TakeTraceTotalsFn)(raw_ostream *);
+static GetTraceConfigFn GetTraceConfig;
+static SetTraceConfigFn SetTraceConfig;
+static TakeTraceTotalsFn TakeTraceTotals;
+
+// A function to run the pass on: its file, and its place among the
+// function definitions of that file.
+struct WorkItem {
+  unsigned file;
+  unsigned index;
+};
+
+// The value of a plugin option of type T, or T() when it is not registered.
+template <typename T> static T optionValue(StringRef name) {
+  auto &options = cl::getRegisteredOptions();
+  auto O = options.find(name);
+  if (O == options.end()) return T();
+  return static_cast<cl::opt<T> *>(O->second)->getValue();
+}
+
+static Expected<std::unique_ptr<Module>> loadLazily(MemoryBufferRef buf, LLVMContext &Ctx) {
+  if (isBitcode(reinterpret_cast<const unsigned char *>(buf.getBufferStart()),
+                reinterpret_cast<const unsigned char *>(buf.getBufferEnd())))
+    return getLazyBitcodeModule(buf, Ctx);
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M = parseIR(buf, Err, Ctx);
+  if (!M) {
+    std::string msg;
+    raw_string_ostream OS(msg);
+    Err.print(buf.getBufferIdentifier().data(), OS);
+    return createStringError(inconvertibleErrorCode(), OS.str());
+  }
+  return M;
+}
+
+static std::vector<Function *> definitions(Module &M) {
+  std::vector<Function *> defs;
+  for (Function &F : M)
+    if (!F.isDeclaration()) defs.push_back(&F);
+  return defs;
+}
+
+// What the runs report: per item, per file what the pass says when it starts
+// on the module (every worker says the same, one copy is kept), and what it
+// says when done with one, per worker and file.
+struct Reports {
+  std::vector<std::string> names, functions, files;
+  std::string finals;
+  std::mutex filesLock;
+};
+
+// One worker: takes the next item until none is left. Items are in file
+// order, so a worker reads every file at most once.
+static Error runWorker(ArrayRef<std::unique_ptr<MemoryBuffer>> buffers, ArrayRef<WorkItem> items,
+                       std::atomic<size_t> &next, Reports &R) {
+  const PassInfo *PI = PassRegistry::getPassRegistry()->getPassInfo(PassName);
+  LLVMContext Ctx;
+  std::unique_ptr<Module> M;
+  std::unique_ptr<legacy::FunctionPassManager> FPM;
+  std::vector<Function *> defs;
+  unsigned file = ~0u;
+  auto finalize = [&]() {
+    if (!FPM) return;
+    std::string final;
+    raw_string_ostream OS(final);
+    SetReportStream(&OS);
+    FPM->doFinalization();
+    SetReportStream(nullptr);
+    OS.flush();
+    std::lock_guard<std::mutex> lock(R.filesLock);
+    R.finals += final;
+  };
+  for (size_t i = next++; i < items.size(); i = next++) {
+    const WorkItem &W = items[i];
+    if (W.file != file) {
+      finalize();
+      FPM.reset();
+      Expected<std::unique_ptr<Module>> loaded = loadLazily(*buffers[W.file], Ctx);
+      if (!loaded) return loaded.takeError();
+      M = std::move(*loaded);
+      defs = definitions(*M);
+      FPM = std::make_unique<legacy::FunctionPassManager>(M.get());
+      FPM->add(PI->createPass());
+      std::string init;
+      raw_string_ostream OS(init);
+      SetReportStream(&OS);
+      FPM->doInitialization();
+      SetReportStream(nullptr);
+      OS.flush();
+      std::lock_guard<std::mutex> lock(R.filesLock);
+      if (R.files[W.file].empty()) R.files[W.file] = init;
+      file = W.file;
+    }
+    Function *F = defs[W.index];
+    R.names[i] = F->getName().str();
+    raw_string_ostream OS(R.functions[i]);
+    SetReportStream(&OS);
+    FPM->run(*F);
+    SetReportStream(nullptr);
+    OS.flush();
+    F->deleteBody();
+  }
+  finalize();
+  return Error::success();
+}
+
+// Run the pass on every item with numThreads workers; returns the seconds
+// taken.
+static Expected<double> runAll(ArrayRef<std::unique_ptr<MemoryBuffer>> buffers,
+                               ArrayRef<WorkItem> items, unsigned numThreads, Reports &R) {
+  R.names.assign(items.size(), "");
+  R.functions.assign(items.size(), "");
+  R.files.assign(buffers.size(), "");
+  R.finals.clear();
+  std::atomic<size_t> next(0);
+  std::vector<Error> errors;
+  for (unsigned t = 0; t < numThreads; ++t) errors.push_back(Error::success());
+  auto start = std::chrono::steady_clock::now();
+  {
+    ThreadPool Pool(hardware_concurrency(numThreads));
+    for (unsigned t = 0; t < numThreads; ++t)
+      Pool.async([&, t] { errors[t] = runWorker(buffers, items, next, R); });
+    Pool.wait();
+  }
+  auto end = std::chrono::steady_clock::now();
+  Error err = Error::success();
+  for (Error &E : errors) err = joinErrors(std::move(err), std::move(E));
+  if (err) return err;
+  return std::chrono::duration<double>(end - start).count();
+}
+
+// A configuration for -tune: the threshold and the hit rates, by name.
+struct TuneConfig {
+  double threshold = 0.6;
+  std::map<std::string, double> hitRates;
+
+  std::string str() const {
+    json::Object rates;
+    for (auto &rate : hitRates) rates[rate.first] = rate.second;
+    std::string text;
+    raw_string_ostream OS(text);
+    OS << json::Value(json::Object{{"threshold", threshold}, {"hitRates", std::move(rates)}});
+    return OS.str();
+  }
+};
+
+struct TuneScore {
+  double fallThru = 0, blocks = 0, hazards = 0, seconds = 0, score = 0;
+};
+
+// Run the pass over the inputs with C and score the traces.
+static Expected<TuneScore> evaluate(ArrayRef<std::unique_ptr<MemoryBuffer>> buffers,
+                                    ArrayRef<WorkItem> items, unsigned numThreads,
+                                    const TuneConfig &C, double startSeconds) {
+  std::string text = C.str(), totals;
+  SetTraceConfig(text.c_str());
+  raw_string_ostream discard(totals);
+  TakeTraceTotals(&discard);
+  Reports R;
+  Expected<double> seconds = runAll(buffers, items, numThreads, R);
+  if (!seconds) return seconds.takeError();
+  totals.clear();
+  raw_string_ostream OS(totals);
+  TakeTraceTotals(&OS);
+  Expected<json::Value> V = json::parse(OS.str());
+  if (!V) return V.takeError();
+  const json::Object *T = V->getAsObject();
+  double entries = T->getNumber("entries").getValueOr(0);
+  double traces = T->getNumber("traces").getValueOr(0);
+  TuneScore S;
+  if (entries) {
+    S.fallThru = T->getNumber("completed").getValueOr(0) / entries;
+    S.blocks = T->getNumber("blocks").getValueOr(0) / entries;
+  }
+  if (traces) S.hazards = T->getNumber("hazards").getValueOr(0) / traces;
+  S.score = S.fallThru + TuneLengthWeight * S.blocks - TuneHazardWeight * S.hazards;
+  if (TuneRuntime.empty()) return S;
+
+  // the command gets the configuration as a file and prints its seconds
+  SmallString<128> configFile, outFile;
+  if (std::error_code EC = sys::fs::createTemporaryFile("trace-config", "json", configFile))
+    return errorCodeToError(EC);
+  FileRemover removeConfig(configFile);
+  if (std::error_code EC = sys::fs::createTemporaryFile("trace-runtime", "out", outFile))
+    return errorCodeToError(EC);
+  FileRemover removeOut(outFile);
+  {
+    std::error_code EC;
+    raw_fd_ostream config(configFile, EC, sys::fs::OF_Text);
+    if (EC) return errorCodeToError(EC);
+    config << text << "\n";
+  }
+  std::string command = TuneRuntime + " " + configFile.str().str();
+  StringRef args[] = {"/bin/sh", "-c", command};
+  Optional<StringRef> redirects[] = {None, StringRef(outFile), None};
+  if (sys::ExecuteAndWait("/bin/sh", args, None, redirects))
+    return createStringError(inconvertibleErrorCode(), "'" + command + "' failed");
+  ErrorOr<std::unique_ptr<MemoryBuffer>> out = MemoryBuffer::getFile(outFile);
+  // the last word it prints
+  StringRef printed = out ? (*out)->getBuffer().rtrim() : "";
+  printed = printed.substr(printed.find_last_of(" \t\r\n") + 1);
+  if (printed.getAsDouble(S.seconds) || S.seconds <= 0)
+    return createStringError(inconvertibleErrorCode(), "'" + command + "' printed no seconds");
+  if (startSeconds > 0) S.score += TuneRuntimeWeight * (startSeconds / S.seconds - 1);
+  return S;
+}
+
+// -tune: a threshold sweep, then coordinate search over every parameter with
+// the step halving each round. A change is kept if it raises the score.
+static int tune(ArrayRef<std::unique_ptr<MemoryBuffer>> buffers, ArrayRef<WorkItem> items,
+                unsigned numThreads) {
+  std::string startText;
+  raw_string_ostream startOS(startText);
+  GetTraceConfig(&startOS);
+  Expected<json::Value> startV = json::parse(startOS.str());
+  if (!startV) {
+    logAllUnhandledErrors(startV.takeError(), errs(), "bad configuration from the plugin: ");
+    return 1;
+  }
+  TuneConfig best;
+  const json::Object *start = startV->getAsObject();
+  best.threshold = start->getNumber("threshold").getValueOr(best.threshold);
+  if (const json::Object *rates = start->getObject("hitRates"))
+    for (auto &rate : *rates) best.hitRates[rate.first.str()] = rate.second.getAsNumber().getValueOr(0.5);
+
+  std::map<std::string, TuneScore> seen;
+  TuneScore bestScore;
+  double startSeconds = 0;
+  unsigned evaluations = 0;
+  outs() << "pass: " << PassName << ", functions: " << items.size() << "\n";
+  outs() << "  eval  change                        fall thru  blocks  hazards"
+         << (TuneRuntime.empty() ? "" : "  seconds") << "     score\n";
+  // evaluate C, print it and keep it if it is better; false on errors
+  auto attempt = [&](const TuneConfig &C, const std::string &change) {
+    std::string key = C.str();
+    if (seen.count(key)) return true;
+    Expected<TuneScore> S = evaluate(buffers, items, numThreads, C, startSeconds);
+    if (!S) {
+      logAllUnhandledErrors(S.takeError(), errs(), "");
+      return false;
+    }
+    seen[key] = *S;
+    bool better = !evaluations || S->score > bestScore.score + 1e-9;
+    outs() << format("%6u  %-28s %10.3f %7.2f %8.3f", ++evaluations, change.c_str(), S->fallThru,
+                     S->blocks, S->hazards);
+    if (!TuneRuntime.empty()) outs() << format(" %8.3f", S->seconds);
+    outs() << format(" %9.4f%s\n", S->score, better ? "  *" : "");
+    if (better) {
+      best = C;
+      bestScore = *S;
+    }
+    return true;
+  };
+
+  if (!attempt(best, "start")) return 1;
+  startSeconds = bestScore.seconds;
+  TuneConfig startConfig = best;
+  TuneScore startScore = bestScore;
+  for (unsigned t = 50; t <= 95; t += 5) {
+    TuneConfig C = startConfig;
+    C.threshold = t / 100.0;
+    if (!attempt(C, formatv("threshold={0:f2}", C.threshold))) return 1;
+  }
+  double step = 0.08;
+  for (unsigned round = 0; round < TuneRounds; ++round, step /= 2) {
+    std::vector<std::string> names(1, "threshold");
+    for (auto &rate : best.hitRates) names.push_back(rate.first);
+    for (const std::string &name : names) {
+      for (double delta : {step, -step}) {
+        // keep going while it helps
+        for (;;) {
+          TuneConfig C = best;
+          double &value = name == "threshold" ? C.threshold : C.hitRates[name];
+          double lo = name == "threshold" ? 0.5 : 0.01, hi = name == "threshold" ? 1.0 : 0.99;
+          value = std::min(hi, std::max(lo, std::round((value + delta) * 1000) / 1000));
+          double before = bestScore.score;
+          if (!attempt(C, formatv("{0}={1:f3}", name, value))) return 1;
+          if (bestScore.score <= before) break;
+        }
+      }
+    }
+  }
+  SetTraceConfig("");
+
+  std::error_code EC;
+  ToolOutputFile out(TuneOutput, EC, sys::fs::OF_Text);
+  if (EC) {
+    errs() << "cannot write " << TuneOutput << ": " << EC.message() << "\n";
+    return 1;
+  }
+  Expected<json::Value> bestV = json::parse(best.str());
+  out.os() << formatv("{0:2}", *bestV) << "\n";
+  out.keep();
+  outs() << format("%u evaluations, score %.4f (start %.4f), fall thru %.3f (start %.3f); ",
+                   evaluations, bestScore.score, startScore.score, bestScore.fallThru,
+                   startScore.fallThru)
+         << "written to " << TuneOutput << "\n";
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "parallel trace formation driver\n");
+  if (InputFiles.empty()) {
+    errs() << "no input files\n";
+    return 1;
+  }
+  // the analyses the trace passes require
+  PassRegistry &Registry = *PassRegistry::getPassRegistry();
+  initializeCore(Registry);
+  initializeAnalysis(Registry);
+  std::string err;
+  if (sys::DynamicLibrary::LoadLibraryPermanently(PluginPath.c_str(), &err)) {
+    errs() << "cannot load " << PluginPath << ": " << err << "\n";
+    return 1;
+  }
+  SetReportStream = reinterpret_cast<SetReportStreamFn>(
+      sys::DynamicLibrary::SearchForAddressOfSymbol("HW2SetReportStream"));
+  if (!SetReportStream) {
+    errs() << PluginPath << " does not export HW2SetReportStream\n";
+    return 1;
+  }
+  GetTraceConfig = reinterpret_cast<GetTraceConfigFn>(
+      sys::DynamicLibrary::SearchForAddressOfSymbol("HW2GetTraceConfig"));
+  SetTraceConfig = reinterpret_cast<SetTraceConfigFn>(
+      sys::DynamicLibrary::SearchForAddressOfSymbol("HW2SetTraceConfig"));
+  TakeTraceTotals = reinterpret_cast<TakeTraceTotalsFn>(
+      sys::DynamicLibrary::SearchForAddressOfSymbol("HW2TakeTraceTotals"));
+  if (Tune && (!GetTraceConfig || !SetTraceConfig || !TakeTraceTotals)) {
+    errs() << PluginPath << " does not export the tuning interface\n";
+    return 1;
+  }
+  if (Tune && Scaling) {
+    errs() << "-tune and -scaling do not go together\n";
+    return 1;
+  }
+  // options registered by the plugin
+  if (!PassArgs.empty()) {
+    std::vector<const char *> pargv = {argv[0]};
+    for (std::string &A : PassArgs) pargv.push_back(A.c_str());
+    cl::ParseCommandLineOptions(pargv.size(), pargv.data());
+  }
+  for (const char *transform : {"form-superblocks", "enlarge-superblocks"})
+    if (optionValue<bool>(transform)) {
+      errs() << "-" << transform << " shares the module growth budget; run the pass in opt instead\n";
+      return 1;
+    }
+  if (optionValue<bool>("call-summaries")) {
+    errs() << "call summaries need the whole module; run the pass in opt instead\n";
+    return 1;
+  }
+  if (!optionValue<std::string>("trace-sample-profile").empty()) {
+    errs() << "sample profiles are loaded per module; run the pass in opt instead\n";
+    return 1;
+  }
+  const PassInfo *PI = Registry.getPassInfo(PassName);
+  if (!PI) {
+    errs() << "pass '" << PassName << "' is not registered by the plugin\n";
+    return 1;
+  }
+  std::unique_ptr<Pass> probe(PI->createPass());
+  if (probe->getPassKind() != PT_Function) {
+    errs() << "pass '" << PassName << "' is not a function pass\n";
+    return 1;
+  }
+
+  // the files are read once and shared; every worker parses its own copy
+  std::vector<std::unique_ptr<MemoryBuffer>> buffers;
+  std::vector<WorkItem> items;
+  for (unsigned file = 0; file < InputFiles.size(); ++file) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> buf = MemoryBuffer::getFileOrSTDIN(InputFiles[file]);
+    if (!buf) {
+      errs() << "cannot read " << InputFiles[file] << ": " << buf.getError().message() << "\n";
+      return 1;
+    }
+    buffers.push_back(std::move(*buf));
+    LLVMContext Ctx;
+    Expected<std::unique_ptr<Module>> M = loadLazily(*buffers.back(), Ctx);
+    if (!M) {
+      logAllUnhandledErrors(M.takeError(), errs(), InputFiles[file] + ": ");
+      return 1;
+    }
+    unsigned numDefs = definitions(**M).size();
+    for (unsigned index = 0; index < numDefs; ++index) items.push_back(WorkItem{file, index});
+  }
+
+  unsigned maxThreads = Threads ? unsigned(Threads) : hardware_concurrency().compute_thread_count();
+  if (Tune) return tune(buffers, items, maxThreads);
+  Reports R;
+  if (!Scaling) {
+    Expected<double> seconds = runAll(buffers, items, maxThreads, R);
+    if (!seconds) {
+      logAllUnhandledErrors(seconds.takeError(), errs(), "");
+      return 1;
+    }
+    std::error_code EC;
+    ToolOutputFile out(OutputFile, EC, sys::fs::OF_Text);
+    if (EC) {
+      errs() << "cannot write " << OutputFile << ": " << EC.message() << "\n";
+      return 1;
+    }
+    for (std::string &init : R.files) errs() << init;
+    errs() << R.finals;
+    for (size_t i = 0; i < items.size(); ++i)
+      out.os() << "function " << R.names[i] << " (" << InputFiles[items[i].file] << ")\n"
+               << R.functions[i];
+    out.keep();
+    errs() << format("%zu functions, %u threads: %.3f s, %.1f functions/sec\n", items.size(),
+                     maxThreads, *seconds, items.size() / *seconds);
+    return 0;
+  }
+
+  // scaling: every run must reproduce the serial reports
+  std::vector<std::string> serialNames, serialFunctions;
+  double serialSeconds = 0;
+  outs() << "pass: " << PassName << ", functions: " << items.size() << "\n";
+  outs() << "   threads    seconds  functions/sec    speedup  matches serial\n";
+  for (unsigned numThreads = 1;; numThreads = std::min(numThreads * 2, maxThreads)) {
+    Expected<double> seconds = runAll(buffers, items, numThreads, R);
+    if (!seconds) {
+      logAllUnhandledErrors(seconds.takeError(), errs(), "");
+      return 1;
+    }
+    if (numThreads == 1) {
+      for (std::string &init : R.files) errs() << init;
+      errs() << R.finals;
+      serialNames = R.names;
+      serialFunctions = R.functions;
+      serialSeconds = *seconds;
+    }
+    bool same = R.names == serialNames && R.functions == serialFunctions;
+    outs() << format("%10u %10.3f %14.1f %10.2f  %s\n", numThreads, *seconds,
+                     items.size() / *seconds, serialSeconds / *seconds, same ? "yes" : "NO");
+    if (!same) return 1;
+    if (numThreads >= maxThreads) break;
+  }
+  return 0;
+}
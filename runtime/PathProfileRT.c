@@ -0,0 +1,127 @@
+//===-- Path and trace profiling runtime ---------------------------------===//
+//
+// Link into programs instrumented with -path-profile-instr or
+// -trace-exit-instr. The instrumented module registers its counters from a
+// constructor. The first destructor to
+// run adds all counters into the file named by $PATHPROF_FILE (default
+// pathprof.out), which is mapped into memory. Counts accumulate over runs as long as the set of
+// profiled functions stays the same, otherwise the file is rewritten.
+//
+// File layout, all fields 64 bit native endian:
+//   magic, number of counter sets
+//   per set: name length, name (padded to 8 bytes), checksum of what was
+//            counted, number of counters, the counters
+//
+//===----------------------------------------------------------------------===//
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PATHPROF_MAGIC 0x3130485441504c42ULL // "BLPATH01"
+
+// Must match the table built by PathProfileInstrPass.
+struct __pathprof_function {
+  const char *name;
+  uint64_t checksum;
+  uint64_t numCounters;
+  uint64_t *counters;
+};
+
+struct module {
+  struct __pathprof_function *fns;
+  uint64_t n;
+  struct module *next;
+};
+
+static struct module *modules, **lastModule = &modules;
+
+static uint64_t padded(uint64_t len) { return (len + 7) & ~7ULL; }
+
+// Walk the file layout. With check set, return 0 unless the mapped file
+// describes exactly the registered functions; otherwise write the function
+// headers and add the counters in.
+static int visit(uint64_t *file, int check) {
+  uint64_t *p = file + 2;
+  for (struct module *m = modules; m; m = m->next) {
+    for (uint64_t i = 0; i < m->n; ++i) {
+      struct __pathprof_function *fn = &m->fns[i];
+      uint64_t len = strlen(fn->name);
+      if (check) {
+        if (p[0] != len || memcmp(p + 1, fn->name, len)) return 0;
+      } else {
+        p[0] = len;
+        memcpy(p + 1, fn->name, len);
+      }
+      p += 1 + padded(len) / 8;
+      if (check) {
+        if (p[0] != fn->checksum || p[1] != fn->numCounters) return 0;
+      } else {
+        p[0] = fn->checksum;
+        p[1] = fn->numCounters;
+      }
+      p += 2;
+      if (!check)
+        for (uint64_t j = 0; j < fn->numCounters; ++j) p[j] += fn->counters[j];
+      p += fn->numCounters;
+    }
+  }
+  return 1;
+}
+
+void __pathprof_dump(void) {
+  static int dumped;
+  if (dumped) return;
+  dumped = 1;
+  const char *path = getenv("PATHPROF_FILE");
+  if (!path) path = "pathprof.out";
+  uint64_t numFns = 0, size = 2 * 8;
+  for (struct module *m = modules; m; m = m->next) {
+    numFns += m->n;
+    for (uint64_t i = 0; i < m->n; ++i)
+      size += 8 + padded(strlen(m->fns[i].name)) + 16 + m->fns[i].numCounters * 8;
+  }
+
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st)) {
+    fprintf(stderr, "pathprof: cannot open %s\n", path);
+    return;
+  }
+  int merge = (uint64_t)st.st_size == size;
+  if (!merge && (ftruncate(fd, 0) || ftruncate(fd, size))) {
+    fprintf(stderr, "pathprof: cannot resize %s\n", path);
+    close(fd);
+    return;
+  }
+  uint64_t *file = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED) {
+    fprintf(stderr, "pathprof: cannot map %s\n", path);
+    return;
+  }
+  // a different program or build: start over
+  if (merge && (file[0] != PATHPROF_MAGIC || file[1] != numFns || !visit(file, 1)))
+    merge = 0;
+  if (!merge) {
+    memset(file, 0, size);
+    file[0] = PATHPROF_MAGIC;
+    file[1] = numFns;
+  }
+  visit(file, 0);
+  munmap(file, size);
+}
+
+void __pathprof_register(struct __pathprof_function *fns, uint64_t n) {
+  struct module *m = malloc(sizeof(*m));
+  if (!m) return;
+  m->fns = fns;
+  m->n = n;
+  m->next = NULL;
+  *lastModule = m;
+  lastModule = &m->next;
+}
@@ -0,0 +1,50 @@
+; -alias-hazards drops a store hazard only if nothing downstream of the
+; store in MemorySSA may read it, not just its direct uses.
+; RUN: %opt -passes=static -alias-hazards %s -disable-output 2>&1 | FileCheck %s
+
+; The load of %p hangs off the store to %q, which may alias %p; the store
+; to %p is still read.
+; CHECK: hazards removed by alias analysis: 0
+define i32 @read_through_def(i32* %p0, i32* %q, i64 %i) {
+entry:
+  %p = getelementptr i32, i32* %p0, i64 %i
+  store i32 1, i32* %p
+  store i32 2, i32* %q
+  %v = load i32, i32* %p
+  br label %exit
+
+exit:
+  ret i32 %v
+}
+
+; Nothing reads %p here.
+; CHECK: hazards removed by alias analysis: 1
+define i32 @unread(i32* noalias %p0, i32* noalias %q, i64 %i) {
+entry:
+  %p = getelementptr i32, i32* %p0, i64 %i
+  store i32 1, i32* %p
+  store i32 2, i32* %q
+  %v = load i32, i32* %q
+  br label %exit
+
+exit:
+  ret i32 %v
+}
+
+; A second store to %p overwrites the first before the load; only the
+; block of the second keeps its hazard.
+; CHECK: hazards removed by alias analysis: 1
+define i32 @overwritten(i32* noalias %p0, i64 %i) {
+entry:
+  %p = getelementptr i32, i32* %p0, i64 %i
+  store i32 1, i32* %p
+  br label %next
+
+next:
+  store i32 2, i32* %p
+  %v = load i32, i32* %p
+  br label %exit
+
+exit:
+  ret i32 %v
+}
@@ -0,0 +1,56 @@
+; With call summaries, a call to a function that only computes, or only
+; writes the caller's stack slot it is passed, does not end a trace; a call
+; that writes a global or is not known does.
+; RUN: %opt -passes=static %s -o /dev/null 2>&1 | FileCheck %s --check-prefix=PLAIN
+; RUN: %opt -passes=static -call-summaries %s -o /dev/null 2>&1 | FileCheck %s --check-prefix=SUMMARY
+; RUN: %opt -enable-new-pm=0 -static -call-summaries %s -o /dev/null 2>&1 | FileCheck %s --check-prefix=SUMMARY
+
+; PLAIN-NOT: Trace: size
+
+; SUMMARY: call summaries: pure 1, read only 0, writes args 1, unknown 2, may unwind 1
+; SUMMARY: hazards removed by call summaries: 0
+; SUMMARY: hazards removed by call summaries: 0
+; SUMMARY: hazards removed by call summaries: 0
+; SUMMARY: Trace: size 2
+; SUMMARY: Num of hazards: 0
+; SUMMARY: hazards removed by call summaries: 2
+
+@g = global i32 0
+
+define i32 @pure(i32 %x) {
+  %y = mul i32 %x, 3
+  ret i32 %y
+}
+
+define void @writes_global(i32 %x) {
+  store i32 %x, i32* @g
+  ret void
+}
+
+define void @writes_slot(i32* %p, i32 %x) {
+  store i32 %x, i32* %p
+  ret void
+}
+
+declare void @unknown()
+
+define i32 @f(i32 %x) !prof !0 {
+entry:
+  %slot = alloca i32
+  %a = call i32 @pure(i32 %x)
+  br label %b1
+b1:
+  call void @writes_slot(i32* %slot, i32 %a)
+  br label %b2
+b2:
+  call void @writes_global(i32 %a)
+  br label %b3
+b3:
+  call void @unknown()
+  br label %b4
+b4:
+  %v = load i32, i32* %slot
+  ret i32 %v
+}
+
+!0 = !{!"function_entry_count", i64 100}
@@ -0,0 +1,28 @@
+; The driver runs functions in any order on any thread, so transforms that
+; share the module growth budget are refused rather than made order
+; dependent; trace formation itself runs.
+; RUN: %driver -plugin=$TEST_PLUGIN -pass=static %s -j=2 2>&1 | FileCheck %s --check-prefix=REPORT
+; RUN: not %driver -plugin=$TEST_PLUGIN -pass=static -pass-arg=-form-superblocks %s 2>&1 | FileCheck %s --check-prefix=FORM
+; RUN: not %driver -plugin=$TEST_PLUGIN -pass=static -pass-arg=-enlarge-superblocks %s 2>&1 | FileCheck %s --check-prefix=ENLARGE
+
+; REPORT: function f ({{.*}}driver-refused.ll)
+; REPORT: Trace: size 2
+; FORM: -form-superblocks shares the module growth budget; run the pass in opt instead
+; ENLARGE: -enlarge-superblocks shares the module growth budget; run the pass in opt instead
+
+define i32 @f(i32 %x) !prof !0 {
+entry:
+  %neg = icmp slt i32 %x, 0
+  br i1 %neg, label %minus, label %plus
+minus:
+  %m = sub i32 0, %x
+  br label %join
+plus:
+  %p = add i32 %x, 1
+  br label %join
+join:
+  %r = phi i32 [ %m, %minus ], [ %p, %plus ]
+  ret i32 %r
+}
+
+!0 = !{!"function_entry_count", i64 100}
@@ -0,0 +1,41 @@
+; -enlarge-superblocks unrolls a hot superblock loop into one loop of
+; four copies.
+; RUN: %opt -passes='profile,function(print<loops>)' -enlarge-superblocks -sb-enlarge-growth=400 \
+; RUN:   -sb-module-growth=400 %s -disable-output 2>&1 | FileCheck %s
+; RUN: %opt -passes=profile -enlarge-superblocks -sb-enlarge-growth=400 -sb-module-growth=400 %s -S 2>/dev/null \
+; RUN:   | FileCheck %s --check-prefix=IR
+
+; CHECK: enlarged superblocks: unrolled 1, peeled 0, target expanded 0 (24 instrs)
+; CHECK: Loop at depth 1 containing: %loop<header><exiting>,%loop.sbx<exiting>,%loop.sbx1<exiting>,%loop.sbx9<latch><exiting>
+
+; IR: loop:
+; IR: br i1 %c, label %loop.sbx, label %exit
+; IR: loop.sbx:
+; IR: br i1 %c.sbx, label %loop.sbx1, label %exit
+; IR: loop.sbx1:
+; IR: br i1 %c.sbx8, label %loop.sbx9, label %exit
+; IR: loop.sbx9:
+; IR: br i1 %c.sbx16, label %loop, label %exit
+define i32 @sum(i32* %a, i32 %n) !prof !0 {
+entry:
+  %c0 = icmp sgt i32 %n, 0
+  br i1 %c0, label %loop, label %exit, !prof !1
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %loop ]
+  %s = phi i32 [ 0, %entry ], [ %s.next, %loop ]
+  %p = getelementptr inbounds i32, i32* %a, i32 %i
+  %v = load i32, i32* %p
+  %s.next = add i32 %s, %v
+  %i.next = add nuw nsw i32 %i, 1
+  %c = icmp slt i32 %i.next, %n
+  br i1 %c, label %loop, label %exit, !prof !2
+
+exit:
+  %r = phi i32 [ 0, %entry ], [ %s.next, %loop ]
+  ret i32 %r
+}
+
+!0 = !{!"function_entry_count", i64 10}
+!1 = !{!"branch_weights", i32 10, i32 0}
+!2 = !{!"branch_weights", i32 990, i32 10}
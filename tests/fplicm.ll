@@ -0,0 +1,83 @@
+; Frequent path LICM hoists the invariant load of the hot path out of the
+; loop when the only store that may overwrite it is off the hot path; the
+; cold store is followed by a reload (the repair code), and the stack slots
+; the values travel in are promoted to phis. The performance variant hoists
+; and repairs the mul of the loaded value as well. A load overwritten on
+; the hot path stays in the loop.
+; RUN: %opt -passes=fplicm-correctness %s -S 2>&1 | FileCheck %s --check-prefixes=CHECK,CORRECT
+; RUN: %opt -passes=fplicm-performance %s -S 2>&1 | FileCheck %s --check-prefixes=CHECK,PERF
+; RUN: %opt -enable-new-pm=0 -fplicm-performance %s -S 2>&1 | FileCheck %s --check-prefixes=CHECK,PERF
+
+; CORRECT: fplicm: hoisted loads: 1, hoisted computations: 0, repair sites: 1
+; PERF:    fplicm: hoisted loads: 1, hoisted computations: 1, repair sites: 1
+; CHECK:   fplicm: hoisted loads: 0, hoisted computations: 0, repair sites: 0
+
+; CHECK-LABEL: define i32 @cold_clobber(
+; CHECK:        entry:
+; CHECK-NEXT:     %[[V:v[0-9]+]] = load i32, i32* %p
+; PERF-NEXT:      %[[M:m[0-9]+]] = mul i32 %[[V]], 3
+; CHECK-NEXT:     br label %header
+; CHECK:        header:
+; PERF-NEXT:      %m.fplicm.0 = phi i32 [ %[[M]], %entry ], [ %m.fplicm.1, %latch ]
+; CHECK-NEXT:     %v.fplicm.0 = phi i32 [ %[[V]], %entry ], [ %v.fplicm.1, %latch ]
+; CHECK-NOT:      load
+; CORRECT:        %m = mul i32 %v.fplicm.0, 3
+; PERF-NOT:       mul
+; PERF:           %sum.next = add i32 %sum, %m.fplicm.0
+; CHECK:        cold:
+; CHECK-NEXT:     store i32 %i, i32* %p
+; CHECK-NEXT:     %v.repair = load i32, i32* %p
+; PERF-NEXT:      %m.repair = mul i32 %v.repair, 3
+; CHECK-NEXT:     br label %latch
+; CHECK:        latch:
+; PERF-NEXT:      %m.fplicm.1 = phi i32 [ %m.repair, %cold ], [ %m.fplicm.0, %header ]
+; CHECK-NEXT:     %v.fplicm.1 = phi i32 [ %v.repair, %cold ], [ %v.fplicm.0, %header ]
+
+; CHECK-LABEL: define i32 @hot_clobber(
+; CHECK:        entry:
+; CHECK-NEXT:     br label %header
+; CHECK:        header:
+; CHECK:          %v = load i32, i32* %p
+; CHECK:          store i32 %sum.next, i32* %p
+
+define i32 @cold_clobber(i32* noalias %p, i32 %n) !prof !0 {
+entry:
+  br label %header
+header:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %latch ]
+  %sum = phi i32 [ 0, %entry ], [ %sum.next, %latch ]
+  %v = load i32, i32* %p
+  %m = mul i32 %v, 3
+  %sum.next = add i32 %sum, %m
+  %rare = icmp eq i32 %i, 50
+  br i1 %rare, label %cold, label %latch, !prof !1
+cold:
+  store i32 %i, i32* %p
+  br label %latch
+latch:
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %exit, label %header, !prof !2
+exit:
+  ret i32 %sum.next
+}
+
+define i32 @hot_clobber(i32* noalias %p, i32 %n) !prof !0 {
+entry:
+  br label %header
+header:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %header ]
+  %sum = phi i32 [ 0, %entry ], [ %sum.next, %header ]
+  %v = load i32, i32* %p
+  %sum.next = add i32 %sum, %v
+  store i32 %sum.next, i32* %p
+  %i.next = add i32 %i, 1
+  %done = icmp eq i32 %i.next, %n
+  br i1 %done, label %exit, label %header, !prof !2
+exit:
+  ret i32 %sum.next
+}
+
+!0 = !{!"function_entry_count", i64 10}
+!1 = !{!"branch_weights", i32 1, i32 999}
+!2 = !{!"branch_weights", i32 10, i32 1000}
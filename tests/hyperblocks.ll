@@ -0,0 +1,58 @@
+; -hyperblocks turns short, hazard-free diamonds and triangles into selects,
+; all of them in one post-order pass.
+; RUN: %opt -passes=static -hyperblocks %s -S 2>&1 | FileCheck %s
+
+; CHECK: hyperblocks: if-converted diamonds: 2, triangles: 1
+; CHECK: hyperblocks: if-converted diamonds: 0, triangles: 0
+; CHECK-LABEL: define i32 @f(
+; CHECK: entry:
+; CHECK: %p1.sel = select i1 %c1, i32 %x1, i32 %y1
+; CHECK-NEXT: br label %j1
+; CHECK: j1:
+; CHECK: %p2.sel = select i1 %c2, i32 %x2, i32 %p1.sel
+; CHECK-NEXT: br label %j2
+; CHECK: j2:
+; CHECK: %p3.sel = select i1 %c3, i32 %x3, i32 %y3
+; CHECK-NEXT: br label %j3
+define i32 @f(i32 %a, i32 %b, i1 %c1, i1 %c2, i1 %c3) {
+entry:
+  br i1 %c1, label %t1, label %e1
+t1:
+  %x1 = add i32 %a, 1
+  br label %j1
+e1:
+  %y1 = mul i32 %a, 3
+  br label %j1
+j1:
+  %p1 = phi i32 [ %x1, %t1 ], [ %y1, %e1 ]
+  br i1 %c2, label %t2, label %j2
+t2:
+  %x2 = add i32 %p1, %b
+  br label %j2
+j2:
+  %p2 = phi i32 [ %x2, %t2 ], [ %p1, %j1 ]
+  br i1 %c3, label %t3, label %e3
+t3:
+  %x3 = sub i32 %p2, 7
+  br label %j3
+e3:
+  %y3 = xor i32 %p2, 5
+  br label %j3
+j3:
+  %p3 = phi i32 [ %x3, %t3 ], [ %y3, %e3 ]
+  ret i32 %p3
+}
+
+; A store is a hazard, so its side stays a branch.
+; CHECK-LABEL: define void @g(
+; CHECK: br i1 %c, label %t, label %j
+define void @g(i32* %p, i32 %v, i1 %c) {
+entry:
+  %q = getelementptr i32, i32* %p, i32 %v
+  br i1 %c, label %t, label %j
+t:
+  store i32 %v, i32* %q
+  br label %j
+j:
+  ret void
+}
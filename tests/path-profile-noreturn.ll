@@ -0,0 +1,42 @@
+; Calls that do not return end a Ball-Larus path: the path is counted
+; before the call, not at a terminator that never runs.
+; RUN: %opt -passes=path-profile-instr %s -S 2>&1 | FileCheck %s
+
+; CHECK: path profiled functions: 1, skipped: 0
+; CHECK: @__pathprof_paths.f = private global [3 x i64] zeroinitializer
+
+define i32 @f(i1 %c, i1 %d) {
+entry:
+  br i1 %c, label %die, label %live
+
+; CHECK-LABEL: die:
+; CHECK: getelementptr inbounds {{.*}} @__pathprof_paths.f
+; CHECK: store i64
+; CHECK-NEXT: call void @exit(i32 1)
+; CHECK-NEXT: unreachable
+die:
+  call void @exit(i32 1)
+  unreachable
+
+live:
+  br i1 %d, label %fail, label %done
+
+; CHECK-LABEL: fail:
+; CHECK: getelementptr inbounds {{.*}} @__pathprof_paths.f
+; CHECK: store i64
+; CHECK-NEXT: call void @abort()
+; CHECK-NEXT: br label %done
+fail:
+  call void @abort()
+  br label %done
+
+; CHECK-LABEL: done:
+; CHECK: getelementptr inbounds {{.*}} @__pathprof_paths.f
+; CHECK: store i64
+; CHECK-NEXT: ret i32 0
+done:
+  ret i32 0
+}
+
+declare void @exit(i32) noreturn
+declare void @abort() noreturn
@@ -0,0 +1,31 @@
+#!/bin/bash
+# Runs the RUN: lines of one test the way lit would. A line ending in \
+# continues on the next RUN: line. Substitutions: %s the test, %S its
+# directory, %t a scratch path for it, %opt opt with the trace passes
+# loaded, %driver the trace driver. FileCheck, not and the other LLVM
+# tools come from PATH.
+#
+#   run-test.sh <test>   (TEST_PLUGIN, TEST_DRIVER and TEST_SCRATCH set)
+set -o pipefail
+test=$1
+name=$(basename "$test")
+dir=$(cd "$(dirname "$test")" && pwd)
+t=$TEST_SCRATCH/$name.tmp
+mkdir -p "$TEST_SCRATCH"
+rm -rf "$t"
+
+status=0
+while IFS= read -r cmd; do
+  cmd=${cmd//%opt/opt -load $TEST_PLUGIN -load-pass-plugin $TEST_PLUGIN}
+  cmd=${cmd//%driver/$TEST_DRIVER}
+  cmd=${cmd//%S/$dir}
+  cmd=${cmd//%s/$dir/$name}
+  cmd=${cmd//%t/$t}
+  echo "RUN: $cmd"
+  if ! bash -o pipefail -c "$cmd"; then
+    echo "FAILED: $name"
+    status=1
+    break
+  fi
+done < <(sed -n 's/^.*RUN: *//p' "$test" | sed -e ':a' -e '/\\$/{N;s/\\\n//;ba' -e '}')
+exit $status
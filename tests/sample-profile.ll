@@ -0,0 +1,60 @@
+; A hand-written text sample profile turns into the entry count and branch
+; weights the traces are selected by, under either pass manager. Profile
+; inference is LLVM's -sample-profile-use-profi, off unless given; without
+; it the loader's propagation adds one to the counts. A missing profile is
+; reported and the static estimates are used.
+; RUN: %opt -passes=profile -sample-profile-use-profi -trace-sample-profile=%S/Inputs/sample-profile-then.prof \
+; RUN:   %s -S 2>&1 | FileCheck %s --check-prefixes=CHECK,PROFI,THEN
+; RUN: %opt -passes=profile -sample-profile-use-profi -trace-sample-profile=%S/Inputs/sample-profile-else.prof \
+; RUN:   %s -S 2>&1 | FileCheck %s --check-prefixes=CHECK,PROFI,ELSE
+; RUN: %opt -enable-new-pm=0 -profile -sample-profile-use-profi -trace-sample-profile=%S/Inputs/sample-profile-then.prof \
+; RUN:   %s -S 2>&1 | FileCheck %s --check-prefixes=CHECK,PROFI,THEN
+; RUN: %opt -passes=profile -trace-sample-profile=%S/Inputs/sample-profile-then.prof %s -S 2>&1 \
+; RUN:   | FileCheck %s --check-prefixes=CHECK,NOPROFI
+; RUN: %opt -passes=static -trace-sample-profile=%S/Inputs/missing.prof %s -o /dev/null 2>&1 \
+; RUN:   | FileCheck %s --check-prefix=MISSING
+
+; CHECK: sample profile: 1 of 1 functions with debug info sampled
+; CHECK: Trace: size 3
+; PROFI: in_count: 100
+; NOPROFI: in_count: 101
+; CHECK: define i32 @f(i32 %x) #0 {{.*}}!prof [[ENTRY:![0-9]+]]
+; CHECK: br i1 %c, label %a, label %b, {{.*}}!prof [[WEIGHTS:![0-9]+]]
+; CHECK: attributes #0 = { "use-sample-profile" }
+; PROFI: [[ENTRY]] = !{!"function_entry_count", i64 100}
+; THEN: [[WEIGHTS]] = !{!"branch_weights", i32 90, i32 10}
+; ELSE: [[WEIGHTS]] = !{!"branch_weights", i32 10, i32 90}
+; NOPROFI: [[ENTRY]] = !{!"function_entry_count", i64 101}
+; NOPROFI: [[WEIGHTS]] = !{!"branch_weights", i32 91, i32 11}
+
+; MISSING: cannot read sample profile {{.*}}missing.prof: {{.*}}, using static estimates
+
+define i32 @f(i32 %x) !dbg !6 {
+entry:
+  %c = icmp sgt i32 %x, 0, !dbg !10
+  br i1 %c, label %a, label %b, !dbg !10
+a:
+  %xa = add i32 %x, 1, !dbg !11
+  br label %join, !dbg !11
+b:
+  %xb = mul i32 %x, 3, !dbg !12
+  br label %join, !dbg !12
+join:
+  %r = phi i32 [ %xa, %a ], [ %xb, %b ], !dbg !13
+  ret i32 %r, !dbg !13
+}
+
+!llvm.dbg.cu = !{!0}
+!llvm.module.flags = !{!3, !4}
+
+!0 = distinct !DICompileUnit(language: DW_LANG_C99, file: !1, producer: "hand written", isOptimized: true, runtimeVersion: 0, emissionKind: FullDebug)
+!1 = !DIFile(filename: "t.c", directory: "/")
+!3 = !{i32 2, !"Debug Info Version", i32 3}
+!4 = !{i32 7, !"Dwarf Version", i32 4}
+!6 = distinct !DISubprogram(name: "f", scope: !1, file: !1, line: 1, type: !7, scopeLine: 1, spFlags: DISPFlagDefinition | DISPFlagOptimized, unit: !0)
+!7 = !DISubroutineType(types: !8)
+!8 = !{null}
+!10 = !DILocation(line: 2, scope: !6)
+!11 = !DILocation(line: 3, scope: !6)
+!12 = !DILocation(line: 4, scope: !6)
+!13 = !DILocation(line: 5, scope: !6)
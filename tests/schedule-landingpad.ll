@@ -0,0 +1,41 @@
+; The superblock scheduler leaves a landing pad first in its block: a
+; block holding an EH pad is in no scheduling region.
+; RUN: %opt -passes=profile -schedule-superblocks -sb-sched-width=1 %s -S 2>&1 | FileCheck %s
+
+; CHECK: scheduled regions: 1
+; CHECK-LABEL: lpad:
+; CHECK-NEXT: %lp = landingpad { i8*, i32 }
+; CHECK-NEXT: cleanup
+; CHECK-NEXT: %x = mul i32 %a, %a
+define i32 @f(i32 %a, i32 %b) personality i32 (...)* @__gxx_personality_v0 !prof !0 {
+entry:
+  invoke void @may_throw() to label %cont unwind label %lpad, !prof !1
+
+cont:
+  ret i32 0
+
+; the chain is taller than the landing pad, which used to go below it
+lpad:
+  %lp = landingpad { i8*, i32 } cleanup
+  %x = mul i32 %a, %a
+  %y = mul i32 %x, %b
+  %z = add i32 %a, %b
+  %w = mul i32 %z, %y
+  %c = icmp sgt i32 %w, 0
+  br i1 %c, label %pos, label %neg, !prof !2
+
+pos:
+  %s = add i32 %w, %a
+  %t = mul i32 %s, %s
+  ret i32 %t
+
+neg:
+  resume { i8*, i32 } %lp
+}
+
+declare void @may_throw()
+declare i32 @__gxx_personality_v0(...)
+
+!0 = !{!"function_entry_count", i64 100}
+!1 = !{!"branch_weights", i32 10, i32 90}
+!2 = !{!"branch_weights", i32 90, i32 1}
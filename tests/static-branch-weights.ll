@@ -0,0 +1,80 @@
+; -static-branch-weights turns the combined heuristic predictions into
+; branch_weights, which BranchProbabilityInfo then reads back. Existing
+; weights are kept unless -static-branch-weights-overwrite.
+; RUN: %opt -passes=static -static-branch-weights %s -S 2>/dev/null | FileCheck %s
+; RUN: %opt -passes=static -static-branch-weights -static-branch-weights-overwrite %s -S 2>/dev/null \
+; RUN:   | FileCheck %s --check-prefix=OVERWRITE
+; RUN: %opt -passes='static,function(print<branch-prob>)' -static-branch-weights %s -disable-output 2>&1 \
+; RUN:   | FileCheck %s --check-prefix=BPI
+
+; The null test is predicted false (pointer heuristic), the latch back to
+; the header (loop branch heuristic).
+; CHECK-LABEL: define i32 @loop(
+; CHECK: br i1 %isnull, label %exit, label %latch, !prof [[NULL:![0-9]+]]
+; CHECK: br i1 %cont, label %header, label %exit, !prof [[LATCH:![0-9]+]]
+; BPI-LABEL: function 'loop'
+; BPI-DAG: edge header -> exit probability is {{.*}} = 14.30%
+; BPI-DAG: edge header -> latch probability is {{.*}} = 85.70% [HOT edge]
+; BPI-DAG: edge latch -> header probability is {{.*}} = 92.30% [HOT edge]
+; BPI-DAG: edge latch -> exit probability is {{.*}} = 7.70%
+define i32 @loop(i32* %a, i32 %n) {
+entry:
+  br label %header
+
+header:
+  %i = phi i32 [ 0, %entry ], [ %i.next, %latch ]
+  %s = phi i32 [ 0, %entry ], [ %s.next, %latch ]
+  %p = getelementptr i32, i32* %a, i32 %i
+  %v = load i32, i32* %p
+  %isnull = icmp eq i32* %p, null
+  br i1 %isnull, label %exit, label %latch
+
+latch:
+  %s.next = add i32 %s, %v
+  %i.next = add i32 %i, 1
+  %cont = icmp slt i32 %i.next, %n
+  br i1 %cont, label %header, label %exit
+
+exit:
+  %r = phi i32 [ -1, %header ], [ %s.next, %latch ]
+  ret i32 %r
+}
+
+; No heuristic tells the cases apart.
+; CHECK-LABEL: define i32 @sw(
+; CHECK: switch i32 %x, label %def [{{.*}}
+; CHECK-NEXT: i32 0, label %a
+; CHECK-NEXT: i32 1, label %b
+; CHECK-NEXT: ], !prof [[SW:![0-9]+]]
+define i32 @sw(i32 %x) {
+entry:
+  switch i32 %x, label %def [ i32 0, label %a
+                              i32 1, label %b ]
+a:
+  ret i32 1
+b:
+  ret i32 2
+def:
+  ret i32 0
+}
+
+; CHECK-LABEL: define i32 @weighted(
+; CHECK: br i1 %c, label %t, label %f, !prof [[KEPT:![0-9]+]]
+; OVERWRITE-LABEL: define i32 @weighted(
+; OVERWRITE: br i1 %c, label %t, label %f, !prof [[EQUAL:![0-9]+]]
+; OVERWRITE: [[EQUAL]] = !{!"branch_weights", i32 500, i32 500}
+define i32 @weighted(i1 %c) {
+entry:
+  br i1 %c, label %t, label %f, !prof !0
+t:
+  ret i32 1
+f:
+  ret i32 0
+}
+
+!0 = !{!"branch_weights", i32 1, i32 99}
+
+; CHECK-DAG: [[NULL]] = !{!"branch_weights", i32 143, i32 857}
+; CHECK-DAG: [[LATCH]] = !{!"branch_weights", i32 923, i32 77}
+; CHECK-DAG: [[SW]] = !{!"branch_weights", i32 333, i32 333, i32 333}
+; CHECK-DAG: [[KEPT]] = !{!"branch_weights", i32 1, i32 99}
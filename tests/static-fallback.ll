@@ -0,0 +1,37 @@
+; Static traces stop where the combined prediction falls short of the trace
+; threshold, as profiled ones do. The opcode heuristic alone, x < 0 is
+; unlikely, puts plus at 0.84: through plus by default, but not at 0.95,
+; where the trace ends at entry and nothing is reported.
+; RUN: %opt -passes=static -trace-layout %s -S 2>&1 | FileCheck %s
+; RUN: %opt -passes=static -trace-threshold=0.95 -trace-layout %s -S 2>&1 | FileCheck %s --check-prefix=STOP
+
+; CHECK: Trace: size 2
+; CHECK-LABEL: define i32 @f(
+; CHECK:      entry:
+; CHECK:      plus:
+; CHECK:      join:
+; CHECK:      minus:
+
+; STOP-NOT: Trace: size
+; STOP-LABEL: define i32 @f(
+; STOP:      entry:
+; STOP:      join:
+; STOP:      plus:
+; STOP:      minus:
+
+define i32 @f(i32 %x) !prof !0 {
+entry:
+  %neg = icmp slt i32 %x, 0
+  br i1 %neg, label %minus, label %plus
+minus:
+  %m = sub i32 0, %x
+  br label %join
+plus:
+  %p = add i32 %x, 1
+  br label %join
+join:
+  %r = phi i32 [ %m, %minus ], [ %p, %plus ]
+  ret i32 %r
+}
+
+!0 = !{!"function_entry_count", i64 100}
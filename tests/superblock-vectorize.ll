@@ -0,0 +1,98 @@
+; Superblock vectorization packs the four adds and stores of the hot trace,
+; two before its side exit and two after, into one <4 x i32> load, add and
+; store on the hot path. The two stores from before the exit move off it,
+; scalar, with their loads and adds, onto the exit edge. A region with a
+; call in it is left alone. The cost model is the target's, hence the triple.
+; RUN: %opt -passes=profile -alias-hazards -vectorize-superblocks %s -S 2>&1 | FileCheck %s
+
+; CHECK: vectorized regions: 1, bundles: 1 (1 across blocks), packed scalars: 12, fallback stores: 2
+; CHECK: vectorized regions: 0, bundles: 0 (0 across blocks), packed scalars: 0, fallback stores: 0
+
+; CHECK-LABEL: define i32 @f(
+; CHECK:      entry:
+; CHECK-NEXT:   %b0 = load i32, i32* %b
+; CHECK-NEXT:   %early = icmp eq i32 %b0, 0
+; CHECK-NEXT:   br i1 %early, label %[[FALLBACK:entry.vec.exit]], label %more
+; CHECK:      more:
+; CHECK:        %b0.vec = load <4 x i32>, <4 x i32>*
+; CHECK-NEXT:   %s0.vec = add <4 x i32> %b0.vec, %.splat
+; CHECK-NEXT:   store <4 x i32> %s0.vec, <4 x i32>*
+; CHECK-NEXT:   ret i32 1
+; CHECK:      [[FALLBACK]]:
+; CHECK-NEXT:   %[[S0:[a-z0-9]+]] = add i32 %b0, %k
+; CHECK-NEXT:   %[[PB1:[a-z0-9]+]] = getelementptr inbounds i32, i32* %b, i64 1
+; CHECK-NEXT:   %[[B1:[a-z0-9]+]] = load i32, i32* %[[PB1]]
+; CHECK-NEXT:   %[[S1:[a-z0-9]+]] = add i32 %[[B1]], %k
+; CHECK-NEXT:   %[[PA1:[a-z0-9]+]] = getelementptr inbounds i32, i32* %a, i64 1
+; CHECK-NEXT:   store i32 %[[S0]], i32* %a
+; CHECK-NEXT:   store i32 %[[S1]], i32* %[[PA1]]
+; CHECK-NEXT:   br label %exit
+
+; CHECK-LABEL: define i32 @g(
+; CHECK-NOT:    <4 x i32>
+; CHECK:        call void @unknown()
+
+target datalayout = "e-m:e-p270:32:32-p271:32:32-p272:64:64-i64:64-f80:128-n8:16:32:64-S128"
+target triple = "x86_64-unknown-linux-gnu"
+
+define i32 @f(i32* noalias %a, i32* noalias %b, i32 %k) !prof !0 {
+entry:
+  %b0 = load i32, i32* %b
+  %s0 = add i32 %b0, %k
+  store i32 %s0, i32* %a
+  %pb1 = getelementptr inbounds i32, i32* %b, i64 1
+  %b1 = load i32, i32* %pb1
+  %s1 = add i32 %b1, %k
+  %pa1 = getelementptr inbounds i32, i32* %a, i64 1
+  store i32 %s1, i32* %pa1
+  %early = icmp eq i32 %b0, 0
+  br i1 %early, label %exit, label %more, !prof !1
+more:
+  %pb2 = getelementptr inbounds i32, i32* %b, i64 2
+  %b2 = load i32, i32* %pb2
+  %s2 = add i32 %b2, %k
+  %pa2 = getelementptr inbounds i32, i32* %a, i64 2
+  store i32 %s2, i32* %pa2
+  %pb3 = getelementptr inbounds i32, i32* %b, i64 3
+  %b3 = load i32, i32* %pb3
+  %s3 = add i32 %b3, %k
+  %pa3 = getelementptr inbounds i32, i32* %a, i64 3
+  store i32 %s3, i32* %pa3
+  ret i32 1
+exit:
+  ret i32 0
+}
+
+define i32 @g(i32* noalias %a, i32* noalias %b, i32 %k) !prof !0 {
+entry:
+  %b0 = load i32, i32* %b
+  %s0 = add i32 %b0, %k
+  store i32 %s0, i32* %a
+  %pb1 = getelementptr inbounds i32, i32* %b, i64 1
+  %b1 = load i32, i32* %pb1
+  %s1 = add i32 %b1, %k
+  %pa1 = getelementptr inbounds i32, i32* %a, i64 1
+  store i32 %s1, i32* %pa1
+  %early = icmp eq i32 %b0, 0
+  br i1 %early, label %exit, label %more, !prof !1
+more:
+  %pb2 = getelementptr inbounds i32, i32* %b, i64 2
+  %b2 = load i32, i32* %pb2
+  %s2 = add i32 %b2, %k
+  %pa2 = getelementptr inbounds i32, i32* %a, i64 2
+  store i32 %s2, i32* %pa2
+  %pb3 = getelementptr inbounds i32, i32* %b, i64 3
+  %b3 = load i32, i32* %pb3
+  %s3 = add i32 %b3, %k
+  %pa3 = getelementptr inbounds i32, i32* %a, i64 3
+  store i32 %s3, i32* %pa3
+  call void @unknown()
+  ret i32 1
+exit:
+  ret i32 0
+}
+
+declare void @unknown()
+
+!0 = !{!"function_entry_count", i64 1000}
+!1 = !{!"branch_weights", i32 1, i32 999}
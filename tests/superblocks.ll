@@ -0,0 +1,60 @@
+; Tail duplication copies the blocks of the hot trace below its side
+; entrances, B from S1 and C from S2, and D with them, then merges the now
+; single-entry trace into one block, as far as the function and module
+; growth budgets allow.
+; RUN: %opt -passes=profile -form-superblocks -sb-func-growth=1000 -sb-module-growth=1000 %s -S 2>&1 \
+; RUN:   | FileCheck %s
+; RUN: %opt -passes=profile -form-superblocks -sb-func-growth=30 -sb-module-growth=1000 %s -o /dev/null 2>&1 \
+; RUN:   | FileCheck %s --check-prefix=PARTIAL
+; RUN: %opt -passes=profile -form-superblocks -sb-func-growth=1000 -sb-module-growth=10 %s -o /dev/null 2>&1 \
+; RUN:   | FileCheck %s --check-prefix=NONE
+
+; CHECK: Trace: size 5
+; CHECK: Num of hazards: 1
+; CHECK: fall thru: 0.999
+; CHECK: superblocks: 1, tail duplicated blocks: 3 (9 instrs), merged blocks: 3
+; CHECK-LABEL: define i32 @f(
+; CHECK:      A:
+; CHECK-NEXT:   %a = add i32 %x, 1
+; CHECK-NEXT:   %b = mul i32 %a, 3
+; CHECK-NEXT:   %c = add i32 %b, 9
+; CHECK-NEXT:   %d = xor i32 %c, 12
+; CHECK-NEXT:   ret i32 %d
+; CHECK:      S1:
+; CHECK:        br i1 %c1, label %B.sb, label %S2
+; CHECK:      S2:
+; CHECK-NEXT:   br label %C.sb
+; CHECK:      B.sb:
+; CHECK:      C.sb:
+; CHECK:      D.sb:
+
+; PARTIAL: superblocks: 1, tail duplicated blocks: 1 (3 instrs), merged blocks: 1
+; NONE: superblocks: 1, tail duplicated blocks: 0 (0 instrs), merged blocks: 0
+
+define i32 @f(i32 %n, i32 %x) !prof !1 {
+entry:
+  %c0 = icmp sgt i32 %n, 0
+  br i1 %c0, label %A, label %S1, !prof !0
+A:
+  %a = add i32 %x, 1
+  br label %B
+S1:
+  %c1 = icmp eq i32 %x, 7
+  br i1 %c1, label %B, label %S2
+B:
+  %pb = phi i32 [ %a, %A ], [ %x, %S1 ]
+  %b = mul i32 %pb, 3
+  br label %C
+S2:
+  br label %C
+C:
+  %pc = phi i32 [ %b, %B ], [ 5, %S2 ]
+  %c = add i32 %pc, 9
+  br label %D
+D:
+  %d = xor i32 %c, 12
+  ret i32 %d
+}
+
+!0 = !{!"branch_weights", i32 1000, i32 1}
+!1 = !{!"function_entry_count", i64 1000}
@@ -0,0 +1,118 @@
+; Peeling the dominant case of a switch: the block compares against the hot
+; case value and branches there, weighted hot against the rest, and the
+; switch, less that case, moves to a block of its own, its last case taking
+; the place of the peeled one. A hot successor shared by several case values
+; has no single value to compare against and stays in the switch. Without a
+; profile, the static predictor scores the cases itself: the case that
+; avoids the stores carries the trace.
+; RUN: %opt -passes=profile -peel-dominant-cases %s -S 2>&1 | FileCheck %s --check-prefix=PEEL
+; RUN: %opt -passes=static -trace-layout %s -S 2>&1 | FileCheck %s --check-prefix=STATIC
+; RUN: %opt -passes=static -static-branch-weights %s -S 2>&1 | FileCheck %s --check-prefix=WEIGHTS
+
+; PEEL: peeled dominant cases: 1
+; PEEL: Trace: size 3
+; PEEL: fall thru: 0.899
+; PEEL: peeled dominant cases: 0
+; PEEL-LABEL: define i32 @peel(
+; PEEL:      entry:
+; PEEL-NEXT:   %entry.hot = icmp eq i32 %x, 2
+; PEEL-NEXT:   br i1 %entry.hot, label %b, label %entry.cases, !prof [[HOT:![0-9]+]]
+; PEEL:      entry.cases:
+; PEEL-NEXT:   switch i32 %x, label %d [
+; PEEL-NEXT:     i32 1, label %a
+; PEEL-NEXT:     i32 4, label %e
+; PEEL-NEXT:     i32 3, label %c
+; PEEL-NEXT:   ], !prof [[REST:![0-9]+]]
+; PEEL:      b:
+; PEEL-NEXT:   br label %join
+; PEEL-LABEL: define i32 @shared(
+; PEEL:      entry:
+; PEEL-NEXT:   switch i32 %x, label %d [
+; PEEL-NEXT:     i32 1, label %b
+; PEEL-NEXT:     i32 2, label %b
+; PEEL-NEXT:     i32 3, label %c
+; PEEL-NEXT:   ], !prof [[SHARED:![0-9]+]]
+; PEEL: [[HOT]] = !{!"branch_weights", i32 900, i32 100}
+; PEEL: [[REST]] = !{!"branch_weights", i32 10, i32 20, i32 40, i32 30}
+; PEEL: [[SHARED]] = !{!"branch_weights", i32 10, i32 450, i32 450, i32 90}
+
+; STATIC-LABEL: define i32 @unprofiled(
+; STATIC:      entry:
+; STATIC-NEXT:   switch i32 %x, label %d [
+; STATIC:      b:
+; STATIC-NEXT:   %y = add i32 %x, 7
+; STATIC:      join:
+; STATIC:      a:
+; STATIC:      d:
+
+; WEIGHTS-LABEL: define i32 @unprofiled(
+; WEIGHTS:       switch i32 %x, label %d [
+; WEIGHTS:       ], !prof [[UNPROFILED:![0-9]+]]
+; WEIGHTS: [[UNPROFILED]] = !{!"branch_weights", i32 310, i32 310, i32 379}
+
+@g = global i32 0
+
+define i32 @peel(i32 %x) !prof !0 {
+entry:
+  switch i32 %x, label %d [
+    i32 1, label %a
+    i32 2, label %b
+    i32 3, label %c
+    i32 4, label %e
+  ], !prof !1
+a:
+  br label %join
+b:
+  br label %join
+c:
+  br label %join
+d:
+  br label %join
+e:
+  br label %join
+join:
+  %r = phi i32 [ 1, %a ], [ 2, %b ], [ 3, %c ], [ 4, %d ], [ 5, %e ]
+  ret i32 %r
+}
+
+define i32 @shared(i32 %x) !prof !0 {
+entry:
+  switch i32 %x, label %d [
+    i32 1, label %b
+    i32 2, label %b
+    i32 3, label %c
+  ], !prof !2
+b:
+  br label %join
+c:
+  br label %join
+d:
+  br label %join
+join:
+  %r = phi i32 [ 2, %b ], [ 3, %c ], [ 4, %d ]
+  ret i32 %r
+}
+
+define i32 @unprofiled(i32 %x) !prof !0 {
+entry:
+  switch i32 %x, label %d [
+    i32 1, label %a
+    i32 2, label %b
+  ]
+a:
+  store i32 1, i32* @g
+  br label %join
+b:
+  %y = add i32 %x, 7
+  br label %join
+d:
+  store i32 0, i32* @g
+  br label %join
+join:
+  %r = phi i32 [ 1, %a ], [ %y, %b ], [ 0, %d ]
+  ret i32 %r
+}
+
+!0 = !{!"function_entry_count", i64 1000}
+!1 = !{!"branch_weights", i32 10, i32 20, i32 900, i32 30, i32 40}
+!2 = !{!"branch_weights", i32 10, i32 450, i32 450, i32 90}
@@ -0,0 +1,31 @@
+; A second run with the same trace cache reuses the traces of the first; a
+; changed option the traces depend on misses. The report does not change.
+; RUN: rm -f %t.cache
+; RUN: %opt -passes=profile -trace-cache=%t.cache %s -o /dev/null 2>&1 | FileCheck %s --check-prefixes=CHECK,MISS
+; RUN: %opt -passes=profile -trace-cache=%t.cache %s -o /dev/null 2>&1 | FileCheck %s --check-prefixes=CHECK,HIT
+; RUN: %opt -passes=profile -trace-cache=%t.cache -trace-threshold=0.9 %s -o /dev/null 2>&1 \
+; RUN:   | FileCheck %s --check-prefixes=CHECK,MISS
+
+; CHECK: Trace: size 3
+; CHECK: fall thru: 0.890
+; MISS: trace cache: hits 0, misses 1
+; HIT:  trace cache: hits 1, misses 0
+
+define i32 @f(i32 %x) !prof !0 {
+entry:
+  %c = icmp sgt i32 %x, 0
+  br i1 %c, label %hot, label %cold, !prof !1
+hot:
+  %y = add i32 %x, 1
+  br label %next
+cold:
+  %w = sub i32 0, %x
+  br label %next
+next:
+  %p = phi i32 [ %y, %hot ], [ %w, %cold ]
+  %z = mul i32 %p, 3
+  ret i32 %z
+}
+
+!0 = !{!"function_entry_count", i64 100}
+!1 = !{!"branch_weights", i32 90, i32 10}
@@ -0,0 +1,64 @@
+; Trace metrics come out as analysis remarks of trace-formation, one per
+; trace and one per function, and as the -trace-stats-json summary.
+; RUN: %opt -passes=profile -pass-remarks-analysis=trace-formation -trace-stats-json=%t.json %s \
+; RUN:   -o /dev/null 2>&1 | FileCheck %s --check-prefix=REMARK
+; RUN: FileCheck %s --check-prefix=JSON < %t.json
+; RUN: %opt -passes=profile -pass-remarks-output=%t.yaml %s -o /dev/null 2>/dev/null
+; RUN: FileCheck %s --check-prefix=YAML < %t.yaml
+
+; REMARK: remark: {{.*}} trace of 3 blocks, 7 instructions, 1 hazard blocks (return 1), entered 100 times, completes 0.890, ends at hazard (hotness: 100)
+; REMARK: remark: {{.*}} 1 traces of 3 blocks, 7 instructions, 1 hazard blocks, average completion 0.890 (hotness: 100)
+
+; JSON:      "version": 1,
+; JSON:      "averageCompletion": 0.89
+; JSON-NEXT: "blocks": 3,
+; JSON-NEXT: "function": "f",
+; JSON-NEXT: "hazards": 1,
+; JSON-NEXT: "instructions": 7,
+; JSON:      "blocks": 3,
+; JSON-NEXT: "end": "hazard",
+; JSON-NEXT: "entryCount": 100,
+; JSON-NEXT: "hazards": 1,
+; JSON-NEXT: "hazardsByKind": {
+; JSON-NEXT:   "call": 0,
+; JSON-NEXT:   "indirectJump": 0,
+; JSON-NEXT:   "return": 1,
+; JSON-NEXT:   "store": 0,
+; JSON-NEXT:   "sync": 0
+; JSON-NEXT: },
+; JSON-NEXT: "head": "entry",
+; JSON-NEXT: "instructions": 7,
+; JSON-NEXT: "predictedCompletion": 0.89
+; JSON:      "traces": 1
+
+; YAML:      --- !Analysis
+; YAML-NEXT: Pass: trace-formation
+; YAML-NEXT: Name: Trace
+; YAML-NEXT: Function: f
+; YAML-NEXT: Hotness: 100
+; YAML:      - End: hazard
+; YAML:      --- !Analysis
+; YAML-NEXT: Pass: trace-formation
+; YAML-NEXT: Name: TraceSummary
+; YAML:      - AverageCompletion: '0.890'
+
+declare void @h()
+
+define i32 @f(i32 %x) !prof !0 {
+entry:
+  %c = icmp sgt i32 %x, 0
+  br i1 %c, label %hot, label %cold, !prof !1
+hot:
+  %y = add i32 %x, 1
+  br label %next
+cold:
+  call void @h()
+  br label %next
+next:
+  %p = phi i32 [ %y, %hot ], [ 0, %cold ]
+  %z = mul i32 %p, 3
+  ret i32 %z
+}
+
+!0 = !{!"function_entry_count", i64 100}
+!1 = !{!"branch_weights", i32 90, i32 10}